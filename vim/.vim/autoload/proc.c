@@ -3,9 +3,18 @@
  * FILE:   proc.c
  * AUTHOR: Yukihiro Nakadaira <http://yukihiro.nakadaira.googlepages.com/#vimproc> (original)
  *         Nico Raffo <nicoraffo@gmail.com> (modified)
+ *
+ * The binary is not under version control; build it next to this file
+ * whenever vimproc#version() changes:
+ *
+ *   gcc -W -O2 -Wall -Wno-unused -std=gnu99 -pedantic -shared -fPIC \
+ *       -o vimproc_linux64.so proc.c -lutil -pthread
  */
 
 #define _XOPEN_SOURCE 600
+#if defined __linux__
+# define _GNU_SOURCE
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,6 +26,7 @@
 #include <dlfcn.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <sys/stat.h>
 
 #if !defined __APPLE__
 # include <sys/types.h>
@@ -63,6 +73,7 @@ int forkpty(int *, char *, struct termios *, struct winsize *);
 /* for waitpid() */
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #if defined __NetBSD__
 #define WIFCONTINUED(x) (_WSTATUS(x) == _WSTOPPED && WSTOPSIG(x) == 0x13)
 #elif defined __ANDROID__
@@ -78,8 +89,53 @@ int forkpty(int *, char *, struct termios *, struct winsize *);
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+
+/* for inotify */
+#if defined __linux__
+# include <sys/inotify.h>
+# include <sys/vfs.h>
+#endif
+
+/* for mmap() */
+#include <sys/mman.h>
+#include <pthread.h>
+#include <setjmp.h>
+#if defined __linux__
+# define vp_madvise(addr, len, advice) madvise(addr, len, MADV_##advice)
+#else
+# define vp_madvise(addr, len, advice) posix_madvise(addr, len, POSIX_MADV_##advice)
+#endif
+
+/* for vp_iconv() */
+#include <iconv.h>
+#include <langinfo.h>
+
+/* for vp_file_read_until() */
+#include <regex.h>
+#include <time.h>
+
+/* for spawn options */
+#if defined __linux__
+# include <sched.h>
+# include <sys/syscall.h>
+#endif
 
 #include "vimstack.c"
+#include "vimparser.c"
+#include "vimterm.c"
+#include "vimsession.c"
+#include "vimhttp.c"
+
+/* for environ */
+#if defined __APPLE__
+# include <crt_externs.h>
+# define environ (*_NSGetEnviron())
+#else
+extern char **environ;
+#endif
 
 const int debug = 0;
 
@@ -91,34 +147,115 @@ const char *vp_dlversion(char *args);   /* [version] () */
 const char *vp_file_open(char *args);   /* [fd] (path, flags, mode) */
 const char *vp_file_close(char *args);  /* [] (fd) */
 const char *vp_file_read(char *args);   /* [hd, eof] (fd, nr, timeout) */
+/* [eof, nlines, lines] or [eof, -1, line, ...] (fd, nr, timeout) */
+const char *vp_file_read_lines(char *args);
+/* [hd, matched, eof] (fd, pattern, timeout, unread_hd) */
+const char *vp_file_read_until(char *args);
 const char *vp_file_write(char *args);  /* [nleft] (fd, hd, timeout) */
+const char *vp_file_writev(char *args); /* [nleft] (fd, timeout, [hd]) */
+
+const char *vp_mmap_open(char *args);   /* [fd, size] (path) */
+const char *vp_mmap_close(char *args);  /* [] (fd) */
+const char *vp_mmap_nlines(char *args); /* [nlines] (fd) */
+const char *vp_mmap_lines(char *args);  /* [nr, hd] (fd, lnum, count) */
+
+const char *vp_follow_open(char *args); /* [fd] (path, from_end) */
+const char *vp_follow_close(char *args);/* [] (fd) */
+const char *vp_follow_read(char *args); /* [hd, event] (fd, nr, timeout) */
 
+const char *vp_watch_add(char *args);   /* [] (path) */
+const char *vp_watch_remove(char *args);/* [] (path) */
+const char *vp_watch_poll(char *args);  /* [path, ...] (timeout) */
+
+/* Spawn options follow argv as [name, value] pairs: cwd, env ("NAME=value"
+ * or "NAME" to unset; repeatable), nice, ioprio, sched, affinity,
+ * rlimit_as, rlimit_cpu, rlimit_nofile and termios (vp_pty_open() only;
+ * see vp_termios_parse()). */
 const char *vp_pipe_open(char *args);   /* [pid, [fd] * npipe]
-                                           (npipe, hstdin, hstdout, hstderr, argc, [argv]) */
+                                           (npipe, hstdin, hstdout, hstderr, argc, [argv], [opts]) */
 const char *vp_pipe_close(char *args);  /* [] (fd) */
 const char *vp_pipe_read(char *args);   /* [hd, eof] (fd, nr, timeout) */
 const char *vp_pipe_write(char *args);  /* [nleft] (fd, hd, timeout) */
 
 const char *vp_pty_open(char *args);
 /* [pid, stdin, stdout, stderr]
-   (npipe, width, height,hstdin, hstdout, hstderr, argc, [argv]) */
+   (npipe, width, height,hstdin, hstdout, hstderr, argc, [argv], [opts]) */
 const char *vp_pty_close(char *args);   /* [] (fd) */
 const char *vp_pty_read(char *args);    /* [hd, eof] (fd, nr, timeout) */
 const char *vp_pty_write(char *args);   /* [nleft] (fd, hd, timeout) */
 const char *vp_pty_get_winsize(char *args); /* [width, height] (fd) */
 const char *vp_pty_set_winsize(char *args); /* [] (fd, width, height) */
+const char *vp_pty_set_mode(char *args);    /* [] (fd, termios) */
+/* [] (fd, bufsize, interval, term); bufsize 0 stops coalescing */
+const char *vp_pty_coalesce(char *args);
+const char *vp_pty_read_frame(char *args); /* [hd, dropped, eof] (fd, timeout) */
+
+const char *vp_term_open(char *args);   /* [id] (cols, rows, scrollback) */
+const char *vp_term_close(char *args);  /* [] (id) */
+const char *vp_term_resize(char *args); /* [] (id, cols, rows) */
+const char *vp_term_read(char *args);   /* [eof, nread] (id, fd, timeout) */
+const char *vp_term_feed(char *args);   /* [reply_hd] (id, hd) */
+/* [cursor_row, cursor_col, cursor_visible, title, nscrolled,
+    [row, text, runs] * ndirty] (id) */
+const char *vp_term_damage(char *args);
+const char *vp_term_lines(char *args);  /* [[text, runs] * n] (id, start, count) */
 
 const char *vp_kill(char *args);        /* [] (pid, sig) */
 const char *vp_waitpid(char *args);     /* [cond, status] (pid) */
+/* [cond, status, utime, stime, maxrss, nvcsw, nivcsw, wall] (pid) */
+const char *vp_waitpid_rusage(char *args);
+
+/* [status, output] (cmdline, cwd, timeout) */
+const char *vp_shell_exec(char *args);
+
+const char *vp_jobs_set_max(char *args);/* [] (max) */
+/* [id, ...] (priority, cwd, njob, [argc, [argv]] * njob) */
+const char *vp_jobs_submit(char *args);
+/* [[id, status, dropped, output] * ndone, npending, nrunning] (timeout) */
+const char *vp_jobs_poll(char *args);
 
-const char *vp_socket_open(char *args); /* [socket] (host, port) */
+const char *vp_socket_open(char *args); /* [socket] (host, port, [timeout]) */
 const char *vp_socket_close(char *args);/* [] (socket) */
 const char *vp_socket_read(char *args); /* [hd, eof] (socket, nr, timeout) */
 const char *vp_socket_write(char *args);/* [nleft] (socket, hd, timeout) */
+const char *vp_socket_writev(char *args); /* [nleft] (socket, timeout, [hd]) */
+/* [value] (socket, name, value); the value read back */
+const char *vp_socket_setopt(char *args);
+/* [socket] (host or path, port, backlog); a path starts with "/" */
+const char *vp_socket_listen(char *args);
+/* [[socket, peer, uid, pid] * n] (socket, max, timeout) */
+const char *vp_socket_accept(char *args);
+
+/* [[status, reason_hd, nheader, [name_hd, value_hd] * nheader, body_hd] * n]
+   (host, port, timeout, maxsize, n,
+    [method, path, nheader, [name, value] * nheader, body] * n) */
+const char *vp_http_request(char *args);
 
 const char *vp_host_exists(char *args); /* [int] (host) */
+const char *vp_resolve_start(char *args); /* [id] (host) */
+/* ["run"] or ["ok", addr, ...] or ["fail", message] (id, timeout) */
+const char *vp_resolve_poll(char *args);
+const char *vp_resolve_close(char *args); /* [] (id) */
+
+/* [id, pid] (socket, name, cols, rows, cwd, argc, [argv]) */
+const char *vp_session_open(char *args);
+/* [[id, name, pid, status, end] * n] (socket) */
+const char *vp_session_list(char *args);
+/* [fd, start, end] (socket, id, since) */
+const char *vp_session_attach(char *args);
+/* [] (socket, "resize", id, cols, rows), (socket, "kill", id, sig) or
+ * (socket, "close", id) */
+const char *vp_session_control(char *args);
 
 const char *vp_decode(char *args);      /* [decoded_str] (encode_str) */
+/* [changed, str] (str, from, to, newline) */
+const char *vp_iconv(char *args);
+
+const char *vp_which(char *args);       /* [path, ...] (path, name, ...) */
+
+/* [condition, ncmd, [stdin, stdout, stderr, argc, [argv]] * ncmd] * nstatement
+ * (cmdline) */
+const char *vp_parse_cmdline(char *args);
 
 const char *vp_get_signals(char *args); /* [signals] () */
 /* --- */
@@ -140,6 +277,406 @@ close_fds(int fds[3][2])
     }
 }
 
+/*
+ * Close every descriptor from lowfd up in a forked child, so that a
+ * long-lived child does not keep the pipes of other processes open.
+ */
+static void
+vp_close_from(int lowfd)
+{
+    long fd, maxfd;
+
+#if defined __linux__ && defined SYS_close_range
+    if (syscall(SYS_close_range, (unsigned int)lowfd, ~0U, 0) == 0)
+        return;
+#endif
+    maxfd = sysconf(_SC_OPEN_MAX);
+    if (maxfd < 0 || maxfd > 65536)
+        maxfd = 65536;
+    for (fd = lowfd; fd < maxfd; ++fd)
+        close((int)fd);
+}
+
+/*
+ * Executable table for vp_which() and bare command names in
+ * vp_pipe_open()/vp_pty_open().
+ *
+ * Every absolute directory of $PATH is scanned once and its executables
+ * are stored in a hash table (the first directory wins, like execvp()).
+ * The table is rebuilt when $PATH changes or a directory is modified.
+ * On Linux the directories are watched by inotify, so a lookup costs no
+ * system call until something changes.  Elsewhere the directory mtimes
+ * are compared and a miss is double-checked by probing the directories.
+ */
+#define VP_WHICH_NBUCKETS 4096
+
+typedef struct vp_which_ent_t {
+    struct vp_which_ent_t *next;
+    unsigned int hash;
+    size_t dir;             /* index of vp_which_dirs */
+    char name[1];
+} vp_which_ent_t;
+
+typedef struct vp_which_dir_t {
+    char *path;
+    time_t mtime;
+    int relative;           /* depends on cwd: never cached */
+} vp_which_dir_t;
+
+static char *vp_which_path = NULL;
+static vp_which_dir_t *vp_which_dirs = NULL;
+static size_t vp_which_ndirs = 0;
+static vp_which_ent_t *vp_which_table[VP_WHICH_NBUCKETS];
+static int vp_which_stale = 1;
+#if defined __linux__
+static int vp_which_ifd = -1;
+#endif
+
+static unsigned int
+vp_which_hash(const char *name)
+{
+    unsigned int h = 2166136261U;
+
+    for (; *name != '\0'; ++name)
+        h = (h ^ (unsigned char)*name) * 16777619U;
+    return h;
+}
+
+static int
+is_executable(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode)
+        && access(path, X_OK) == 0;
+}
+
+static void
+vp_which_clear(void)
+{
+    size_t i;
+
+    for (i = 0; i < VP_WHICH_NBUCKETS; ++i) {
+        while (vp_which_table[i] != NULL) {
+            vp_which_ent_t *ent = vp_which_table[i];
+
+            vp_which_table[i] = ent->next;
+            free(ent);
+        }
+    }
+    for (i = 0; i < vp_which_ndirs; ++i)
+        free(vp_which_dirs[i].path);
+    free(vp_which_dirs);
+    free(vp_which_path);
+    vp_which_dirs = NULL;
+    vp_which_ndirs = 0;
+    vp_which_path = NULL;
+#if defined __linux__
+    if (vp_which_ifd != -1) {
+        /* Closing the instance drops all the watches. */
+        close(vp_which_ifd);
+        vp_which_ifd = -1;
+    }
+#endif
+}
+
+static vp_which_ent_t *
+vp_which_find(const char *name, unsigned int hash)
+{
+    vp_which_ent_t *ent;
+
+    for (ent = vp_which_table[hash % VP_WHICH_NBUCKETS];
+            ent != NULL; ent = ent->next) {
+        if (ent->hash == hash && strcmp(ent->name, name) == 0)
+            return ent;
+    }
+    return NULL;
+}
+
+static void
+vp_which_scan(size_t n)
+{
+    DIR *dir;
+    struct dirent *dp;
+    struct stat st;
+    char buf[4096];
+    const char *path = (vp_which_dirs[n].path[0] == '\0')
+        ? "/" : vp_which_dirs[n].path;
+
+    if (stat(path, &st) == 0)
+        vp_which_dirs[n].mtime = st.st_mtime;
+    if ((dir = opendir(path)) == NULL)
+        return;
+    for (dp = readdir(dir); dp != NULL; dp = readdir(dir)) {
+        unsigned int hash;
+        vp_which_ent_t *ent;
+
+        if (dp->d_name[0] == '.' && (dp->d_name[1] == '\0'
+                    || (dp->d_name[1] == '.' && dp->d_name[2] == '\0')))
+            continue;
+        hash = vp_which_hash(dp->d_name);
+        if (vp_which_find(dp->d_name, hash) != NULL)
+            continue;
+        snprintf(buf, sizeof(buf), "%s/%s",
+                vp_which_dirs[n].path, dp->d_name);
+        if (!is_executable(buf))
+            continue;
+        ent = malloc(offsetof(vp_which_ent_t, name) + strlen(dp->d_name) + 1);
+        if (ent == NULL)
+            break;
+        ent->hash = hash;
+        ent->dir = n;
+        strcpy(ent->name, dp->d_name);
+        ent->next = vp_which_table[hash % VP_WHICH_NBUCKETS];
+        vp_which_table[hash % VP_WHICH_NBUCKETS] = ent;
+    }
+    closedir(dir);
+}
+
+static const char *
+vp_which_build(const char *path)
+{
+    const char *p, *q;
+    size_t i, n;
+
+    vp_which_clear();
+    if ((vp_which_path = strdup(path)) == NULL)
+        return "vp_which: NOMEM";
+    for (n = 1, p = path; *p != '\0'; ++p) {
+        if (*p == ':')
+            ++n;
+    }
+    if ((vp_which_dirs = calloc(n, sizeof(vp_which_dir_t))) == NULL)
+        return "vp_which: NOMEM";
+#if defined __linux__
+    vp_which_ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    for (p = path; ; p = q + 1) {
+        size_t len;
+
+        q = strchr(p, ':');
+        len = (q == NULL) ? strlen(p) : (size_t)(q - p);
+        /* Strip trailing slashes, but keep "/" itself. */
+        while (len > 1 && p[len - 1] == '/')
+            --len;
+        if ((vp_which_dirs[vp_which_ndirs].path = malloc(len + 2)) == NULL)
+            return "vp_which: NOMEM";
+        if (len == 0)
+            strcpy(vp_which_dirs[vp_which_ndirs].path, ".");
+        else if (len == 1 && p[0] == '/')
+            vp_which_dirs[vp_which_ndirs].path[0] = '\0';
+        else {
+            memcpy(vp_which_dirs[vp_which_ndirs].path, p, len);
+            vp_which_dirs[vp_which_ndirs].path[len] = '\0';
+        }
+        vp_which_dirs[vp_which_ndirs].relative = (len == 0 || p[0] != '/');
+        ++vp_which_ndirs;
+        if (q == NULL)
+            break;
+    }
+    for (i = 0; i < vp_which_ndirs; ++i) {
+        if (vp_which_dirs[i].relative)
+            continue;
+#if defined __linux__
+        if (vp_which_ifd != -1)
+            inotify_add_watch(vp_which_ifd,
+                    vp_which_dirs[i].path[0] == '\0' ? "/" : vp_which_dirs[i].path,
+                    IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM
+                    | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+#endif
+        vp_which_scan(i);
+    }
+    vp_which_stale = 0;
+    return NULL;
+}
+
+/* Rebuild the table if $PATH or one of its directories has changed. */
+static const char *
+vp_which_update(const char *path)
+{
+    if (!vp_which_stale && vp_which_path != NULL
+            && strcmp(vp_which_path, path) == 0) {
+#if defined __linux__
+        if (vp_which_ifd != -1) {
+            char buf[4096];
+
+            while (read(vp_which_ifd, buf, sizeof(buf)) > 0)
+                vp_which_stale = 1;
+        } else
+#endif
+        {
+            struct stat st;
+            size_t i;
+
+            for (i = 0; i < vp_which_ndirs; ++i) {
+                if (vp_which_dirs[i].relative)
+                    continue;
+                if (stat(vp_which_dirs[i].path[0] == '\0'
+                            ? "/" : vp_which_dirs[i].path, &st) != 0
+                        || st.st_mtime != vp_which_dirs[i].mtime) {
+                    vp_which_stale = 1;
+                    break;
+                }
+            }
+        }
+        if (!vp_which_stale)
+            return NULL;
+    }
+    return vp_which_build(path);
+}
+
+/* buf = cwd/dir/name ("." is omitted) */
+static int
+join_cwd(char *buf, size_t size, const char *dir, const char *name)
+{
+    size_t len;
+
+    if (getcwd(buf, size) == NULL)
+        return -1;
+    len = strlen(buf);
+    while (name[0] == '.' && name[1] == '/')
+        name += 2;
+    if (strcmp(dir, ".") == 0)
+        snprintf(buf + len, size - len, "/%s", name);
+    else
+        snprintf(buf + len, size - len, "/%s/%s", dir, name);
+    return 0;
+}
+
+/* Resolve name to buf.  Returns 0 on success, -1 if not found. */
+static int
+vp_which_lookup(const char *path, const char *name, char *buf, size_t size)
+{
+    vp_which_ent_t *ent;
+    size_t i;
+    int watched = 0;
+
+    if (name[0] == '\0')
+        return -1;
+    if (strchr(name, '/') != NULL) {
+        if (name[0] == '/')
+            snprintf(buf, size, "%s", name);
+        else if (join_cwd(buf, size, ".", name) != 0)
+            return -1;
+        return is_executable(buf) ? 0 : -1;
+    }
+
+    if (vp_which_update(path) != NULL)
+        return -1;
+
+    ent = vp_which_find(name, vp_which_hash(name));
+#if defined __linux__
+    watched = (vp_which_ifd != -1);
+#endif
+    for (i = 0; i < vp_which_ndirs; ++i) {
+        vp_which_dir_t *dir = &vp_which_dirs[i];
+
+        if (ent != NULL && ent->dir == i) {
+            snprintf(buf, size, "%s/%s", dir->path, name);
+            return 0;
+        }
+        /* Relative directories always, the others only to confirm a miss. */
+        if (!dir->relative && (ent != NULL || watched))
+            continue;
+        if (dir->relative) {
+            if (join_cwd(buf, size, dir->path, name) != 0)
+                continue;
+        } else {
+            snprintf(buf, size, "%s/%s", dir->path, name);
+        }
+        if (is_executable(buf))
+            return 0;
+    }
+    return -1;
+}
+
+/* Pop argc arguments for execv(). */
+static const char *
+pop_argv(vp_stack_t *stack, int argc, char ***argvp)
+{
+    char **argv;
+    int i;
+
+    if (argc < 1)
+        return vp_stack_return_error(&_result, "argc range error.");
+    argv = malloc(sizeof(char *) * (argc+1));
+    if (argv == NULL)
+        return vp_stack_return_error(&_result, "malloc() error: %s",
+                strerror(errno));
+    for (i = 0; i < argc; ++i) {
+        const char *err = vp_stack_pop_str(stack, &(argv[i]));
+        if (err != NULL) {
+            free(argv);
+            return err;
+        }
+    }
+    argv[argc] = NULL;
+    *argvp = argv;
+    return NULL;
+}
+
+/* Is a directory of $PATH relative? */
+static int
+path_has_relative(const char *envpath)
+{
+    const char *p;
+
+    for (p = envpath; ; ++p) {
+        if (*p != '/')
+            return 1;
+        if ((p = strchr(p, ':')) == NULL)
+            return 0;
+    }
+}
+
+/*
+ * Resolve the command name to path for a child which starts in cwd ("" for
+ * ours) with $PATH envpath (NULL for ours).  A name with a slash is left
+ * to execv(), which the child calls after changing the directory.
+ */
+static const char *
+resolve_argv0(const char *name, const char *cwd, const char *envpath,
+        char *path, size_t size)
+{
+    char buf[4096];
+    const char *p, *q;
+    int len;
+
+    if (strchr(name, '/') != NULL) {
+        snprintf(path, size, "%s", name);
+        return NULL;
+    }
+    if (envpath == NULL) {
+        if ((envpath = getenv("PATH")) == NULL)
+            envpath = "";
+        /* The table is for our own directory and $PATH. */
+        if (*cwd == '\0' || !path_has_relative(envpath))
+            return vp_which_lookup(envpath, name, path, size) == 0 ? NULL
+                : vp_stack_return_error(&_result, "command not found: %s",
+                        name);
+    }
+    if (*name != '\0') {
+        for (p = envpath; ; p = q + 1) {
+            q = strchr(p, ':');
+            len = (q == NULL) ? (int)strlen(p) : (int)(q - p);
+            if (len == 0)
+                snprintf(path, size, "./%s", name);
+            else
+                snprintf(path, size, "%.*s/%s", len, p, name);
+            /* A relative directory is relative to cwd. */
+            if (*path != '/' && *cwd != '\0')
+                snprintf(buf, sizeof(buf), "%s/%s", cwd, path);
+            else
+                snprintf(buf, sizeof(buf), "%s", path);
+            if (is_executable(buf))
+                return NULL;
+            if (q == NULL)
+                break;
+        }
+    }
+    return vp_stack_return_error(&_result, "command not found: %s", name);
+}
+
 const char *
 vp_dlopen(char *args)
 {
@@ -157,6 +694,8 @@ vp_dlopen(char *args)
     return vp_stack_return(&_result);
 }
 
+static int vp_threads_stop(void);
+
 const char *
 vp_dlclose(char *args)
 {
@@ -166,6 +705,9 @@ vp_dlclose(char *args)
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
     VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%p", &handle));
 
+    /* Stay loaded while a thread of ours still runs. */
+    if (vp_threads_stop() < 0)
+        return NULL;
     /* On FreeBSD6, to call dlclose() twice with same pointer causes SIGSEGV */
     if (dlclose(handle) == -1)
         return dlerror();
@@ -176,7 +718,7 @@ vp_dlclose(char *args)
 const char *
 vp_dlversion(char *args)
 {
-    vp_stack_push_num(&_result, "%2d%02d", 8, 0);
+    vp_stack_push_num(&_result, "%2d%02d", 8, 3);
     return vp_stack_return(&_result);
 }
 
@@ -264,6 +806,104 @@ vp_file_open(char *args)
     return vp_stack_return(&_result);
 }
 
+/*
+ * Line framer for vp_file_read_lines().
+ * The trailing partial line of a fd is kept here until its newline
+ * arrives.  vp_file_read() returns it first, and vp_file_close() drops it.
+ * vp_file_read_until() keeps the bytes before a match here too.
+ */
+typedef struct vp_lines_t {
+    struct vp_lines_t *next;
+    int fd;
+    char *buf;
+    size_t len;
+    size_t size;
+    size_t scanned;     /* vp_file_read_until() resumes from here */
+} vp_lines_t;
+
+static vp_lines_t *vp_lines_list = NULL;
+
+static vp_lines_t *
+vp_lines_find(int fd, int create)
+{
+    vp_lines_t *l;
+
+    for (l = vp_lines_list; l != NULL; l = l->next) {
+        if (l->fd == fd)
+            return l;
+    }
+    if (!create || (l = calloc(1, sizeof(vp_lines_t))) == NULL)
+        return NULL;
+    l->fd = fd;
+    l->next = vp_lines_list;
+    vp_lines_list = l;
+    return l;
+}
+
+static void
+vp_lines_free(int fd)
+{
+    vp_lines_t **prev, *l;
+
+    for (prev = &vp_lines_list; *prev != NULL; prev = &(*prev)->next) {
+        if ((*prev)->fd == fd) {
+            l = *prev;
+            *prev = l->next;
+            free(l->buf);
+            free(l);
+            return;
+        }
+    }
+}
+
+static const char *
+vp_lines_append(vp_lines_t *l, const char *buf, size_t len)
+{
+    if (l->len + len > l->size) {
+        size_t newsize = (l->size == 0) ? VP_READ_BUFSIZE : l->size;
+        char *newbuf;
+
+        while (l->len + len > newsize)
+            newsize *= 2;
+        if ((newbuf = realloc(l->buf, newsize)) == NULL)
+            return "vp_lines_append: NOMEM";
+        l->buf = newbuf;
+        l->size = newsize;
+    }
+    memcpy(l->buf + l->len, buf, len);
+    l->len += len;
+    return NULL;
+}
+
+/* Push a line.  NUL is "\n" like in Vim buffers.  Lines which libcall()
+ * cannot carry are sent as VP_RAW and hex. */
+static const char *
+vp_lines_push(vp_stack_t *stack, const char *line, size_t len)
+{
+    size_t i;
+    char *p;
+
+    if (memchr(line, VP_EOV, len) != NULL || (len > 0 && line[0] == VP_RAW)) {
+        VP_RETURN_IF_FAIL(vp_stack_push_bin(stack, line, len));
+        /* Insert VP_RAW before hex. */
+        VP_RETURN_IF_FAIL(vp_stack_reserve(stack,
+                    (stack->top - stack->buf) + 2));
+        p = stack->top - 1 - len * 2;
+        memmove(p + 1, p, len * 2 + 1);
+        *p = VP_RAW;
+        ++stack->top;
+        return NULL;
+    }
+    VP_RETURN_IF_FAIL(vp_stack_reserve(stack,
+                (stack->top - stack->buf) + len + sizeof(VP_EOV_STR)));
+    for (i = 0; i < len; ++i)
+        *(stack->top++) = (line[i] == '\0') ? '\n' : line[i];
+    *(stack->top++) = VP_EOV;
+    return NULL;
+}
+
+static void vp_coalesce_close(int fd);
+
 const char *
 vp_file_close(char *args)
 {
@@ -273,6 +913,8 @@ vp_file_close(char *args)
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
     VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
 
+    vp_coalesce_close(fd);
+    vp_lines_free(fd);
     if (close(fd) == -1)
         return vp_stack_return_error(&_result, "close() error: %s",
                 strerror(errno));
@@ -289,6 +931,7 @@ vp_file_read(char *args)
     int n;
     char buf[VP_READ_BUFSIZE];
     struct pollfd pfd = {0, POLLIN, 0};
+    vp_lines_t *lines;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
     VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
@@ -297,6 +940,18 @@ vp_file_read(char *args)
 
     pfd.fd = fd;
     vp_stack_push_str(&_result, ""); /* initialize */
+    if ((lines = vp_lines_find(fd, 0)) != NULL && lines->len > 0) {
+        /* The partial line of vp_file_read_lines() comes first. */
+        n = (nr > 0 && (size_t)nr < lines->len) ? nr : (int)lines->len;
+        _result.top--;
+        vp_stack_push_bin(&_result, lines->buf, n);
+        memmove(lines->buf, lines->buf + n, lines->len - n);
+        lines->len -= n;
+        lines->scanned = 0;
+        if (nr > 0)
+            nr -= n;
+        timeout = 0;
+    }
     while (nr != 0) {
         n = poll(&pfd, 1, timeout);
         if (n == -1) {
@@ -346,652 +1001,5432 @@ vp_file_read(char *args)
 }
 
 const char *
-vp_file_write(char *args)
+vp_file_read_lines(char *args)
 {
     vp_stack_t stack;
     int fd;
-    char *buf;
-    size_t size;
+    int nr;
     int timeout;
-    size_t nleft;
     int n;
-    struct pollfd pfd = {0, POLLOUT, 0};
+    int eof = 0;
+    char buf[VP_READ_BUFSIZE];
+    struct pollfd pfd = {0, POLLIN, 0};
+    vp_lines_t *lines;
+    char *p, *q, *nl, *end;
+    int joined;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
     VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
-    VP_RETURN_IF_FAIL(vp_stack_pop_bin(&stack, &buf, &size));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nr));
     VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
 
+    if ((lines = vp_lines_find(fd, 1)) == NULL)
+        return "vp_file_read_lines: NOMEM";
+
     pfd.fd = fd;
-    nleft = 0;
-    while (nleft < size) {
+    while (nr != 0) {
         n = poll(&pfd, 1, timeout);
         if (n == -1) {
-            return vp_stack_return_error(&_result, "poll() error: %s",
-                    strerror(errno));
+            eof = 1;
+            break;
         } else if (n == 0) {
             /* timeout */
             break;
         }
-        if (pfd.revents & POLLOUT) {
-            n = write(fd, buf + nleft, size - nleft);
+        if (pfd.revents & POLLIN) {
+            n = read(fd, buf, (nr > 0 && VP_READ_BUFSIZE > nr)
+                    ? nr : VP_READ_BUFSIZE);
             if (n == -1) {
-                return vp_stack_return_error(&_result, "write() error: %s",
+                return vp_stack_return_error(&_result, "read() error: %s",
                         strerror(errno));
+            } else if (n == 0) {
+                eof = 1;
+                break;
             }
-            nleft += n;
-            /* try write more bytes without waiting */
+            VP_RETURN_IF_FAIL(vp_lines_append(lines, buf, n));
+            if (nr > 0)
+                nr -= n;
+            /* try read more bytes without waiting */
             timeout = 0;
             continue;
         } else if (pfd.revents & (POLLERR | POLLHUP)) {
-            /* eof or error */
+            eof = 1;
             break;
         } else if (pfd.revents & POLLNVAL) {
             return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
                     pfd.revents);
         }
         /* DO NOT REACH HERE */
-        return vp_stack_return_error(&_result, "poll() unknown status: %s",
+        return vp_stack_return_error(&_result, "poll() unknown status: %d",
                 pfd.revents);
     }
-    vp_stack_push_num(&_result, "%zu", nleft);
+
+    vp_stack_push_num(&_result, "%d", eof);
+    end = lines->buf + lines->len;
+    q = end;
+    if (!eof) {
+        /* Keep the partial line. */
+        while (q > lines->buf && q[-1] != '\n')
+            --q;
+    }
+
+    /* Splitting many values is slow in Vim script.  Send the lines as a
+     * value joined with "\n" unless it cannot be carried. */
+    joined = (memchr(lines->buf, '\0', q - lines->buf) == NULL
+            && memchr(lines->buf, VP_EOV, q - lines->buf) == NULL);
+    if (joined) {
+        size_t nlines = (q > lines->buf && q[-1] != '\n') ? 1 : 0;
+
+        for (p = lines->buf; p < q; ++p)
+            nlines += (*p == '\n');
+        vp_stack_push_num(&_result, "%zu", nlines);
+        VP_RETURN_IF_FAIL(vp_stack_reserve(&_result, (_result.top - _result.buf)
+                    + (q - lines->buf) + sizeof(VP_EOV_STR)));
+    } else {
+        vp_stack_push_num(&_result, "%d", -1);
+    }
+
+    /* Split lines with "\r*\n".  At eof the last line may not end with
+     * newline. */
+    for (p = lines->buf; p < q; p = nl + 1) {
+        char *e;
+
+        if ((nl = memchr(p, '\n', q - p)) == NULL)
+            nl = q;
+        for (e = nl; e > p && e[-1] == '\r'; --e)
+            ;
+        if (joined) {
+            memcpy(_result.top, p, e - p);
+            _result.top += e - p;
+            *(_result.top++) = '\n';
+        } else {
+            VP_RETURN_IF_FAIL(vp_lines_push(&_result, p, e - p));
+        }
+    }
+    if (joined) {
+        if (_result.top[-1] == '\n')
+            _result.top[-1] = VP_EOV;   /* the last separator */
+        else
+            *(_result.top++) = VP_EOV;  /* no lines */
+    }
+
+    if (eof) {
+        vp_lines_free(fd);
+    } else if (q != lines->buf) {
+        memmove(lines->buf, q, end - q);
+        lines->len = end - q;
+        lines->scanned = 0;
+    }
     return vp_stack_return(&_result);
 }
 
+/* The last pattern of vp_file_read_until(). */
+static struct {
+    char *pattern;
+    regex_t re;
+} _until = {NULL};
+
+static long
+vp_msec_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Search buf[start, len).  start is always a line start. */
+static int
+vp_until_exec(vp_lines_t *l, size_t start, regmatch_t *m)
+{
+#ifdef REG_STARTEND
+    m->rm_so = start;
+    m->rm_eo = l->len;
+    return regexec(&_until.re, l->buf, 1, m, REG_STARTEND);
+#else
+    /* NUL in the data ends the search early. */
+    if (vp_lines_append(l, "", 1) != NULL)
+        return REG_ESPACE;
+    l->len--;
+    if (regexec(&_until.re, l->buf + start, 1, m, 0) != 0)
+        return REG_NOMATCH;
+    m->rm_so += start;
+    m->rm_eo += start;
+    return 0;
+#endif
+}
+
+/*
+ * Read until the POSIX extended regex matches, and return the bytes up to
+ * and including the match.  "^" and "$" match at newlines.  Only the data
+ * from the last line on is searched again as bytes arrive, so a match
+ * cannot start in a line which was already complete.  On timeout nothing
+ * is returned and the data waits for the next call; at eof the rest is
+ * returned unmatched.  unread_hd is put back in front of the data.
+ */
 const char *
-vp_pipe_open(char *args)
+vp_file_read_until(char *args)
 {
-#define VP_GOTO_ERROR(_fmt) do { errfmt = (_fmt); goto error; } while(0)
     vp_stack_t stack;
-    int npipe, hstdin, hstderr, hstdout;
-    int argc;
-    int fd[3][2] = {{0}};
-    pid_t pid;
-    int dummy;
-    char *errfmt;
+    int fd;
+    char *pattern;
+    int timeout;
+    long deadline;
+    int n;
+    int eof = 0;
+    int matched = 0;
+    size_t size;
+    char buf[VP_READ_BUFSIZE];
+    struct pollfd pfd = {0, POLLIN, 0};
+    vp_lines_t *lines;
+    regmatch_t m;
+    char *p;
+    char *unread;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &npipe));
-    if (npipe != 2 && npipe != 3)
-        return vp_stack_return_error(&_result, "npipe range error. wrong pipes.");
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstdin));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstdout));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstderr));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &pattern));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+    VP_RETURN_IF_FAIL(vp_stack_pop_bin(&stack, &unread, &size));
 
-    if (hstdin > 0) {
-        fd[0][0] = hstdin;
-        fd[0][1] = 0;
-    } else {
-        if (pipe(fd[0]) < 0) {
-            VP_GOTO_ERROR("pipe() error: %s");
+    if (_until.pattern == NULL || strcmp(_until.pattern, pattern) != 0) {
+        if (_until.pattern != NULL) {
+            regfree(&_until.re);
+            free(_until.pattern);
+            _until.pattern = NULL;
         }
-    }
-    if (hstdout > 0) {
-        fd[1][1] = hstdout;
-        fd[1][0] = 0;
-    } else {
-        if (pipe(fd[1]) < 0) {
-            VP_GOTO_ERROR("pipe() error: %s");
+        n = regcomp(&_until.re, pattern, REG_EXTENDED | REG_NEWLINE);
+        if (n != 0) {
+            regerror(n, &_until.re, buf, sizeof(buf));
+            return vp_stack_return_error(&_result, "regcomp() error: %s",
+                    buf);
+        }
+        if ((_until.pattern = strdup(pattern)) == NULL) {
+            regfree(&_until.re);
+            return "vp_file_read_until: NOMEM";
         }
     }
-    if (hstderr > 0) {
-        fd[2][1] = hstderr;
-        fd[2][0] = 0;
-    } else if (npipe == 3 && hstderr == 0) {
-        if (pipe(fd[2]) < 0) {
-            VP_GOTO_ERROR("pipe() error: %s");
+    if ((lines = vp_lines_find(fd, 1)) == NULL)
+        return "vp_file_read_until: NOMEM";
+    if (size > 0) {
+        VP_RETURN_IF_FAIL(vp_lines_append(lines, unread, size));
+        memmove(lines->buf + size, lines->buf, lines->len - size);
+        memcpy(lines->buf, unread, size);
+        lines->scanned = 0;
+    }
+
+    pfd.fd = fd;
+    deadline = vp_msec_now() + timeout;
+    for (;;) {
+        if (lines->scanned < lines->len) {
+            n = vp_until_exec(lines, lines->scanned, &m);
+            if (n == 0) {
+                matched = 1;
+                break;
+            }
+            if (n != REG_NOMATCH)
+                return "vp_file_read_until: NOMEM";
+            /* Resume from the last line next time. */
+            for (p = lines->buf + lines->len;
+                    p > lines->buf + lines->scanned && p[-1] != '\n'; --p)
+                ;
+            lines->scanned = p - lines->buf;
+        }
+        if (eof)
+            break;
+
+        n = poll(&pfd, 1, (timeout < 0) ? -1 : (int)(deadline > vp_msec_now()
+                    ? deadline - vp_msec_now() : 0));
+        if (n == -1) {
+            eof = 1;
+        } else if (n == 0) {
+            /* timeout */
+            break;
+        } else if (pfd.revents & POLLIN) {
+            n = read(fd, buf, VP_READ_BUFSIZE);
+            if (n == -1)
+                return vp_stack_return_error(&_result, "read() error: %s",
+                        strerror(errno));
+            else if (n == 0)
+                eof = 1;
+            else
+                VP_RETURN_IF_FAIL(vp_lines_append(lines, buf, n));
+        } else if (pfd.revents & (POLLERR | POLLHUP)) {
+            eof = 1;
+        } else {
+            return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
+                    pfd.revents);
         }
     }
 
-    pid = fork();
-    if (pid < 0) {
-        VP_GOTO_ERROR("fork() error: %s");
-    } else if (pid == 0) {
-        /* child */
-        char **argv;
-        int i;
+    if (matched)
+        size = m.rm_eo;
+    else
+        size = eof ? lines->len : 0;
+    vp_stack_push_bin(&_result, lines->buf, size);
+    vp_stack_push_num(&_result, "%d", matched);
+    /* The rest after a match is read by the next call. */
+    vp_stack_push_num(&_result, "%d", eof && !matched);
+    if (eof && !matched) {
+        vp_lines_free(fd);
+    } else if (size > 0) {
+        memmove(lines->buf, lines->buf + size, lines->len - size);
+        lines->len -= size;
+        lines->scanned = 0;
+    }
+    return vp_stack_return(&_result);
+}
 
-        /* Set process group. */
-        setpgid(0, 0);
+const char *
+vp_file_write(char *args)
+{
+    vp_stack_t stack;
+    int fd;
+    char *buf;
+    size_t size;
+    int timeout;
+    size_t nleft;
+    int n;
+    struct pollfd pfd = {0, POLLOUT, 0};
 
-        if (fd[0][1] > 0) {
-            close(fd[0][1]);
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_bin(&stack, &buf, &size));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    pfd.fd = fd;
+    nleft = 0;
+    while (nleft < size) {
+        n = poll(&pfd, 1, timeout);
+        if (n == -1) {
+            return vp_stack_return_error(&_result, "poll() error: %s",
+                    strerror(errno));
+        } else if (n == 0) {
+            /* timeout */
+            break;
         }
-        if (fd[1][0] > 0) {
-            close(fd[1][0]);
+        if (pfd.revents & POLLOUT) {
+            n = write(fd, buf + nleft, size - nleft);
+            if (n == -1) {
+                return vp_stack_return_error(&_result, "write() error: %s",
+                        strerror(errno));
+            }
+            nleft += n;
+            /* try write more bytes without waiting */
+            timeout = 0;
+            continue;
+        } else if (pfd.revents & (POLLERR | POLLHUP)) {
+            /* eof or error */
+            break;
+        } else if (pfd.revents & POLLNVAL) {
+            return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
+                    pfd.revents);
         }
-        if (fd[2][0] > 0) {
-            close(fd[2][0]);
+        /* DO NOT REACH HERE */
+        return vp_stack_return_error(&_result, "poll() unknown status: %s",
+                pfd.revents);
+    }
+    vp_stack_push_num(&_result, "%zu", nleft);
+    return vp_stack_return(&_result);
+}
+
+/*
+ * vp_file_write() of many buffers with one writev() or sendmsg(), so
+ * that a header, a body and a trailer are one libcall and one syscall.
+ */
+#define VP_WRITEV_MAX   64
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL   0
+#endif
+#ifndef MSG_DONTWAIT
+# define MSG_DONTWAIT   0
+#endif
+
+static const char *
+vp_writev(char *args, int is_socket)
+{
+    vp_stack_t stack;
+    int fd;
+    int timeout;
+    struct iovec iov[VP_WRITEV_MAX];
+    int cnt = 0, i = 0;
+    size_t size;
+    size_t nleft;
+    ssize_t n;
+    struct msghdr msg;
+    struct pollfd pfd = {0, POLLOUT, 0};
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+    while (stack.top != stack.buf) {
+        char *buf;
+
+        if (cnt == VP_WRITEV_MAX)
+            return vp_stack_return_error(&_result, "too many buffers: %d",
+                    VP_WRITEV_MAX);
+        VP_RETURN_IF_FAIL(vp_stack_pop_bin(&stack, &buf, &size));
+        iov[cnt].iov_base = buf;
+        iov[cnt++].iov_len = size;
+    }
+
+    pfd.fd = fd;
+    nleft = 0;
+    while (i < cnt) {
+        if (iov[i].iov_len == 0) {
+            ++i;
+            continue;
         }
-        if (fd[0][0] > 0) {
-            if (dup2(fd[0][0], STDIN_FILENO) != STDIN_FILENO) {
-                goto child_error;
-            }
-            close(fd[0][0]);
+        n = poll(&pfd, 1, timeout);
+        if (n == -1) {
+            return vp_stack_return_error(&_result, "poll() error: %s",
+                    strerror(errno));
+        } else if (n == 0) {
+            /* timeout */
+            break;
         }
-        if (fd[1][1] > 0) {
-            if (dup2(fd[1][1], STDOUT_FILENO) != STDOUT_FILENO) {
-                goto child_error;
+        if (pfd.revents & POLLOUT) {
+            if (is_socket) {
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov + i;
+                msg.msg_iovlen = cnt - i;
+                /* A full send buffer must not outlast the timeout. */
+                n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            } else {
+                n = writev(fd, iov + i, cnt - i);
             }
-            close(fd[1][1]);
-        }
-        if (fd[2][1] > 0) {
-            if (dup2(fd[2][1], STDERR_FILENO) != STDERR_FILENO) {
-                goto child_error;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                continue;
+            } else if (n == -1) {
+                return vp_stack_return_error(&_result, "%s() error: %s",
+                        is_socket ? "sendmsg" : "writev", strerror(errno));
             }
-            close(fd[2][1]);
-        } else if (npipe == 2) {
-            if (dup2(STDOUT_FILENO, STDERR_FILENO) != STDERR_FILENO) {
-                goto child_error;
+            nleft += n;
+            /* skip what is written */
+            for (; i < cnt && (size_t)n >= iov[i].iov_len; ++i)
+                n -= iov[i].iov_len;
+            if (n > 0) {
+                iov[i].iov_base = (char *)iov[i].iov_base + n;
+                iov[i].iov_len -= n;
             }
+            /* try write more bytes without waiting */
+            timeout = 0;
+            continue;
+        } else if (pfd.revents & (POLLERR | POLLHUP)) {
+            /* eof or error */
+            break;
+        } else if (pfd.revents & POLLNVAL) {
+            return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
+                    pfd.revents);
         }
+        /* DO NOT REACH HERE */
+        return vp_stack_return_error(&_result, "poll() unknown status: %d",
+                pfd.revents);
+    }
+    vp_stack_push_num(&_result, "%zu", nleft);
+    return vp_stack_return(&_result);
+}
 
-        {
-#ifndef TIOCNOTTY
-            setsid();
-#else
-            /* Ignore tty. */
-            char name[L_ctermid];
-            if (ctermid(name)[0] != '\0') {
-                int tfd;
-                if ((tfd = open(name, O_RDONLY)) != -1) {
-                    ioctl(tfd, TIOCNOTTY, NULL);
-                    close(tfd);
+const char *
+vp_file_writev(char *args)
+{
+    return vp_writev(args, 0);
+}
+
+/*
+ * Memory mapped files for vp_mmap_*().
+ * The newline index keeps the offset of every VP_MMAP_STEP-th line, so
+ * a line is found with a binary search and a memchr() over at most
+ * 2 * VP_MMAP_STEP lines.  Files larger than VP_MMAP_CHUNK are indexed by
+ * threads, one chunk each.  Scanned pages are dropped with madvise(), so
+ * only the pages of the lines actually read stay resident.
+ */
+#define VP_MMAP_STEP        1024
+#define VP_MMAP_CHUNK       (64 * 1024 * 1024)
+#define VP_MMAP_MAX_THREADS 8
+#define VP_MMAP_DROP_SIZE   (8 * 1024 * 1024)
+
+typedef struct vp_mmap_mark_t {
+    size_t lnum;    /* 0-based line number */
+    size_t offset;  /* start of the line */
+} vp_mmap_mark_t;
+
+typedef struct vp_mmap_chunk_t {
+    const char *addr;
+    size_t begin;
+    size_t end;
+    size_t nnl;             /* newlines in the chunk */
+    vp_mmap_mark_t *marks;  /* lnum is relative to the chunk */
+    size_t nmarks;
+    int nomem;
+    int truncated;          /* the file shrank under the scan */
+    int running;            /* thread is joinable */
+    pthread_t thread;
+} vp_mmap_chunk_t;
+
+typedef struct vp_mmap_t {
+    struct vp_mmap_t *next;
+    int fd;
+    char *addr;
+    size_t size;
+    vp_mmap_chunk_t *chunks;
+    int nchunks;
+    int indexed;
+    int truncated;
+    vp_mmap_mark_t *marks;
+    size_t nmarks;
+    size_t nlines;
+} vp_mmap_t;
+
+static vp_mmap_t *vp_mmap_list = NULL;
+
+static void
+vp_mmap_drop(const char *addr, size_t begin, size_t end)
+{
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+
+    begin -= begin % pagesize;
+    if (end > begin)
+        vp_madvise((void *)(addr + begin), end - begin, DONTNEED);
+}
+
+static void
+vp_mmap_scan_chunk(vp_mmap_chunk_t *chunk)
+{
+    const char *p = chunk->addr + chunk->begin;
+    const char *end = chunk->addr + chunk->end;
+    const char *dropped = p;
+    size_t size = 0;
+
+    /* glibc memchr() is vectorized. */
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        ++p;
+        if (++chunk->nnl % VP_MMAP_STEP == 0) {
+            if (chunk->nmarks == size) {
+                vp_mmap_mark_t *marks;
+
+                size = (size == 0) ? 64 : size * 2;
+                marks = realloc(chunk->marks, size * sizeof(vp_mmap_mark_t));
+                if (marks == NULL) {
+                    chunk->nomem = 1;
+                    break;
                 }
+                chunk->marks = marks;
             }
-#endif
+            chunk->marks[chunk->nmarks].lnum = chunk->nnl;
+            chunk->marks[chunk->nmarks].offset = p - chunk->addr;
+            ++chunk->nmarks;
         }
-
-        argv = malloc(sizeof(char *) * (argc+1));
-        if (argv == NULL) {
-            goto child_error;
-        }
-        for (i = 0; i < argc; ++i) {
-            if (vp_stack_pop_str(&stack, &(argv[i]))) {
-                free(argv);
-                goto child_error;
-            }
+        if (p - dropped >= VP_MMAP_DROP_SIZE) {
+            vp_mmap_drop(chunk->addr, dropped - chunk->addr, p - chunk->addr);
+            dropped = p;
         }
-        argv[argc] = NULL;
+    }
+    vp_mmap_drop(chunk->addr, dropped - chunk->addr, chunk->end);
+}
 
-        execv(argv[0], argv);
-        /* error */
-        goto child_error;
+/*
+ * The pages past a new EOF raise SIGBUS, e.g. after copytruncate, and a
+ * check of the size could not keep up with memchr().  While chunks are
+ * scanned, SIGBUS jumps out of the scan of the faulting thread.
+ */
+static pthread_mutex_t vp_mmap_bus_lock = PTHREAD_MUTEX_INITIALIZER;
+static int vp_mmap_bus_users = 0;
+static struct sigaction vp_mmap_bus_old;
+static __thread sigjmp_buf *vp_mmap_bus_jmp;
+
+static void
+vp_mmap_bus(int sig)
+{
+    if (vp_mmap_bus_jmp != NULL)
+        siglongjmp(*vp_mmap_bus_jmp, 1);
+    /* Not in a scan: the fault repeats with the handler before ours. */
+    sigaction(SIGBUS, &vp_mmap_bus_old, NULL);
+}
+
+static void
+vp_mmap_bus_guard(int on)
+{
+    struct sigaction sa;
+
+    pthread_mutex_lock(&vp_mmap_bus_lock);
+    if (on && vp_mmap_bus_users++ == 0) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = vp_mmap_bus;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, &vp_mmap_bus_old);
+    } else if (!on && --vp_mmap_bus_users == 0) {
+        sigaction(SIGBUS, &vp_mmap_bus_old, NULL);
+    }
+    pthread_mutex_unlock(&vp_mmap_bus_lock);
+}
+
+static void *
+vp_mmap_scan(void *arg)
+{
+    vp_mmap_chunk_t *chunk = (vp_mmap_chunk_t *)arg;
+    sigjmp_buf jmp;
+
+    vp_mmap_bus_guard(1);
+    if (sigsetjmp(jmp, 1) == 0) {
+        vp_mmap_bus_jmp = &jmp;
+        vp_mmap_scan_chunk(chunk);
     } else {
-        /* parent */
-        if (fd[0][0] > 0) {
-            close(fd[0][0]);
-        }
-        if (fd[1][1] > 0) {
-            close(fd[1][1]);
-        }
-        if (fd[2][1] > 0) {
-            close(fd[2][1]);
+        chunk->truncated = 1;
+    }
+    vp_mmap_bus_jmp = NULL;
+    vp_mmap_bus_guard(0);
+    return NULL;
+}
+
+/* Wait for the index threads and merge the chunks. */
+static const char *
+vp_mmap_index(vp_mmap_t *m)
+{
+    size_t nnl = 0;
+    size_t n = 1;
+    int i, nomem = 0;
+
+    if (m->indexed)
+        return NULL;
+    for (i = 0; i < m->nchunks; ++i) {
+        if (m->chunks[i].running)
+            pthread_join(m->chunks[i].thread, NULL);
+        m->chunks[i].running = 0;
+        nomem |= m->chunks[i].nomem;
+        m->truncated |= m->chunks[i].truncated;
+        n += m->chunks[i].nmarks;
+    }
+    if (!nomem && !m->truncated
+            && (m->marks = malloc(n * sizeof(vp_mmap_mark_t))) == NULL)
+        nomem = 1;
+    if (nomem || m->truncated) {
+        for (i = 0; i < m->nchunks; ++i)
+            free(m->chunks[i].marks);
+        free(m->chunks);
+        m->chunks = NULL;
+        m->nchunks = 0;
+        if (m->truncated)
+            return vp_stack_return_error(&_result,
+                    "vp_mmap_index: file was truncated; open it again");
+        return "vp_mmap_index: NOMEM";
+    }
+
+    m->marks[0].lnum = 0;
+    m->marks[0].offset = 0;
+    m->nmarks = 1;
+    for (i = 0; i < m->nchunks; ++i) {
+        vp_mmap_chunk_t *chunk = &m->chunks[i];
+        size_t k;
+
+        for (k = 0; k < chunk->nmarks; ++k) {
+            if (chunk->marks[k].offset >= m->size)
+                break;
+            m->marks[m->nmarks].lnum = nnl + chunk->marks[k].lnum;
+            m->marks[m->nmarks].offset = chunk->marks[k].offset;
+            ++m->nmarks;
         }
+        nnl += chunk->nnl;
+        free(chunk->marks);
+    }
+    free(m->chunks);
+    m->chunks = NULL;
+    m->nchunks = 0;
 
+    m->nlines = nnl;
+    if (m->size > 0 && m->addr[m->size - 1] != '\n')
+        ++m->nlines;
+    m->indexed = 1;
+    if (m->size > 0)
+        vp_madvise(m->addr, m->size, RANDOM);
+    return NULL;
+}
+
+/* Returns the offset of the line lnum (0-based). */
+static size_t
+vp_mmap_line_offset(vp_mmap_t *m, size_t lnum)
+{
+    size_t lo = 0, hi = m->nmarks;
+    const char *p, *end = m->addr + m->size;
+    size_t n;
+
+    /* The last mark whose lnum <= lnum. */
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (m->marks[mid].lnum <= lnum)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    p = m->addr + m->marks[lo].offset;
+    for (n = lnum - m->marks[lo].lnum; n > 0 && p < end; --n) {
+        if ((p = memchr(p, '\n', end - p)) == NULL)
+            return m->size;
+        ++p;
+    }
+    return p - m->addr;
+}
+
+static vp_mmap_t *
+vp_mmap_find(int fd, vp_mmap_t ***prevp)
+{
+    vp_mmap_t **prev = &vp_mmap_list;
+
+    while (*prev != NULL && (*prev)->fd != fd)
+        prev = &(*prev)->next;
+    if (prevp != NULL)
+        *prevp = prev;
+    return *prev;
+}
+
+const char *
+vp_mmap_open(char *args)
+{
+    vp_stack_t stack;
+    char *path;
+    vp_mmap_t *m;
+    struct stat st;
+    int nchunks, i;
+    long ncpu;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
+
+    if ((m = calloc(1, sizeof(vp_mmap_t))) == NULL)
+        return "vp_mmap_open: NOMEM";
+    if ((m->fd = open(path, O_RDONLY)) == -1) {
+        free(m);
+        return vp_stack_return_error(&_result, "open() error: %s",
+                strerror(errno));
+    }
+    (void)fcntl(m->fd, F_SETFD, FD_CLOEXEC);
+    if (fstat(m->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(m->fd);
+        free(m);
+        return vp_stack_return_error(&_result, "vp_mmap_open: not a regular file: %s",
+                path);
+    }
+    m->size = (size_t)st.st_size;
+    if (m->size > 0) {
+        m->addr = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, m->fd, 0);
+        if (m->addr == MAP_FAILED) {
+            close(m->fd);
+            free(m);
+            return vp_stack_return_error(&_result, "mmap() error: %s",
+                    strerror(errno));
+        }
+        vp_madvise(m->addr, m->size, SEQUENTIAL);
+    }
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nchunks = (int)(m->size / VP_MMAP_CHUNK) + 1;
+    if (nchunks > ncpu)
+        nchunks = (ncpu > 1) ? (int)ncpu : 1;
+    if (nchunks > VP_MMAP_MAX_THREADS)
+        nchunks = VP_MMAP_MAX_THREADS;
+    if ((m->chunks = calloc(nchunks, sizeof(vp_mmap_chunk_t))) == NULL) {
+        if (m->addr != NULL)
+            munmap(m->addr, m->size);
+        close(m->fd);
+        free(m);
+        return "vp_mmap_open: NOMEM";
+    }
+    m->nchunks = nchunks;
+    for (i = 0; i < nchunks; ++i) {
+        m->chunks[i].addr = m->addr;
+        m->chunks[i].begin = m->size / nchunks * i;
+        m->chunks[i].end = (i == nchunks - 1) ? m->size : m->size / nchunks * (i + 1);
+    }
+    if (m->size == 0) {
+        /* Nothing to scan. */
+    } else if (nchunks == 1) {
+        vp_mmap_scan(&m->chunks[0]);
+    } else {
+        for (i = 0; i < nchunks; ++i) {
+            if (pthread_create(&m->chunks[i].thread, NULL,
+                        vp_mmap_scan, &m->chunks[i]) == 0)
+                m->chunks[i].running = 1;
+            else
+                vp_mmap_scan(&m->chunks[i]);
+        }
+    }
+
+    m->next = vp_mmap_list;
+    vp_mmap_list = m;
+
+    vp_stack_push_num(&_result, "%d", m->fd);
+    vp_stack_push_num(&_result, "%zu", m->size);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_mmap_close(char *args)
+{
+    vp_stack_t stack;
+    int fd;
+    vp_mmap_t *m, **prev;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+
+    if ((m = vp_mmap_find(fd, &prev)) == NULL)
+        return vp_stack_return_error(&_result, "vp_mmap_close: invalid fd: %d", fd);
+    /* Join the threads before unmapping. */
+    vp_mmap_index(m);
+    *prev = m->next;
+    if (m->addr != NULL)
+        munmap(m->addr, m->size);
+    close(m->fd);
+    free(m->marks);
+    free(m);
+    return NULL;
+}
+
+const char *
+vp_mmap_nlines(char *args)
+{
+    vp_stack_t stack;
+    int fd;
+    vp_mmap_t *m;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+
+    if ((m = vp_mmap_find(fd, NULL)) == NULL)
+        return vp_stack_return_error(&_result, "vp_mmap_nlines: invalid fd: %d", fd);
+    VP_RETURN_IF_FAIL(vp_mmap_index(m));
+    vp_stack_push_num(&_result, "%zu", m->nlines);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_mmap_lines(char *args)
+{
+    vp_stack_t stack;
+    int fd;
+    size_t lnum;
+    size_t count;
+    size_t begin, end;
+    vp_mmap_t *m;
+    struct stat st;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%zu", &lnum));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%zu", &count));
+
+    if ((m = vp_mmap_find(fd, NULL)) == NULL)
+        return vp_stack_return_error(&_result, "vp_mmap_lines: invalid fd: %d", fd);
+    VP_RETURN_IF_FAIL(vp_mmap_index(m));
+    /* The pages past a new EOF raise SIGBUS, e.g. after copytruncate. */
+    if (fstat(m->fd, &st) == -1)
+        return vp_stack_return_error(&_result, "fstat() error: %s",
+                strerror(errno));
+    if ((size_t)st.st_size < m->size)
+        return vp_stack_return_error(&_result,
+                "vp_mmap_lines: file was truncated; open it again");
+
+    /* lnum is 1-based like getline(). */
+    if (lnum < 1 || lnum > m->nlines)
+        count = 0;
+    else if (count > m->nlines - lnum + 1)
+        count = m->nlines - lnum + 1;
+    if (count == 0) {
+        vp_stack_push_num(&_result, "%d", 0);
+        vp_stack_push_str(&_result, "");
+        return vp_stack_return(&_result);
+    }
+
+    begin = vp_mmap_line_offset(m, lnum - 1);
+    end = vp_mmap_line_offset(m, lnum - 1 + count);
+    if (end > begin && m->addr[end - 1] == '\n')
+        --end;
+    vp_stack_push_num(&_result, "%zu", count);
+    VP_RETURN_IF_FAIL(vp_stack_push_bin(&_result, m->addr + begin, end - begin));
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Followed files for vp_follow_*().
+ * On Linux the file is watched with inotify and vp_follow_read() does
+ * nothing until an event arrives.  The parent directory is watched too,
+ * to notice the file being created again after rotation.  Elsewhere the
+ * file is checked with fstat() on every call.
+ */
+#define VP_FOLLOW_POLL_INTERVAL 100 /* msec */
+
+typedef struct vp_follow_t {
+    struct vp_follow_t *next;
+    int fd;         /* handle; kept across rotation by dup2() */
+    int ifd;        /* inotify fd or -1 */
+    int wd;         /* watch of the file */
+    int dwd;        /* watch of the parent directory */
+    char *path;
+    const char *name;   /* basename of path */
+    dev_t dev;
+    ino_t ino;
+    off_t offset;
+    int pending;    /* there may be unread bytes */
+} vp_follow_t;
+
+static vp_follow_t *vp_follow_list = NULL;
+
+static vp_follow_t *
+vp_follow_find(int fd, vp_follow_t ***prevp)
+{
+    vp_follow_t **prev = &vp_follow_list;
+
+    while (*prev != NULL && (*prev)->fd != fd)
+        prev = &(*prev)->next;
+    if (prevp != NULL)
+        *prevp = prev;
+    return *prev;
+}
+
+static void
+vp_follow_watch(vp_follow_t *f)
+{
+#if defined __linux__
+    if (f->ifd == -1)
+        return;
+    if (f->wd != -1)
+        inotify_rm_watch(f->ifd, f->wd);
+    f->wd = inotify_add_watch(f->ifd, f->path,
+            IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+#endif
+}
+
+/* Read inotify events.  Returns -1 if there is no inotify. */
+static int
+vp_follow_drain(vp_follow_t *f, int timeout)
+{
+#if defined __linux__
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = {0, POLLIN, 0};
+    ssize_t len;
+    char *p;
+
+    if (f->ifd == -1)
+        return -1;
+    if (!f->pending && timeout != 0) {
+        pfd.fd = f->ifd;
+        if (poll(&pfd, 1, timeout) <= 0)
+            return 0;
+    }
+    while ((len = read(f->ifd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+
+            if (ev->wd == f->wd || (ev->len > 0 && strcmp(ev->name, f->name) == 0))
+                f->pending = 1;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Reopen the path if it is another file now.  Returns 1 if rotated. */
+static int
+vp_follow_reopen(vp_follow_t *f)
+{
+    struct stat st;
+    int fd;
+
+    if (stat(f->path, &st) == -1
+            || (st.st_dev == f->dev && st.st_ino == f->ino))
+        return 0;
+    if ((fd = open(f->path, O_RDONLY)) == -1)
+        return 0;
+    if (fstat(fd, &st) == -1 || dup2(fd, f->fd) == -1) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    (void)fcntl(f->fd, F_SETFD, FD_CLOEXEC);
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->offset = 0;
+    vp_follow_watch(f);
+    return 1;
+}
+
+const char *
+vp_follow_open(char *args)
+{
+    vp_stack_t stack;
+    char *path;
+    int from_end;
+    vp_follow_t *f;
+    struct stat st;
+    char *p;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &from_end));
+
+    if ((f = calloc(1, sizeof(vp_follow_t))) == NULL
+            || (f->path = strdup(path)) == NULL) {
+        free(f);
+        return "vp_follow_open: NOMEM";
+    }
+    p = strrchr(f->path, '/');
+    f->name = (p != NULL) ? p + 1 : f->path;
+    f->ifd = f->wd = f->dwd = -1;
+    if ((f->fd = open(path, O_RDONLY)) == -1 || fstat(f->fd, &st) == -1) {
+        if (f->fd != -1)
+            close(f->fd);
+        free(f->path);
+        free(f);
+        return vp_stack_return_error(&_result, "open() error: %s",
+                strerror(errno));
+    }
+    (void)fcntl(f->fd, F_SETFD, FD_CLOEXEC);
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->offset = from_end ? st.st_size : 0;
+    f->pending = 1;
+
+#if defined __linux__
+    if ((f->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1) {
+        vp_follow_watch(f);
+        if (p == NULL) {
+            f->dwd = inotify_add_watch(f->ifd, ".", IN_CREATE | IN_MOVED_TO);
+        } else {
+            *p = '\0';
+            f->dwd = inotify_add_watch(f->ifd, (p == f->path) ? "/" : f->path,
+                    IN_CREATE | IN_MOVED_TO);
+            *p = '/';
+        }
+        if (f->wd == -1) {
+            close(f->ifd);
+            f->ifd = -1;
+        }
+    }
+#endif
+
+    f->next = vp_follow_list;
+    vp_follow_list = f;
+
+    vp_stack_push_num(&_result, "%d", f->fd);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_follow_close(char *args)
+{
+    vp_stack_t stack;
+    int fd;
+    vp_follow_t *f, **prev;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+
+    if ((f = vp_follow_find(fd, &prev)) == NULL)
+        return vp_stack_return_error(&_result, "vp_follow_close: invalid fd: %d", fd);
+    *prev = f->next;
+    if (f->ifd != -1)
+        close(f->ifd);
+    close(f->fd);
+    free(f->path);
+    free(f);
+    return NULL;
+}
+
+const char *
+vp_follow_read(char *args)
+{
+    vp_stack_t stack;
+    int fd;
+    int nr;
+    int timeout;
+    int n;
+    char buf[VP_READ_BUFSIZE];
+    const char *event = "";
+    vp_follow_t *f;
+    struct stat st;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nr));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    if ((f = vp_follow_find(fd, NULL)) == NULL)
+        return vp_stack_return_error(&_result, "vp_follow_read: invalid fd: %d", fd);
+
+    vp_stack_push_str(&_result, ""); /* initialize */
+    if (vp_follow_drain(f, timeout) == 0 && !f->pending) {
+        /* Nothing happened. */
+        vp_stack_push_str(&_result, event);
+        return vp_stack_return(&_result);
+    }
+
+    while (nr != 0) {
+        if (fstat(f->fd, &st) == 0 && st.st_size < f->offset) {
+            /* Truncated. */
+            f->offset = 0;
+            event = "truncated";
+        }
+        if (nr > 0)
+            n = pread(f->fd, buf, (VP_READ_BUFSIZE < nr) ? VP_READ_BUFSIZE : nr,
+                    f->offset);
+        else
+            n = pread(f->fd, buf, VP_READ_BUFSIZE, f->offset);
+        if (n == -1) {
+            return vp_stack_return_error(&_result, "read() error: %s",
+                    strerror(errno));
+        } else if (n == 0) {
+            /* Read the rest of the old file before reopening. */
+            if (vp_follow_reopen(f)) {
+                event = "rotated";
+                continue;
+            }
+            if (f->ifd != -1 || timeout <= 0 || _result.top - _result.buf > 1) {
+                f->pending = 0;
+                break;
+            }
+            /* Poll with fstat(). */
+            poll(NULL, 0, (timeout < VP_FOLLOW_POLL_INTERVAL)
+                    ? timeout : VP_FOLLOW_POLL_INTERVAL);
+            timeout -= VP_FOLLOW_POLL_INTERVAL;
+            continue;
+        }
+        /* decrease stack top for concatenate. */
+        _result.top--;
+        vp_stack_push_bin(&_result, buf, n);
+        f->offset += n;
+        if (nr > 0)
+            nr -= n;
+    }
+    vp_stack_push_str(&_result, event);
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Watched files for vp_watch_*().
+ * On Linux the parent directory of each path is watched with inotify, so
+ * files replaced by rename() are noticed too.  Files on network file
+ * systems, where inotify does not see remote changes, and all files on
+ * other systems are compared with stat() at most once a
+ * VP_WATCH_STAT_INTERVAL.  Any number of events for a path are reported
+ * once by the next vp_watch_poll().
+ */
+#define VP_WATCH_STAT_INTERVAL 1 /* sec */
+
+typedef struct vp_watch_t {
+    struct vp_watch_t *next;
+    char *path;
+    const char *name;   /* basename of path */
+    int wd;             /* watch of the parent directory or -1 */
+    int changed;
+    int exists;
+    struct stat st;
+} vp_watch_t;
+
+static vp_watch_t *vp_watch_list = NULL;
+static int vp_watch_ifd = -1;
+static time_t vp_watch_stat_time = 0;
+
+static void
+vp_watch_stat(vp_watch_t *w)
+{
+    struct stat st;
+    int exists = (stat(w->path, &st) == 0);
+
+    if (exists != w->exists || (exists && (st.st_mtime != w->st.st_mtime
+                    || st.st_size != w->st.st_size || st.st_ino != w->st.st_ino
+                    || st.st_mode != w->st.st_mode)))
+        w->changed = 1;
+    w->exists = exists;
+    if (exists)
+        w->st = st;
+}
+
+#if defined __linux__
+/* inotify does not work for remote changes. */
+static int
+is_network_fs(const char *path)
+{
+    struct statfs sfs;
+
+    if (statfs(path, &sfs) == -1)
+        return 0;
+    switch ((unsigned long)sfs.f_type) {
+    case 0x6969UL:      /* NFS */
+    case 0x517BUL:      /* SMB */
+    case 0xFF534D42UL:  /* CIFS */
+    case 0xFE534D42UL:  /* SMB2 */
+    case 0x65735546UL:  /* FUSE (sshfs, ...) */
+    case 0x564C:        /* NCP */
+    case 0x73757245UL:  /* CODA */
+    case 0x5346414FUL:  /* AFS */
+        return 1;
+    }
+    return 0;
+}
+
+static void
+vp_watch_read_events(void)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    char *p;
+    vp_watch_t *w;
+
+    while ((len = read(vp_watch_ifd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+
+            p += sizeof(struct inotify_event) + ev->len;
+            for (w = vp_watch_list; w != NULL; w = w->next) {
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    w->changed = 1;
+                } else if (ev->wd == w->wd) {
+                    if (ev->mask & IN_IGNORED) {
+                        /* The directory is removed: Use stat(). */
+                        w->wd = -1;
+                        w->changed = 1;
+                    } else if (ev->len == 0 || strcmp(ev->name, w->name) == 0) {
+                        w->changed = 1;
+                    }
+                }
+            }
+        }
+    }
+}
+#endif
+
+const char *
+vp_watch_add(char *args)
+{
+    vp_stack_t stack;
+    char *path;
+    vp_watch_t *w;
+    char *p;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
+
+    for (w = vp_watch_list; w != NULL; w = w->next) {
+        if (strcmp(w->path, path) == 0)
+            return NULL;
+    }
+    if ((w = calloc(1, sizeof(vp_watch_t))) == NULL
+            || (w->path = strdup(path)) == NULL) {
+        free(w);
+        return "vp_watch_add: NOMEM";
+    }
+    p = strrchr(w->path, '/');
+    w->name = (p != NULL) ? p + 1 : w->path;
+    w->wd = -1;
+    vp_watch_stat(w);
+    w->changed = 0;
+
+#if defined __linux__
+    if (vp_watch_ifd == -1)
+        vp_watch_ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (vp_watch_ifd != -1) {
+        const char *dir = ".";
+
+        if (p == w->path) {
+            dir = "/";
+        } else if (p != NULL) {
+            *p = '\0';
+            dir = w->path;
+        }
+        if (!is_network_fs(dir))
+            w->wd = inotify_add_watch(vp_watch_ifd, dir,
+                    IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE
+                    | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                    | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (p != NULL)
+            *p = '/';
+    }
+#endif
+
+    w->next = vp_watch_list;
+    vp_watch_list = w;
+    return NULL;
+}
+
+const char *
+vp_watch_remove(char *args)
+{
+    vp_stack_t stack;
+    char *path;
+    vp_watch_t *w, **prev;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
+
+    for (prev = &vp_watch_list; *prev != NULL; prev = &(*prev)->next) {
+        if (strcmp((*prev)->path, path) == 0)
+            break;
+    }
+    if ((w = *prev) == NULL)
+        return NULL;
+    *prev = w->next;
+#if defined __linux__
+    if (w->wd != -1) {
+        vp_watch_t *o;
+
+        /* The directory watch is shared with the other files in it. */
+        for (o = vp_watch_list; o != NULL && o->wd != w->wd; o = o->next)
+            ;
+        if (o == NULL)
+            inotify_rm_watch(vp_watch_ifd, w->wd);
+    }
+#endif
+    free(w->path);
+    free(w);
+    return NULL;
+}
+
+const char *
+vp_watch_poll(char *args)
+{
+    vp_stack_t stack;
+    int timeout;
+    vp_watch_t *w;
+    time_t now;
+    int changed = 0, polled = 0;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    for (w = vp_watch_list; w != NULL; w = w->next) {
+        changed |= w->changed;
+        polled |= (w->wd == -1);
+    }
+#if defined __linux__
+    if (vp_watch_ifd != -1) {
+        struct pollfd pfd = {0, POLLIN, 0};
+
+        pfd.fd = vp_watch_ifd;
+        if (poll(&pfd, 1, (changed || polled) ? 0 : timeout) > 0)
+            vp_watch_read_events();
+    }
+#endif
+
+    now = time(NULL);
+    if (polled && now - vp_watch_stat_time >= VP_WATCH_STAT_INTERVAL) {
+        vp_watch_stat_time = now;
+        for (w = vp_watch_list; w != NULL; w = w->next) {
+            if (w->wd == -1)
+                vp_watch_stat(w);
+        }
+    }
+
+    for (w = vp_watch_list; w != NULL; w = w->next) {
+        if (w->changed) {
+            vp_stack_push_str(&_result, w->path);
+            w->changed = 0;
+        }
+    }
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Spawn options of vp_pipe_open() and vp_pty_open().
+ * They are parsed in the parent, so that a bad value is an error of the
+ * call, and applied in the child before exec.
+ */
+#define VP_SPAWN_RLIMIT_MAX 3
+
+#ifdef O_DIRECTORY
+# define VP_O_DIRECTORY O_DIRECTORY
+#else
+# define VP_O_DIRECTORY 0
+#endif
+
+/*
+ * A termios spec: comma separated words applied from left to right.
+ *   raw, cbreak, noecho, sane   profiles
+ *   echo, -echo, icanon, ...    a flag of vp_termios_flags
+ *   vmin=N, vtime=N             c_cc[VMIN] and c_cc[VTIME]
+ * It is kept as masks, so that flags not named keep the pty defaults.
+ */
+typedef struct vp_termios_t {
+    tcflag_t clear[4];  /* iflag, oflag, cflag, lflag */
+    tcflag_t set[4];
+    int vmin, vtime;    /* -1 if unset */
+} vp_termios_t;
+
+enum { VP_TC_I, VP_TC_O, VP_TC_C, VP_TC_L };
+
+static const struct {
+    const char *name;
+    int field;
+    tcflag_t bits;
+} vp_termios_flags[] = {
+    {"echo",    VP_TC_L, ECHO},
+    {"echoe",   VP_TC_L, ECHOE},
+    {"echonl",  VP_TC_L, ECHONL},
+    {"icanon",  VP_TC_L, ICANON},
+    {"isig",    VP_TC_L, ISIG},
+    {"iexten",  VP_TC_L, IEXTEN},
+    {"icrnl",   VP_TC_I, ICRNL},
+    {"ixon",    VP_TC_I, IXON},
+    {"istrip",  VP_TC_I, ISTRIP},
+    {"opost",   VP_TC_O, OPOST},
+    {"onlcr",   VP_TC_O, ONLCR},
+};
+
+static void
+vp_termios_flag(vp_termios_t *spec, int field, tcflag_t bits, int on)
+{
+    if (on) {
+        spec->set[field] |= bits;
+        spec->clear[field] &= ~bits;
+    } else {
+        spec->clear[field] |= bits;
+        spec->set[field] &= ~bits;
+    }
+}
+
+static int
+vp_termios_cc(const char *word, const char *name, int *value)
+{
+    size_t len = strlen(name);
+    char *end;
+    long n;
+
+    if (strncmp(word, name, len) != 0 || word[len] != '=')
+        return 0;
+    errno = 0;
+    n = strtol(word + len + 1, &end, 10);
+    if (errno != 0 || end == word + len + 1 || (*end != '\0' && *end != ',')
+            || n < 0 || n > 255)
+        return -1;
+    *value = (int)n;
+    return 1;
+}
+
+/* Returns -1 on an unknown word. */
+static int
+vp_termios_parse(const char *value, vp_termios_t *spec)
+{
+    const char *p = value;
+    size_t len, i;
+    int on, r;
+
+    memset(spec, 0, sizeof(*spec));
+    spec->vmin = spec->vtime = -1;
+    while (*p != '\0') {
+        len = strcspn(p, ",");
+        if (len == 3 && strncmp(p, "raw", len) == 0) {
+            vp_termios_flag(spec, VP_TC_I, IGNBRK | BRKINT | PARMRK | ISTRIP
+                    | INLCR | IGNCR | ICRNL | IXON, 0);
+            vp_termios_flag(spec, VP_TC_O, OPOST, 0);
+            vp_termios_flag(spec, VP_TC_L, ECHO | ECHONL | ICANON | ISIG
+                    | IEXTEN, 0);
+            vp_termios_flag(spec, VP_TC_C, CSIZE | PARENB, 0);
+            vp_termios_flag(spec, VP_TC_C, CS8, 1);
+            spec->vmin = 1;
+            spec->vtime = 0;
+        } else if (len == 6 && strncmp(p, "cbreak", len) == 0) {
+            vp_termios_flag(spec, VP_TC_L, ICANON | ECHO, 0);
+            spec->vmin = 1;
+            spec->vtime = 0;
+        } else if (len == 6 && strncmp(p, "noecho", len) == 0) {
+            vp_termios_flag(spec, VP_TC_L, ECHO | ECHOE | ECHOK | ECHONL, 0);
+        } else if (len == 4 && strncmp(p, "sane", len) == 0) {
+            vp_termios_flag(spec, VP_TC_I, BRKINT | ICRNL | IXON, 1);
+            vp_termios_flag(spec, VP_TC_O, OPOST | ONLCR, 1);
+            vp_termios_flag(spec, VP_TC_L, ECHO | ECHOE | ECHOK | ICANON
+                    | ISIG | IEXTEN, 1);
+            spec->vmin = spec->vtime = -1;
+        } else if ((r = vp_termios_cc(p, "vmin", &spec->vmin)) != 0
+                || (r = vp_termios_cc(p, "vtime", &spec->vtime)) != 0) {
+            if (r < 0)
+                return -1;
+        } else {
+            on = (*p != '-');
+            if (!on) {
+                ++p;
+                --len;
+            }
+            for (i = 0; i < sizeof(vp_termios_flags) / sizeof(vp_termios_flags[0]); ++i)
+                if (strlen(vp_termios_flags[i].name) == len
+                        && strncmp(p, vp_termios_flags[i].name, len) == 0)
+                    break;
+            if (i == sizeof(vp_termios_flags) / sizeof(vp_termios_flags[0]))
+                return -1;
+            vp_termios_flag(spec, vp_termios_flags[i].field,
+                    vp_termios_flags[i].bits, on);
+        }
+        p += len;
+        if (*p == ',')
+            ++p;
+    }
+    return 0;
+}
+
+/* One tcsetattr(), so that the mode never is half applied. */
+static int
+vp_termios_apply(int fd, const vp_termios_t *spec)
+{
+    struct termios t;
+
+    if (tcgetattr(fd, &t) < 0)
+        return -1;
+    t.c_iflag = (t.c_iflag & ~spec->clear[VP_TC_I]) | spec->set[VP_TC_I];
+    t.c_oflag = (t.c_oflag & ~spec->clear[VP_TC_O]) | spec->set[VP_TC_O];
+    t.c_cflag = (t.c_cflag & ~spec->clear[VP_TC_C]) | spec->set[VP_TC_C];
+    t.c_lflag = (t.c_lflag & ~spec->clear[VP_TC_L]) | spec->set[VP_TC_L];
+    if (spec->vmin != -1)
+        t.c_cc[VMIN] = (cc_t)spec->vmin;
+    if (spec->vtime != -1)
+        t.c_cc[VTIME] = (cc_t)spec->vtime;
+    return tcsetattr(fd, TCSANOW, &t);
+}
+
+typedef struct vp_spawn_opts_t {
+    int nice;           /* increment */
+    int ioprio;         /* -1 if unset */
+    int sched;          /* -1 if unset */
+    int has_affinity;
+#if defined __linux__
+    cpu_set_t affinity;
+#endif
+    int nrlimits;
+    struct {
+        int resource;
+        rlim_t value;
+    } rlimits[VP_SPAWN_RLIMIT_MAX];
+    int cwd;            /* directory fd or -1 */
+    const char *cwdname; /* its name or "" */
+    char **env;         /* "env" values */
+    size_t nenv;
+    char **envp;        /* for execve(); NULL for environ */
+    int has_termios;    /* ptys only */
+    vp_termios_t termios;
+} vp_spawn_opts_t;
+
+static int
+vp_spawn_num(const char *value, long *n)
+{
+    char *end;
+
+    errno = 0;
+    *n = strtol(value, &end, 10);
+    return (errno != 0 || end == value || *end != '\0') ? -1 : 0;
+}
+
+#if defined __linux__
+/* "0-3,6" */
+static int
+vp_spawn_cpulist(const char *value, cpu_set_t *set)
+{
+    const char *p = value;
+    char *end;
+    long first, last;
+
+    CPU_ZERO(set);
+    while (*p != '\0') {
+        first = last = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (; first <= last; ++first)
+            CPU_SET(first, set);
+        if (*end == ',')
+            ++end;
+        else if (*end != '\0')
+            return -1;
+        p = end;
+    }
+    return 0;
+}
+#endif
+
+static void
+vp_spawn_opts_free(vp_spawn_opts_t *opts)
+{
+    if (opts->cwd != -1)
+        close(opts->cwd);
+    opts->cwd = -1;
+    free(opts->env);
+    free(opts->envp);
+    opts->env = opts->envp = NULL;
+}
+
+static int
+vp_spawn_env_match(const char *entry, const char *name)
+{
+    size_t len = strcspn(name, "=");
+
+    return strncmp(entry, name, len) == 0 && entry[len] == '=';
+}
+
+/* $PATH of the child, or NULL if opts->env does not change it. */
+static const char *
+vp_spawn_envpath(const vp_spawn_opts_t *opts)
+{
+    size_t i = opts->nenv;
+
+    /* The last one wins. */
+    while (i-- > 0) {
+        if (vp_spawn_env_match(opts->env[i], "PATH"))
+            return opts->env[i] + 5;
+        if (strcmp(opts->env[i], "PATH") == 0)
+            return "";
+    }
+    return NULL;
+}
+
+/* environ with opts->env applied.  The strings are shared. */
+static const char *
+vp_spawn_envp(vp_spawn_opts_t *opts)
+{
+    char **env;
+    size_t n = 0, i;
+
+    for (env = environ; env != NULL && *env != NULL; ++env)
+        ++n;
+    if ((opts->envp = malloc(sizeof(char *) * (n + opts->nenv + 1))) == NULL)
+        return "vp_spawn_envp: NOMEM";
+    n = 0;
+    for (env = environ; env != NULL && *env != NULL; ++env) {
+        for (i = 0; i < opts->nenv; ++i)
+            if (vp_spawn_env_match(*env, opts->env[i]))
+                break;
+        if (i == opts->nenv)
+            opts->envp[n++] = *env;
+    }
+    for (i = 0; i < opts->nenv; ++i) {
+        size_t j;
+
+        if (strchr(opts->env[i], '=') == NULL)
+            continue;
+        /* The last one wins. */
+        for (j = i + 1; j < opts->nenv; ++j)
+            if (vp_spawn_env_match(opts->env[i], opts->env[j]))
+                break;
+        if (j == opts->nenv)
+            opts->envp[n++] = opts->env[i];
+    }
+    opts->envp[n] = NULL;
+    return NULL;
+}
+
+static const char *
+vp_spawn_opts_pop(vp_stack_t *stack, vp_spawn_opts_t *opts)
+{
+    char *name, *value;
+    long n;
+    int resource;
+    char **newenv;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->ioprio = -1;
+    opts->sched = -1;
+    opts->cwd = -1;
+    opts->cwdname = "";
+    while (stack->top != stack->buf) {
+        VP_RETURN_IF_FAIL(vp_stack_pop_str(stack, &name));
+        VP_RETURN_IF_FAIL(vp_stack_pop_str(stack, &value));
+        resource = -1;
+        if (strcmp(name, "cwd") == 0) {
+            if (opts->cwd != -1)
+                close(opts->cwd);
+            /* Opened here, so that a wrong directory is an error. */
+            if ((opts->cwd = open(value, O_RDONLY | VP_O_DIRECTORY)) == -1)
+                return vp_stack_return_error(&_result, "open() error: %s: %s",
+                        value, strerror(errno));
+            (void)fcntl(opts->cwd, F_SETFD, FD_CLOEXEC);
+            opts->cwdname = value;
+        } else if (strcmp(name, "env") == 0) {
+            if (*value == '\0' || *value == '=')
+                goto invalid;
+            newenv = realloc(opts->env, sizeof(char *) * (opts->nenv + 1));
+            if (newenv == NULL)
+                return "vp_spawn_opts_pop: NOMEM";
+            opts->env = newenv;
+            opts->env[opts->nenv++] = value;
+        } else if (strcmp(name, "nice") == 0) {
+            if (vp_spawn_num(value, &n) < 0)
+                goto invalid;
+            opts->nice = (int)n;
+#if defined __linux__ && defined SYS_ioprio_set
+        } else if (strcmp(name, "ioprio") == 0) {
+            /* "idle", "be[:level]" or "rt[:level]" */
+            size_t len = strcspn(value, ":");
+            int class;
+
+            if (len == 4 && strncmp(value, "idle", 4) == 0)
+                class = 3;
+            else if (len == 2 && strncmp(value, "be", 2) == 0)
+                class = 2;
+            else if (len == 2 && strncmp(value, "rt", 2) == 0)
+                class = 1;
+            else
+                goto invalid;
+            n = (class == 3) ? 0 : 4;
+            if (value[len] == ':' && vp_spawn_num(value + len + 1, &n) < 0)
+                goto invalid;
+            if (n < 0 || n > 7)
+                goto invalid;
+            opts->ioprio = (class << 13) | (int)n;
+        } else if (strcmp(name, "sched") == 0) {
+            if (strcmp(value, "other") == 0)
+                opts->sched = SCHED_OTHER;
+            else if (strcmp(value, "batch") == 0)
+                opts->sched = SCHED_BATCH;
+            else if (strcmp(value, "idle") == 0)
+                opts->sched = SCHED_IDLE;
+            else
+                goto invalid;
+        } else if (strcmp(name, "affinity") == 0) {
+            if (vp_spawn_cpulist(value, &opts->affinity) < 0)
+                goto invalid;
+            opts->has_affinity = 1;
+#endif
+        } else if (strcmp(name, "termios") == 0) {
+            if (vp_termios_parse(value, &opts->termios) < 0)
+                goto invalid;
+            opts->has_termios = 1;
+        } else if (strcmp(name, "rlimit_cpu") == 0) {
+            resource = RLIMIT_CPU;
+        } else if (strcmp(name, "rlimit_nofile") == 0) {
+            resource = RLIMIT_NOFILE;
+#ifdef RLIMIT_AS
+        } else if (strcmp(name, "rlimit_as") == 0) {
+            resource = RLIMIT_AS;
+#endif
+        } else {
+            return vp_stack_return_error(&_result,
+                    "unsupported spawn option: %s", name);
+        }
+        if (resource != -1) {
+            if (vp_spawn_num(value, &n) < 0 || n < 0
+                    || opts->nrlimits == VP_SPAWN_RLIMIT_MAX)
+                goto invalid;
+            opts->rlimits[opts->nrlimits].resource = resource;
+            opts->rlimits[opts->nrlimits++].value = (rlim_t)n;
+        }
+    }
+    if (opts->nenv > 0)
+        return vp_spawn_envp(opts);
+    return NULL;
+
+invalid:
+    return vp_stack_return_error(&_result, "invalid spawn option: %s=%s",
+            name, value);
+}
+
+/* In the child.  Returns -1 with errno. */
+static int
+vp_spawn_opts_apply(const vp_spawn_opts_t *opts)
+{
+    struct rlimit rl;
+    int i;
+
+    if (opts->cwd != -1 && fchdir(opts->cwd) < 0)
+        return -1;
+    if (opts->nice != 0) {
+        errno = 0;
+        if (nice(opts->nice) == -1 && errno != 0)
+            return -1;
+    }
+#if defined __linux__
+# if defined SYS_ioprio_set
+    /* IOPRIO_WHO_PROCESS */
+    if (opts->ioprio != -1 && syscall(SYS_ioprio_set, 1, 0, opts->ioprio) < 0)
+        return -1;
+# endif
+    if (opts->sched != -1) {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        if (sched_setscheduler(0, opts->sched, &param) < 0)
+            return -1;
+    }
+    if (opts->has_affinity
+            && sched_setaffinity(0, sizeof(cpu_set_t), &opts->affinity) < 0)
+        return -1;
+#endif
+    for (i = 0; i < opts->nrlimits; ++i) {
+        rl.rlim_cur = rl.rlim_max = opts->rlimits[i].value;
+        if (setrlimit(opts->rlimits[i].resource, &rl) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Spawn times for the wall time of vp_waitpid_rusage().  A slot is
+ * overwritten by a newer process, then the wall time is unknown.
+ */
+#define VP_SPAWN_TABLE_SIZE 256
+
+static struct {
+    pid_t pid;
+    long start;     /* vp_msec_now() */
+} vp_spawn_table[VP_SPAWN_TABLE_SIZE];
+
+static void
+vp_spawn_add(pid_t pid)
+{
+    vp_spawn_table[pid % VP_SPAWN_TABLE_SIZE].pid = pid;
+    vp_spawn_table[pid % VP_SPAWN_TABLE_SIZE].start = vp_msec_now();
+}
+
+/* -1 if unknown. */
+static long
+vp_spawn_wall(pid_t pid, int remove)
+{
+    long wall = -1;
+
+    if (vp_spawn_table[pid % VP_SPAWN_TABLE_SIZE].pid == pid) {
+        wall = vp_msec_now() - vp_spawn_table[pid % VP_SPAWN_TABLE_SIZE].start;
+        if (remove)
+            vp_spawn_table[pid % VP_SPAWN_TABLE_SIZE].pid = 0;
+    }
+    return wall;
+}
+
+/*
+ * Pool of pty pairs for vp_pty_open().  forkpty() opens, unlocks and
+ * looks up a pty by name on every spawn; the pairs are opened ahead in a
+ * thread instead, and the window size is set when one is handed out.
+ */
+#ifdef TIOCSCTTY
+#define VP_PTY_POOL_SIZE 4
+
+static struct {
+    int master;
+    int slave;
+} vp_pty_pool[VP_PTY_POOL_SIZE];
+static int vp_pty_pool_n = 0;
+static int vp_pty_pool_filling = 0;
+static int vp_pty_pool_joinable = 0;
+static pthread_t vp_pty_pool_thread;
+static pthread_mutex_t vp_pty_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Both ends are close-on-exec. */
+static int
+vp_pty_pair(int *master, int *slave)
+{
+#if defined __linux__ && defined O_CLOEXEC
+    char name[64];
+    int m, s = -1;
+
+    if ((m = open("/dev/ptmx", O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1)
+        return -1;
+    if (grantpt(m) < 0 || unlockpt(m) < 0)
+        goto error;
+#ifdef TIOCGPTPEER
+    s = ioctl(m, TIOCGPTPEER, O_RDWR | O_NOCTTY | O_CLOEXEC);
+#endif
+    if (s == -1) {
+        if (ptsname_r(m, name, sizeof(name)) != 0)
+            goto error;
+        if ((s = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1)
+            goto error;
+    }
+    *master = m;
+    *slave = s;
+    return 0;
+
+error:
+    close(m);
+    return -1;
+#else
+    if (openpty(master, slave, NULL, NULL, NULL) < 0)
+        return -1;
+    (void)fcntl(*master, F_SETFD, FD_CLOEXEC);
+    (void)fcntl(*slave, F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+static void *
+vp_pty_pool_fill(void *arg)
+{
+    int m, s;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&vp_pty_pool_lock);
+        if (vp_pty_pool_n >= VP_PTY_POOL_SIZE)
+            break;
+        pthread_mutex_unlock(&vp_pty_pool_lock);
+
+        if (vp_pty_pair(&m, &s) < 0) {
+            pthread_mutex_lock(&vp_pty_pool_lock);
+            break;
+        }
+
+        pthread_mutex_lock(&vp_pty_pool_lock);
+        vp_pty_pool[vp_pty_pool_n].master = m;
+        vp_pty_pool[vp_pty_pool_n].slave = s;
+        ++vp_pty_pool_n;
+        pthread_mutex_unlock(&vp_pty_pool_lock);
+    }
+    vp_pty_pool_filling = 0;
+    pthread_mutex_unlock(&vp_pty_pool_lock);
+    return NULL;
+}
+
+/* Take a pair from the pool, or open one if it is empty. */
+static int
+vp_pty_take(int *master, int *slave, struct winsize *ws)
+{
+    int got = 0;
+
+    pthread_mutex_lock(&vp_pty_pool_lock);
+    if (vp_pty_pool_n > 0) {
+        --vp_pty_pool_n;
+        *master = vp_pty_pool[vp_pty_pool_n].master;
+        *slave = vp_pty_pool[vp_pty_pool_n].slave;
+        got = 1;
+    }
+    if (!vp_pty_pool_filling) {
+        /* The last one has released the lock for good. */
+        if (vp_pty_pool_joinable)
+            pthread_join(vp_pty_pool_thread, NULL);
+        vp_pty_pool_joinable = (pthread_create(&vp_pty_pool_thread, NULL,
+                    vp_pty_pool_fill, NULL) == 0);
+        vp_pty_pool_filling = vp_pty_pool_joinable;
+    }
+    pthread_mutex_unlock(&vp_pty_pool_lock);
+
+    if (!got && vp_pty_pair(master, slave) < 0)
+        return -1;
+    (void)ioctl(*slave, TIOCSWINSZ, ws);
+    return 0;
+}
+
+/* Join the filler and close the pairs, before unloading. */
+static void
+vp_pty_pool_stop(void)
+{
+    if (vp_pty_pool_joinable) {
+        pthread_join(vp_pty_pool_thread, NULL);
+        vp_pty_pool_joinable = vp_pty_pool_filling = 0;
+    }
+    while (vp_pty_pool_n > 0) {
+        --vp_pty_pool_n;
+        close(vp_pty_pool[vp_pty_pool_n].master);
+        close(vp_pty_pool[vp_pty_pool_n].slave);
+    }
+}
+
+/* login_tty() for a slave from vp_pty_take(). */
+static int
+vp_pty_login(int slave)
+{
+    if (setsid() < 0 || ioctl(slave, TIOCSCTTY, 0) < 0)
+        return -1;
+    if (dup2(slave, STDIN_FILENO) != STDIN_FILENO
+            || dup2(slave, STDOUT_FILENO) != STDOUT_FILENO
+            || dup2(slave, STDERR_FILENO) != STDERR_FILENO)
+        return -1;
+    if (slave > STDERR_FILENO)
+        close(slave);
+    return 0;
+}
+#endif
+
+const char *
+vp_pipe_open(char *args)
+{
+#define VP_GOTO_ERROR(_fmt) do { errfmt = (_fmt); goto error; } while(0)
+    vp_stack_t stack;
+    int npipe, hstdin, hstderr, hstdout;
+    int argc;
+    int fd[3][2] = {{0}};
+    pid_t pid;
+    int dummy;
+    char *errfmt;
+    char **argv;
+    char path[4096];
+    vp_spawn_opts_t opts;
+    const char *err;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &npipe));
+    if (npipe != 2 && npipe != 3)
+        return vp_stack_return_error(&_result, "npipe range error. wrong pipes.");
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstdin));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstdout));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstderr));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
+    VP_RETURN_IF_FAIL(pop_argv(&stack, argc, &argv));
+    if ((err = vp_spawn_opts_pop(&stack, &opts)) != NULL
+            || (err = resolve_argv0(argv[0], opts.cwdname,
+                    vp_spawn_envpath(&opts), path, sizeof(path))) != NULL) {
+        vp_spawn_opts_free(&opts);
+        free(argv);
+        return err;
+    }
+    if (opts.has_termios) {
+        vp_spawn_opts_free(&opts);
+        free(argv);
+        return vp_stack_return_error(&_result,
+                "unsupported spawn option: termios");
+    }
+
+    if (hstdin > 0) {
+        fd[0][0] = hstdin;
+        fd[0][1] = 0;
+    } else {
+        if (pipe(fd[0]) < 0) {
+            VP_GOTO_ERROR("pipe() error: %s");
+        }
+    }
+    if (hstdout > 0) {
+        fd[1][1] = hstdout;
+        fd[1][0] = 0;
+    } else {
+        if (pipe(fd[1]) < 0) {
+            VP_GOTO_ERROR("pipe() error: %s");
+        }
+    }
+    if (hstderr > 0) {
+        fd[2][1] = hstderr;
+        fd[2][0] = 0;
+    } else if (npipe == 3 && hstderr == 0) {
+        if (pipe(fd[2]) < 0) {
+            VP_GOTO_ERROR("pipe() error: %s");
+        }
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        VP_GOTO_ERROR("fork() error: %s");
+    } else if (pid == 0) {
+        /* child */
+        /* Set process group. */
+        setpgid(0, 0);
+
+        if (fd[0][1] > 0) {
+            close(fd[0][1]);
+        }
+        if (fd[1][0] > 0) {
+            close(fd[1][0]);
+        }
+        if (fd[2][0] > 0) {
+            close(fd[2][0]);
+        }
+        if (fd[0][0] > 0) {
+            if (dup2(fd[0][0], STDIN_FILENO) != STDIN_FILENO) {
+                goto child_error;
+            }
+            close(fd[0][0]);
+        }
+        if (fd[1][1] > 0) {
+            if (dup2(fd[1][1], STDOUT_FILENO) != STDOUT_FILENO) {
+                goto child_error;
+            }
+            close(fd[1][1]);
+        }
+        if (fd[2][1] > 0) {
+            if (dup2(fd[2][1], STDERR_FILENO) != STDERR_FILENO) {
+                goto child_error;
+            }
+            close(fd[2][1]);
+        } else if (npipe == 2) {
+            if (dup2(STDOUT_FILENO, STDERR_FILENO) != STDERR_FILENO) {
+                goto child_error;
+            }
+        }
+
+        {
+#ifndef TIOCNOTTY
+            setsid();
+#else
+            /* Ignore tty. */
+            char name[L_ctermid];
+            if (ctermid(name)[0] != '\0') {
+                int tfd;
+                if ((tfd = open(name, O_RDONLY)) != -1) {
+                    ioctl(tfd, TIOCNOTTY, NULL);
+                    close(tfd);
+                }
+            }
+#endif
+        }
+
+        if (vp_spawn_opts_apply(&opts) < 0) {
+            goto child_error;
+        }
+
+        if (opts.envp != NULL)
+            execve(path, argv, opts.envp);
+        else
+            execv(path, argv);
+        /* error */
+        goto child_error;
+    } else {
+        /* parent */
+        free(argv);
+        vp_spawn_opts_free(&opts);
+        if (fd[0][0] > 0) {
+            close(fd[0][0]);
+        }
+        if (fd[1][1] > 0) {
+            close(fd[1][1]);
+        }
+        if (fd[2][1] > 0) {
+            close(fd[2][1]);
+        }
+
+        vp_spawn_add(pid);
+        vp_stack_push_num(&_result, "%d", pid);
+        vp_stack_push_num(&_result, "%d", fd[0][1]);
+        vp_stack_push_num(&_result, "%d", fd[1][0]);
+        if (npipe == 3) {
+            vp_stack_push_num(&_result, "%d", fd[2][0]);
+        }
+        return vp_stack_return(&_result);
+    }
+    /* DO NOT REACH HERE */
+    return NULL;
+
+    /* error */
+error:
+    free(argv);
+    close_fds(fd);
+    err = vp_stack_return_error(&_result, errfmt, strerror(errno));
+    vp_spawn_opts_free(&opts);
+    return err;
+
+child_error:
+    dummy = write(STDOUT_FILENO, strerror(errno), strlen(strerror(errno)));
+    _exit(EXIT_FAILURE);
+#undef VP_GOTO_ERROR
+}
+
+const char *
+vp_pipe_close(char *args)
+{
+    return vp_file_close(args);
+}
+
+const char *
+vp_pipe_read(char *args)
+{
+    return vp_file_read(args);
+}
+
+const char *
+vp_pipe_write(char *args)
+{
+    return vp_file_write(args);
+}
+
+const char *
+vp_pty_open(char *args)
+{
+#define VP_GOTO_ERROR(_fmt) do { errfmt = (_fmt); goto error; } while(0)
+    vp_stack_t stack;
+    int argc;
+    int fd[3][2] = {{0}};
+    pid_t pid;
+    struct winsize ws = {0, 0, 0, 0};
+    int dummy;
+    int hstdin, hstderr, hstdout;
+    int fdm, fds;
+    int npipe;
+    char *errfmt;
+    char **argv;
+    char path[4096];
+    vp_spawn_opts_t opts;
+    const char *err;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &npipe));
+    if (npipe != 2 && npipe != 3)
+        return vp_stack_return_error(&_result, "npipe range error. wrong pipes.");
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_col)));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_row)));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstdin));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstdout));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstderr));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
+    VP_RETURN_IF_FAIL(pop_argv(&stack, argc, &argv));
+    if ((err = vp_spawn_opts_pop(&stack, &opts)) != NULL
+            || (err = resolve_argv0(argv[0], opts.cwdname,
+                    vp_spawn_envpath(&opts), path, sizeof(path))) != NULL) {
+        vp_spawn_opts_free(&opts);
+        free(argv);
+        return err;
+    }
+
+    /* Set pipe */
+    if (hstdin > 0) {
+        fd[0][0] = hstdin;
+        fd[0][1] = 0;
+    }
+    if (hstdout > 1) {
+        fd[1][1] = hstdout;
+        fd[1][0] = 0;
+    } else if (hstdout == 1) {
+        if (pipe(fd[1]) < 0) {
+            VP_GOTO_ERROR("pipe() error: %s");
+        }
+    }
+    if (hstderr > 1) {
+        fd[2][1] = hstderr;
+        fd[2][0] = 0;
+    } else if (npipe == 3) {
+        if (hstderr == 1){
+            if (pipe(fd[2]) < 0) {
+                VP_GOTO_ERROR("pipe() error: %s");
+            }
+        } else if (hstderr == 0) {
+#ifdef TIOCSCTTY
+            if (vp_pty_take(&fd[2][0], &fd[2][1], &ws) < 0) {
+#else
+            if (openpty(&fd[2][0], &fd[2][1], NULL, NULL, &ws) < 0) {
+#endif
+                VP_GOTO_ERROR("openpty() error: %s");
+            }
+        }
+    }
+
+#ifdef TIOCSCTTY
+    if (vp_pty_take(&fdm, &fds, &ws) < 0) {
+        VP_GOTO_ERROR("openpty() error: %s");
+    }
+    pid = fork();
+    if (pid < 0) {
+        close(fdm);
+        close(fds);
+    }
+#else
+    pid = forkpty(&fdm, NULL, NULL, &ws);
+#endif
+    if (pid < 0) {
+        VP_GOTO_ERROR("fork() error: %s");
+    } else if (pid == 0) {
+        /* child */
+#ifdef TIOCSCTTY
+        close(fdm);
+        if (vp_pty_login(fds) < 0) {
+            goto child_error;
+        }
+#endif
+        /* Before exec, so that the first read sees the mode. */
+        if (opts.has_termios
+                && vp_termios_apply(STDIN_FILENO, &opts.termios) < 0) {
+            goto child_error;
+        }
+        if (opts.has_termios && npipe == 3 && hstderr == 0
+                && vp_termios_apply(fd[2][1], &opts.termios) < 0) {
+            goto child_error;
+        }
+        /* Close pipe */
+        if (fd[1][0] > 0) {
+            close(fd[1][0]);
+        }
+        if (fd[2][0] > 0) {
+            close(fd[2][0]);
+        }
+
+        if (fd[0][0] > 0) {
+            if (dup2(fd[0][0], STDIN_FILENO) != STDIN_FILENO) {
+                goto child_error;
+            }
+            close(fd[0][0]);
+        }
+
+        if (fd[1][1] > 0) {
+            if (dup2(fd[1][1], STDOUT_FILENO) != STDOUT_FILENO) {
+                goto child_error;
+            }
+            close(fd[1][1]);
+        }
+
+        if (fd[2][1] > 0) {
+            if (dup2(fd[2][1], STDERR_FILENO) != STDERR_FILENO) {
+                goto child_error;
+            }
+            close(fd[2][1]);
+        }
+
+        if (vp_spawn_opts_apply(&opts) < 0) {
+            goto child_error;
+        }
+
+        if (opts.envp != NULL)
+            execve(path, argv, opts.envp);
+        else
+            execv(path, argv);
+        /* error */
+        goto child_error;
+    } else {
+        /* parent */
+        free(argv);
+        vp_spawn_opts_free(&opts);
+#ifdef TIOCSCTTY
+        close(fds);
+#endif
+        if (fd[1][1] > 0) {
+            close(fd[1][1]);
+        }
+        if (fd[2][1] > 0) {
+            close(fd[2][1]);
+        }
+
+        if (hstdin == 0) {
+            fd[0][1] = fdm;
+        }
+        if (hstdout == 0) {
+            fd[1][0] = hstdin == 0 ? dup(fdm) : fdm;
+        }
+
+        vp_spawn_add(pid);
         vp_stack_push_num(&_result, "%d", pid);
         vp_stack_push_num(&_result, "%d", fd[0][1]);
         vp_stack_push_num(&_result, "%d", fd[1][0]);
         if (npipe == 3) {
             vp_stack_push_num(&_result, "%d", fd[2][0]);
         }
-        return vp_stack_return(&_result);
+        return vp_stack_return(&_result);
+    }
+    /* DO NOT REACH HERE */
+    return NULL;
+
+    /* error */
+error:
+    free(argv);
+    close_fds(fd);
+    err = vp_stack_return_error(&_result, errfmt, strerror(errno));
+    vp_spawn_opts_free(&opts);
+    return err;
+
+child_error:
+    dummy = write(STDOUT_FILENO, strerror(errno), strlen(strerror(errno)));
+    _exit(EXIT_FAILURE);
+#undef VP_GOTO_ERROR
+}
+
+const char *
+vp_pty_close(char *args)
+{
+    return vp_file_close(args);
+}
+
+const char *
+vp_pty_read(char *args)
+{
+    return vp_file_read(args);
+}
+
+const char *
+vp_pty_write(char *args)
+{
+    return vp_file_write(args);
+}
+
+const char *
+vp_pty_get_winsize(char *args)
+{
+    vp_stack_t stack;
+    int fd;
+    struct winsize ws = {0, 0, 0, 0};
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+
+    if (ioctl(fd, TIOCGWINSZ, &ws) < 0)
+        return vp_stack_return_error(&_result, "ioctl() error: %s",
+                strerror(errno));
+    vp_stack_push_num(&_result, "%hu", ws.ws_col);
+    vp_stack_push_num(&_result, "%hu", ws.ws_row);
+    return vp_stack_return(&_result);
+}
+const char *
+vp_pty_set_winsize(char *args)
+{
+    vp_stack_t stack;
+    int fd;
+    struct winsize ws = {0, 0, 0, 0};
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_col)));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_row)));
+
+    if (ioctl(fd, TIOCSWINSZ, &ws) < 0)
+        return vp_stack_return_error(&_result, "ioctl() error: %s",
+                strerror(errno));
+    return NULL;
+}
+
+const char *
+vp_pty_set_mode(char *args)
+{
+    vp_stack_t stack;
+    int fd;
+    char *value;
+    vp_termios_t spec;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &value));
+
+    if (vp_termios_parse(value, &spec) < 0)
+        return vp_stack_return_error(&_result, "invalid termios: %s", value);
+    if (vp_termios_apply(fd, &spec) < 0)
+        return vp_stack_return_error(&_result, "tcsetattr() error: %s",
+                strerror(errno));
+    return NULL;
+}
+
+/*
+ * Coalescing pty reader for vp_pty_coalesce().  A thread drains the pty
+ * continuously, either into a ring buffer which keeps only the last
+ * bufsize bytes, or into a shadow screen of a vp_term_*() terminal.
+ * vp_pty_read_frame() hands out at most one frame per interval.
+ */
+#define VP_COALESCE_MAX 16
+
+typedef struct vp_coalesce_t {
+    int fd;             /* 0 if unused */
+    int term;           /* vp_terms[] index or -1 */
+    vp_term_t *shadow;  /* parsed by the thread if term >= 0 */
+    char *buf;          /* ring buffer if term < 0 */
+    size_t size;
+    size_t head;
+    size_t len;
+    size_t nread;       /* since the last frame */
+    size_t dropped;     /* since the last frame */
+    int eof;
+    int interval;
+    long last;          /* vp_msec_now() of the last frame */
+    int wake[2];        /* stops the thread */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} vp_coalesce_t;
+
+static vp_coalesce_t vp_coalesce[VP_COALESCE_MAX];
+
+static vp_coalesce_t *
+vp_coalesce_find(int fd)
+{
+    int i;
+
+    for (i = 0; i < VP_COALESCE_MAX; ++i)
+        if (vp_coalesce[i].fd == fd)
+            return &vp_coalesce[i];
+    return NULL;
+}
+
+static void
+vp_coalesce_append(vp_coalesce_t *c, const char *buf, size_t n)
+{
+    size_t tail, first;
+
+    if (n > c->size) {
+        c->dropped += n - c->size;
+        buf += n - c->size;
+        n = c->size;
+    }
+    if (c->len + n > c->size) {
+        size_t drop = c->len + n - c->size;
+
+        c->dropped += drop;
+        c->head = (c->head + drop) % c->size;
+        c->len -= drop;
+    }
+    tail = (c->head + c->len) % c->size;
+    first = (n < c->size - tail) ? n : c->size - tail;
+    memcpy(c->buf + tail, buf, first);
+    memcpy(c->buf, buf + first, n - first);
+    c->len += n;
+}
+
+static void *
+vp_coalesce_thread(void *arg)
+{
+    vp_coalesce_t *c = arg;
+    struct pollfd pfd[2];
+    char buf[65536];
+    char reply[sizeof(((vp_term_t *)0)->reply)];
+    size_t nreply;
+    ssize_t n;
+
+    pfd[0].fd = c->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = c->wake[0];
+    pfd[1].events = POLLIN;
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            n = -1;
+        } else if (pfd[1].revents != 0) {
+            return NULL;
+        } else {
+            n = read(c->fd, buf, sizeof(buf));
+            if (n == -1 && (errno == EINTR || errno == EAGAIN))
+                continue;
+        }
+
+        pthread_mutex_lock(&c->lock);
+        if (n <= 0) {
+            c->eof = 1;
+            pthread_cond_signal(&c->cond);
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        nreply = 0;
+        if (c->shadow != NULL) {
+            vp_term_parse(c->shadow, buf, n);
+            nreply = c->shadow->nreply;
+            memcpy(reply, c->shadow->reply, nreply);
+            c->shadow->nreply = 0;
+        } else {
+            vp_coalesce_append(c, buf, n);
+        }
+        c->nread += n;
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+
+        if (nreply > 0 && write(c->fd, reply, nreply) < 0) {
+            /* the child went away */
+        }
+    }
+}
+
+static void
+vp_coalesce_stop(vp_coalesce_t *c)
+{
+    if (c == NULL || c->fd == 0)
+        return;
+    if (write(c->wake[1], "", 1) == 1)
+        pthread_join(c->thread, NULL);
+    close(c->wake[0]);
+    close(c->wake[1]);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    vp_term_free(c->shadow);
+    free(c->buf);
+    memset(c, 0, sizeof(*c));
+}
+
+/* Wait until the vp_msec_now() time until, or forever if negative. */
+static void
+vp_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, long until)
+{
+    struct timespec ts;
+    long wait;
+
+    if (until < 0) {
+        pthread_cond_wait(cond, lock);
+        return;
+    }
+    wait = until - vp_msec_now();
+    if (wait <= 0)
+        return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += wait / 1000;
+    ts.tv_nsec += (wait % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(cond, lock, &ts);
+}
+
+static void
+vp_coalesce_wait(vp_coalesce_t *c, long until)
+{
+    vp_cond_wait(&c->cond, &c->lock, until);
+}
+
+/* Called when fd is closed. */
+static void
+vp_coalesce_close(int fd)
+{
+    if (fd > 0)
+        vp_coalesce_stop(vp_coalesce_find(fd));
+}
+
+/*
+ * Terminal screens for vp_term_*().  See vimterm.c.
+ */
+#define VP_TERM_MAX 64
+#define VP_TERM_READ_MAX (1024 * 1024)
+
+static vp_term_t *vp_terms[VP_TERM_MAX];
+
+static const char *
+vp_term_pop(vp_stack_t *stack, vp_term_t **t)
+{
+    int id;
+
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(stack, "%d", &id));
+    if (id < 0 || id >= VP_TERM_MAX || vp_terms[id] == NULL)
+        return vp_stack_return_error(&_result, "invalid term: %d", id);
+    *t = vp_terms[id];
+    return NULL;
+}
+
+/* Push cells as [text, runs]. */
+static const char *
+vp_term_push_line(const vp_cell_t *cells, int n)
+{
+    char *text = malloc(VP_TERM_TEXT_SIZE(n));
+    char *runs = malloc(VP_TERM_RUNS_SIZE(n));
+
+    if (text == NULL || runs == NULL) {
+        free(text);
+        free(runs);
+        return vp_stack_return_error(&_result, "malloc() error: %s",
+                strerror(errno));
+    }
+    vp_term_encode(cells, n, text, runs);
+    vp_stack_push_str(&_result, text);
+    vp_stack_push_str(&_result, runs);
+    free(text);
+    free(runs);
+    return NULL;
+}
+
+const char *
+vp_term_open(char *args)
+{
+    vp_stack_t stack;
+    int cols, rows, scrollback;
+    int id;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &cols));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &rows));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &scrollback));
+
+    for (id = 0; id < VP_TERM_MAX && vp_terms[id] != NULL; ++id)
+        ;
+    if (id == VP_TERM_MAX)
+        return vp_stack_return_error(&_result, "too many terms");
+    if ((vp_terms[id] = vp_term_new(cols, rows, scrollback)) == NULL)
+        return vp_stack_return_error(&_result, "vp_term_new() error");
+    vp_stack_push_num(&_result, "%d", id);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_term_close(char *args)
+{
+    vp_stack_t stack;
+    int id;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &id));
+
+    if (id >= 0 && id < VP_TERM_MAX) {
+        int i;
+
+        for (i = 0; i < VP_COALESCE_MAX; ++i)
+            if (vp_coalesce[i].fd != 0 && vp_coalesce[i].term == id)
+                vp_coalesce_stop(&vp_coalesce[i]);
+        vp_term_free(vp_terms[id]);
+        vp_terms[id] = NULL;
+    }
+    return NULL;
+}
+
+const char *
+vp_term_resize(char *args)
+{
+    vp_stack_t stack;
+    vp_term_t *t;
+    int cols, rows;
+    int i;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_term_pop(&stack, &t));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &cols));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &rows));
+
+    if (vp_term_resize_screen(t, cols, rows) < 0)
+        return vp_stack_return_error(&_result, "invalid size: %dx%d",
+                cols, rows);
+    for (i = 0; i < VP_COALESCE_MAX; ++i) {
+        vp_coalesce_t *c = &vp_coalesce[i];
+
+        if (c->fd != 0 && c->shadow != NULL && vp_terms[c->term] == t) {
+            /* t has already moved the lines to its own scrollback. */
+            int sb_new;
+
+            pthread_mutex_lock(&c->lock);
+            sb_new = c->shadow->sb_new;
+            vp_term_resize_screen(c->shadow, cols, rows);
+            c->shadow->sb_new = sb_new;
+            pthread_mutex_unlock(&c->lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Parse everything which is readable from fd without waiting longer than
+ * timeout for the first byte.  Answers to terminal queries are written
+ * back to fd.
+ */
+const char *
+vp_term_read(char *args)
+{
+    vp_stack_t stack;
+    vp_term_t *t;
+    int fd;
+    int timeout;
+    ssize_t n;
+    size_t total = 0;
+    int eof = 0;
+    char buf[65536];
+    struct pollfd pfd = {0, POLLIN, 0};
+    vp_lines_t *lines;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_term_pop(&stack, &t));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    pfd.fd = fd;
+    if ((lines = vp_lines_find(fd, 0)) != NULL && lines->len > 0) {
+        /* The partial line of vp_file_read_lines() comes first. */
+        vp_term_parse(t, lines->buf, lines->len);
+        total += lines->len;
+        lines->len = 0;
+        lines->scanned = 0;
+        timeout = 0;
+    }
+    while (total < VP_TERM_READ_MAX) {
+        n = poll(&pfd, 1, timeout);
+        if (n == -1) {
+            eof = 1;
+            break;
+        } else if (n == 0) {
+            break;
+        }
+        if (pfd.revents & POLLIN) {
+            n = read(fd, buf, sizeof(buf));
+            if (n <= 0) {
+                /* A pty master fails with EIO when the slave is closed. */
+                if (n == -1 && errno != EIO)
+                    return vp_stack_return_error(&_result,
+                            "read() error: %s", strerror(errno));
+                eof = 1;
+                break;
+            }
+            vp_term_parse(t, buf, n);
+            total += n;
+            timeout = 0;
+        } else if (pfd.revents & (POLLERR | POLLHUP)) {
+            eof = 1;
+            break;
+        } else {
+            return vp_stack_return_error(&_result,
+                    "poll() unknown status: %d", pfd.revents);
+        }
+    }
+
+    if (t->nreply > 0 && !eof) {
+        if (write(fd, t->reply, t->nreply) < 0) {
+            /* the child went away */
+        }
+    }
+    t->nreply = 0;
+
+    vp_stack_push_num(&_result, "%d", eof);
+    vp_stack_push_num(&_result, "%lu", (unsigned long)total);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_term_feed(char *args)
+{
+    vp_stack_t stack;
+    vp_term_t *t;
+    char *buf;
+    size_t size;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_term_pop(&stack, &t));
+    VP_RETURN_IF_FAIL(vp_stack_pop_bin(&stack, &buf, &size));
+
+    vp_term_parse(t, buf, size);
+    vp_stack_push_bin(&_result, t->reply, t->nreply);
+    t->nreply = 0;
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_term_damage(char *args)
+{
+    vp_stack_t stack;
+    vp_term_t *t;
+    int y;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_term_pop(&stack, &t));
+
+    vp_stack_push_num(&_result, "%d", t->cur.y);
+    vp_stack_push_num(&_result, "%d", t->cur.x);
+    vp_stack_push_num(&_result, "%d", t->cursor_visible);
+    vp_stack_push_str(&_result, t->title);
+    vp_stack_push_num(&_result, "%d", t->sb_new);
+    t->sb_new = 0;
+    for (y = 0; y < t->rows; ++y) {
+        if (!t->dirty[y])
+            continue;
+        vp_stack_push_num(&_result, "%d", y);
+        VP_RETURN_IF_FAIL(vp_term_push_line(VP_TERM_CELL(t, y, 0), t->cols));
+        t->dirty[y] = 0;
+    }
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_term_lines(char *args)
+{
+    vp_stack_t stack;
+    vp_term_t *t;
+    int start, count;
+    int y, n;
+    const vp_cell_t *cells;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_term_pop(&stack, &t));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &start));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &count));
+
+    if (start < -t->sb_count) {
+        count -= -t->sb_count - start;
+        start = -t->sb_count;
+    }
+    for (y = start; y < start + count; ++y) {
+        if (vp_term_line(t, y, &cells, &n) < 0)
+            break;
+        VP_RETURN_IF_FAIL(vp_term_push_line(cells, n));
+    }
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_pty_coalesce(char *args)
+{
+    vp_stack_t stack;
+    int fd;
+    int bufsize;
+    int interval;
+    int term;
+    vp_coalesce_t *c;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &bufsize));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &interval));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &term));
+
+    vp_coalesce_stop(vp_coalesce_find(fd));
+    if (bufsize <= 0)
+        return NULL;
+    if (term >= 0 && (term >= VP_TERM_MAX || vp_terms[term] == NULL))
+        return vp_stack_return_error(&_result, "invalid term: %d", term);
+    if (fd <= 0 || (c = vp_coalesce_find(0)) == NULL)
+        return vp_stack_return_error(&_result, "too many coalesced ptys");
+
+    c->term = term;
+    c->size = bufsize;
+    c->interval = interval;
+    if (term >= 0)
+        c->shadow = vp_term_new(vp_terms[term]->cols,
+                vp_terms[term]->rows, vp_terms[term]->sb_cap);
+    else
+        c->buf = malloc(bufsize);
+    if ((c->shadow == NULL && c->buf == NULL) || pipe(c->wake) < 0) {
+        vp_term_free(c->shadow);
+        free(c->buf);
+        memset(c, 0, sizeof(*c));
+        return vp_stack_return_error(&_result, "vp_pty_coalesce: %s",
+                strerror(errno));
+    }
+    if (term >= 0) {
+        /* A copy to start from; damage() still reports the new lines,
+         * and the first frame must not push them again. */
+        int sb_new = vp_terms[term]->sb_new;
+
+        vp_term_sync(c->shadow, vp_terms[term]);
+        vp_terms[term]->sb_new = sb_new;
+        c->shadow->sb_new = 0;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    c->fd = fd;
+    if (pthread_create(&c->thread, NULL, vp_coalesce_thread, c) != 0) {
+        int err = errno;
+
+        close(c->wake[1]);
+        c->wake[1] = -1;
+        vp_coalesce_stop(c);
+        return vp_stack_return_error(&_result, "pthread_create() error: %s",
+                strerror(err));
+    }
+    return NULL;
+}
+
+const char *
+vp_pty_read_frame(char *args)
+{
+    vp_stack_t stack;
+    int fd;
+    int timeout;
+    long deadline, due;
+    size_t first;
+    int ready;
+    vp_coalesce_t *c;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    if ((c = vp_coalesce_find(fd)) == NULL || fd == 0)
+        return vp_stack_return_error(&_result, "not coalesced: %d", fd);
+
+    deadline = (timeout < 0) ? -1 : vp_msec_now() + timeout;
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        long now = vp_msec_now();
+
+        ready = c->nread > 0 || c->len > 0 || c->eof;
+        due = c->last + c->interval;
+        if (ready && (now >= due || c->eof))
+            break;
+        if (deadline >= 0 && now >= deadline) {
+            /* keep it for the next frame */
+            ready = 0;
+            break;
+        }
+        vp_coalesce_wait(c, !ready ? deadline
+                : (deadline < 0 || due < deadline) ? due : deadline);
+    }
+
+    vp_stack_push_str(&_result, "");
+    if (ready) {
+        if (c->shadow != NULL) {
+            vp_term_sync(vp_terms[c->term], c->shadow);
+        } else if (c->len > 0) {
+            first = (c->len < c->size - c->head) ? c->len
+                : c->size - c->head;
+            _result.top--;
+            vp_stack_push_bin(&_result, c->buf + c->head, first);
+            if (first < c->len) {
+                _result.top--;
+                vp_stack_push_bin(&_result, c->buf, c->len - first);
+            }
+            c->head = c->len = 0;
+        }
+        c->last = vp_msec_now();
+    }
+    vp_stack_push_num(&_result, "%lu",
+            (unsigned long)(ready ? c->dropped : 0));
+    vp_stack_push_num(&_result, "%d", ready && c->eof);
+    if (ready) {
+        c->nread = 0;
+        c->dropped = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_kill(char *args)
+{
+    vp_stack_t stack;
+    pid_t pid, pgid;
+    int sig;
+    int ret;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &pid));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &sig));
+
+    ret = kill(pid, sig);
+    if (ret < 0)
+        return vp_stack_return_error(&_result, "kill() error: %s",
+                strerror(errno));
+
+    if (sig != 0) {
+        /* Kill by the process group. */
+        pgid = getpgid(pid);
+        if (pgid > 0) {
+            kill(-pgid, sig);
+        }
+    }
+
+    vp_stack_push_num(&_result, "%d", ret);
+    return vp_stack_return(&_result);
+}
+
+static const char *
+vp_wait4(char *args, int rusage)
+{
+    vp_stack_t stack;
+    pid_t pid, pgid;
+    pid_t n;
+    int status;
+    struct rusage ru;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &pid));
+
+    memset(&ru, 0, sizeof(ru));
+    n = wait4(pid, &status, WNOHANG | WUNTRACED, &ru);
+    if (n == -1)
+        return vp_stack_return_error(&_result, "waitpid() error: %s",
+                strerror(errno));
+    if (n == 0 || WIFCONTINUED(status)) {
+        vp_stack_push_str(&_result, "run");
+        vp_stack_push_num(&_result, "%d", 0);
+    } else if (WIFEXITED(status)) {
+        /* Kill by the process group. */
+        pgid = getpgid(pid);
+        if (pgid > 0) {
+            kill(-pgid, 15);
+        }
+
+        vp_stack_push_str(&_result, "exit");
+        vp_stack_push_num(&_result, "%d", WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        vp_stack_push_str(&_result, "signal");
+        vp_stack_push_num(&_result, "%d", WTERMSIG(status));
+    } else if (WIFSTOPPED(status)) {
+        vp_stack_push_str(&_result, "stop");
+        vp_stack_push_num(&_result, "%d", WSTOPSIG(status));
+    } else {
+        return vp_stack_return_error(&_result,
+                "waitpid() unknown status: status=%d", status);
+    }
+
+    if (rusage) {
+        int reaped = (n != 0 && (WIFEXITED(status) || WIFSIGNALED(status)));
+
+        vp_stack_push_num(&_result, "%ld", (long)ru.ru_utime.tv_sec * 1000
+                + ru.ru_utime.tv_usec / 1000);
+        vp_stack_push_num(&_result, "%ld", (long)ru.ru_stime.tv_sec * 1000
+                + ru.ru_stime.tv_usec / 1000);
+        /* Linux and the BSDs count in KB, macOS in bytes. */
+#ifdef __APPLE__
+        vp_stack_push_num(&_result, "%ld", ru.ru_maxrss / 1024);
+#else
+        vp_stack_push_num(&_result, "%ld", ru.ru_maxrss);
+#endif
+        vp_stack_push_num(&_result, "%ld", ru.ru_nvcsw);
+        vp_stack_push_num(&_result, "%ld", ru.ru_nivcsw);
+        vp_stack_push_num(&_result, "%ld", vp_spawn_wall(pid, reaped));
+    } else if (n != 0 && (WIFEXITED(status) || WIFSIGNALED(status))) {
+        vp_spawn_wall(pid, 1);
+    }
+
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_waitpid(char *args)
+{
+    return vp_wait4(args, 0);
+}
+
+/* The resource usage is zero while the process runs. */
+const char *
+vp_waitpid_rusage(char *args)
+{
+    return vp_wait4(args, 1);
+}
+
+/*
+ * Resolved hosts for vp_socket_open() and vp_host_exists().
+ * getaddrinfo() does not tell the TTL of the records, so an entry lives
+ * VP_DNS_TTL msec, and a failure VP_DNS_NEG_TTL msec.  The addresses are
+ * kept in the Happy Eyeballs order: the families interleaved, starting
+ * with the one getaddrinfo() prefers.
+ */
+#define VP_DNS_CACHE_SIZE   16
+#define VP_DNS_ADDR_MAX     8
+#define VP_DNS_TTL          60000
+#define VP_DNS_NEG_TTL      5000
+
+typedef struct vp_dns_entry_t {
+    char host[256];
+    long expire;        /* vp_msec_now(); 0 if unused */
+    int error;          /* EAI_* of a failure */
+    int naddr;
+    struct sockaddr_storage addr[VP_DNS_ADDR_MAX];
+    socklen_t addrlen[VP_DNS_ADDR_MAX];
+} vp_dns_entry_t;
+
+static vp_dns_entry_t vp_dns_cache[VP_DNS_CACHE_SIZE];
+static pthread_mutex_t vp_dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+vp_dns_fill(vp_dns_entry_t *e, struct addrinfo *res)
+{
+    struct addrinfo *ai, *list[2][VP_DNS_ADDR_MAX];
+    int n[2] = {0, 0}, i[2] = {0, 0};
+    int k;
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        k = (ai->ai_family != res->ai_family);
+        if (ai->ai_addrlen <= sizeof(e->addr[0]) && n[k] < VP_DNS_ADDR_MAX)
+            list[k][n[k]++] = ai;
+    }
+    e->naddr = 0;
+    for (k = 0; e->naddr < VP_DNS_ADDR_MAX
+            && (i[0] < n[0] || i[1] < n[1]); k = !k) {
+        if (i[k] == n[k])
+            k = !k;
+        ai = list[k][i[k]++];
+        memcpy(&e->addr[e->naddr], ai->ai_addr, ai->ai_addrlen);
+        e->addrlen[e->naddr++] = ai->ai_addrlen;
+    }
+}
+
+/* Returns 0 or EAI_*.  addr and addrlen have VP_DNS_ADDR_MAX slots. */
+static int
+vp_dns_lookup(const char *host, struct sockaddr_storage *addr,
+        socklen_t *addrlen, int *naddr)
+{
+    struct addrinfo hints, *res = NULL;
+    vp_dns_entry_t *e, *slot = NULL;
+    long now = vp_msec_now();
+    int ret, i;
+
+    if (strlen(host) >= sizeof(vp_dns_cache[0].host))
+        return EAI_NONAME;
+
+    pthread_mutex_lock(&vp_dns_mutex);
+    for (i = 0; i < VP_DNS_CACHE_SIZE; ++i) {
+        e = &vp_dns_cache[i];
+        if (e->expire != 0 && e->expire > now && strcmp(e->host, host) == 0)
+            break;
+    }
+    if (i < VP_DNS_CACHE_SIZE) {
+        ret = e->error;
+        *naddr = e->naddr;
+        memcpy(addr, e->addr, sizeof(e->addr[0]) * e->naddr);
+        memcpy(addrlen, e->addrlen, sizeof(e->addrlen[0]) * e->naddr);
+        pthread_mutex_unlock(&vp_dns_mutex);
+        return ret;
+    }
+    pthread_mutex_unlock(&vp_dns_mutex);
+
+    /* Not under the lock; a slow resolver should not block others. */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+#ifdef AI_ADDRCONFIG
+    hints.ai_flags = AI_ADDRCONFIG;
+#endif
+    ret = getaddrinfo(host, NULL, &hints, &res);
+
+    pthread_mutex_lock(&vp_dns_mutex);
+    for (i = 0; i < VP_DNS_CACHE_SIZE; ++i) {
+        e = &vp_dns_cache[i];
+        if (e->expire == 0 || e->expire <= now || strcmp(e->host, host) == 0) {
+            slot = e;
+            break;
+        }
+        if (slot == NULL || e->expire < slot->expire)
+            slot = e;
+    }
+    memset(slot, 0, sizeof(*slot));
+    strcpy(slot->host, host);
+    if (ret == 0) {
+        vp_dns_fill(slot, res);
+        slot->expire = now + VP_DNS_TTL;
+    } else if (ret != EAI_SYSTEM) {
+        /* EAI_AGAIN too: a flaky resolver should fail fast the next time. */
+        slot->error = ret;
+        slot->expire = now + VP_DNS_NEG_TTL;
+    }
+    *naddr = slot->naddr;
+    memcpy(addr, slot->addr, sizeof(slot->addr[0]) * slot->naddr);
+    memcpy(addrlen, slot->addrlen, sizeof(slot->addrlen[0]) * slot->naddr);
+    pthread_mutex_unlock(&vp_dns_mutex);
+
+    if (res != NULL)
+        freeaddrinfo(res);
+    return ret;
+}
+
+/*
+ * Happy Eyeballs (RFC 8305) connect(): the next address is tried when
+ * the previous ones did not connect in VP_EYEBALLS_DELAY msec, or at once
+ * when they failed.  The first connected socket wins.  Returns the
+ * blocking socket, or -1 with errno.  timeout is msec, -1 for none.
+ */
+#define VP_EYEBALLS_DELAY   250
+
+static int
+vp_socket_connect(struct sockaddr_storage *addr, const socklen_t *addrlen,
+        int naddr, unsigned short nport, int timeout)
+{
+    struct pollfd pfd[VP_DNS_ADDR_MAX];
+    int npending = 0, next = 0;
+    int sock = -1, lasterr = ECONNREFUSED;
+    long now = vp_msec_now();
+    long deadline = (timeout < 0) ? -1 : now + timeout;
+    long next_start = now;
+    int wait, i, n, soerr;
+    socklen_t len;
+
+    while (sock == -1) {
+        now = vp_msec_now();
+        if (deadline != -1 && now >= deadline) {
+            lasterr = ETIMEDOUT;
+            break;
+        }
+        if (next < naddr && (npending == 0 || now >= next_start)) {
+            struct sockaddr *sa = (struct sockaddr *)&addr[next];
+            int fd;
+
+            if (sa->sa_family == AF_INET6)
+                ((struct sockaddr_in6 *)sa)->sin6_port = nport;
+            else
+                ((struct sockaddr_in *)sa)->sin_port = nport;
+            next_start = now + VP_EYEBALLS_DELAY;
+            if ((fd = socket(sa->sa_family, SOCK_STREAM, 0)) == -1) {
+                lasterr = errno;
+                ++next;
+                continue;
+            }
+            (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+            (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            if (connect(fd, sa, addrlen[next++]) == 0) {
+                sock = fd;
+            } else if (errno == EINPROGRESS) {
+                pfd[npending].fd = fd;
+                pfd[npending++].events = POLLOUT;
+            } else {
+                lasterr = errno;
+                close(fd);
+            }
+            continue;
+        }
+        if (npending == 0)
+            break;
+
+        wait = (next < naddr) ? (int)(next_start - now) : -1;
+        if (deadline != -1 && (wait == -1 || deadline - now < wait))
+            wait = (int)(deadline - now);
+        n = poll(pfd, npending, wait);
+        if (n < 0 && errno != EINTR) {
+            lasterr = errno;
+            break;
+        }
+        for (i = 0; n > 0 && i < npending; ++i) {
+            if (pfd[i].revents == 0)
+                continue;
+            len = sizeof(soerr);
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0)
+                soerr = errno;
+            if (soerr == 0) {
+                sock = pfd[i].fd;
+            } else {
+                lasterr = soerr;
+                close(pfd[i].fd);
+                /* A failure starts the next one now. */
+                next_start = now;
+            }
+            pfd[i--] = pfd[--npending];
+            if (sock != -1)
+                break;
+        }
+    }
+
+    for (i = 0; i < npending; ++i)
+        close(pfd[i].fd);
+    if (sock == -1) {
+        errno = lasterr;
+        return -1;
+    }
+    (void)fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+    return sock;
+}
+
+/* A number or a service name, in network byte order. */
+static int
+vp_socket_port(const char *port, unsigned short *nport)
+{
+    struct servent *servent;
+    char *p;
+    long n;
+
+    n = strtol(port, &p, 10);
+    if (*port != '\0' && *p == '\0') {
+        *nport = htons((unsigned short)n);
+        return 0;
+    }
+    if ((servent = getservbyname(port, NULL)) == NULL)
+        return -1;
+    *nport = (unsigned short)servent->s_port;
+    return 0;
+}
+
+/*
+ * This is based on socket.diff.gz written by Yasuhiro Matsumoto.
+ * see: http://marc.theaimsgroup.com/?l=vim-dev&m=105289857008664&w=2
+ */
+const char *
+vp_socket_open(char *args)
+{
+    vp_stack_t stack;
+    char *host;
+    char *port;
+    unsigned short nport;
+    int sock;
+    int timeout = -1;
+    int naddr;
+    int ret;
+    struct sockaddr_storage addr[VP_DNS_ADDR_MAX];
+    socklen_t addrlen[VP_DNS_ADDR_MAX];
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &host));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &port));
+    if (stack.top != stack.buf)
+        VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    if (vp_socket_port(port, &nport) < 0)
+        return vp_stack_return_error(&_result, "getservbyname() error: %s",
+                port);
+
+    if ((ret = vp_dns_lookup(host, addr, addrlen, &naddr)) != 0)
+        return vp_stack_return_error(&_result, "getaddrinfo() error: %s: %s",
+                host, gai_strerror(ret));
+    if ((sock = vp_socket_connect(addr, addrlen, naddr, nport, timeout)) == -1)
+        return vp_stack_return_error(&_result, "connect() error: %s",
+                strerror(errno));
+
+    vp_stack_push_num(&_result, "%d", sock);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_socket_close(char *args)
+{
+    return vp_file_close(args);
+}
+
+const char *
+vp_socket_read(char *args)
+{
+    return vp_file_read(args);
+}
+
+const char *
+vp_socket_write(char *args)
+{
+    return vp_file_write(args);
+}
+
+/* sendmsg() does not raise SIGPIPE on a closed peer. */
+const char *
+vp_socket_writev(char *args)
+{
+    return vp_writev(args, 1);
+}
+
+/* The names of vp_socket_setopt().  "cork" holds partial frames. */
+static const struct {
+    const char *name;
+    int level;
+    int opt;
+} vp_socket_opts[] = {
+    {"nodelay",     IPPROTO_TCP, TCP_NODELAY},
+#if defined TCP_CORK
+    {"cork",        IPPROTO_TCP, TCP_CORK},
+#elif defined TCP_NOPUSH
+    {"cork",        IPPROTO_TCP, TCP_NOPUSH},
+#endif
+    {"sndbuf",      SOL_SOCKET, SO_SNDBUF},
+    {"rcvbuf",      SOL_SOCKET, SO_RCVBUF},
+    {"keepalive",   SOL_SOCKET, SO_KEEPALIVE},
+#ifdef TCP_KEEPIDLE
+    {"keepidle",    IPPROTO_TCP, TCP_KEEPIDLE},
+#endif
+#ifdef TCP_KEEPINTVL
+    {"keepintvl",   IPPROTO_TCP, TCP_KEEPINTVL},
+#endif
+#ifdef TCP_KEEPCNT
+    {"keepcnt",     IPPROTO_TCP, TCP_KEEPCNT},
+#endif
+};
+
+const char *
+vp_socket_setopt(char *args)
+{
+    vp_stack_t stack;
+    int sock;
+    char *name;
+    int value;
+    socklen_t len = sizeof(value);
+    size_t i;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &sock));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &name));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &value));
+
+    for (i = 0; i < sizeof(vp_socket_opts) / sizeof(vp_socket_opts[0]); ++i)
+        if (strcmp(name, vp_socket_opts[i].name) == 0)
+            break;
+    if (i == sizeof(vp_socket_opts) / sizeof(vp_socket_opts[0]))
+        return vp_stack_return_error(&_result,
+                "unsupported socket option: %s", name);
+
+    if (setsockopt(sock, vp_socket_opts[i].level, vp_socket_opts[i].opt,
+                &value, sizeof(value)) < 0
+            || getsockopt(sock, vp_socket_opts[i].level, vp_socket_opts[i].opt,
+                &value, &len) < 0)
+        return vp_stack_return_error(&_result, "setsockopt() error: %s: %s",
+                name, strerror(errno));
+    vp_stack_push_num(&_result, "%d", value);
+    return vp_stack_return(&_result);
+}
+
+/* The path of a live socket is in use; a stale one is replaced. */
+static int
+vp_socket_bind_unix(int fd, const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int ret, probe;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+        if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            return -1;
+        ret = connect(probe, (struct sockaddr *)&addr, sizeof(addr));
+        close(probe);
+        if (ret == 0) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+        unlink(path);
+    }
+    mask = umask(077);
+    ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    return ret;
+}
+
+const char *
+vp_socket_listen(char *args)
+{
+    vp_stack_t stack;
+    char *host;
+    char *port;
+    int backlog;
+    int sock = -1;
+    int one = 1;
+    int ret;
+    struct addrinfo hints, *res, *ai;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &host));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &port));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &backlog));
+
+    if (*host == '/') {
+        if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            return vp_stack_return_error(&_result, "socket() error: %s",
+                    strerror(errno));
+        if (vp_socket_bind_unix(sock, host) < 0) {
+            ret = errno;
+            close(sock);
+            return vp_stack_return_error(&_result, "bind() error: %s: %s",
+                    host, strerror(ret));
+        }
+    } else {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if ((ret = getaddrinfo(*host == '\0' ? NULL : host, port, &hints,
+                        &res)) != 0)
+            return vp_stack_return_error(&_result,
+                    "getaddrinfo() error: %s: %s", host, gai_strerror(ret));
+        ret = 0;
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+            if ((sock = socket(ai->ai_family, ai->ai_socktype,
+                            ai->ai_protocol)) < 0) {
+                ret = errno;
+                continue;
+            }
+            (void)setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            ret = errno;
+            close(sock);
+            sock = -1;
+        }
+        freeaddrinfo(res);
+        if (sock == -1)
+            return vp_stack_return_error(&_result, "bind() error: %s: %s",
+                    host, strerror(ret));
+    }
+
+    /* accept() in vp_socket_accept() must not block. */
+    (void)fcntl(sock, F_SETFD, FD_CLOEXEC);
+    (void)fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (listen(sock, backlog) < 0) {
+        ret = errno;
+        close(sock);
+        return vp_stack_return_error(&_result, "listen() error: %s",
+                strerror(ret));
+    }
+    vp_stack_push_num(&_result, "%d", sock);
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Accept up to max pending connections at once.  uid and pid are the
+ * peer credentials of an AF_UNIX connection, -1 if unknown.
+ */
+const char *
+vp_socket_accept(char *args)
+{
+    vp_stack_t stack;
+    int sock, max, timeout;
+    int fd, n;
+    struct pollfd pfd;
+    struct sockaddr_storage addr;
+    socklen_t len;
+    char host[NI_MAXHOST], serv[NI_MAXSERV];
+    char peer[NI_MAXHOST + NI_MAXSERV + 4];
+    long uid, pid;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &sock));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &max));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    n = poll(&pfd, 1, timeout);
+    if (n < 0 && errno != EINTR)
+        return vp_stack_return_error(&_result, "poll() error: %s",
+                strerror(errno));
+    if (n <= 0)
+        return NULL;
+
+    for (n = 0; n < max; ) {
+        len = sizeof(addr);
+#if defined __linux__ && defined SOCK_CLOEXEC
+        fd = accept4(sock, (struct sockaddr *)&addr, &len, SOCK_CLOEXEC);
+#else
+        fd = accept(sock, (struct sockaddr *)&addr, &len);
+        if (fd != -1) {
+            /* The BSDs inherit O_NONBLOCK of the listening socket. */
+            (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+            (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+        }
+#endif
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || n > 0)
+                break;
+            return vp_stack_return_error(&_result, "accept() error: %s",
+                    strerror(errno));
+        }
+
+        uid = pid = -1;
+        if (addr.ss_family == AF_UNIX) {
+            strcpy(peer, "unix");
+#if defined __linux__ && defined SO_PEERCRED
+            {
+                struct ucred cred;
+                socklen_t clen = sizeof(cred);
+
+                if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &clen) == 0) {
+                    uid = cred.uid;
+                    pid = cred.pid;
+                }
+            }
+#elif defined __APPLE__ || defined __FreeBSD__ || defined __OpenBSD__ \
+            || defined __NetBSD__
+            {
+                uid_t euid;
+                gid_t egid;
+
+                if (getpeereid(fd, &euid, &egid) == 0)
+                    uid = euid;
+            }
+#endif
+        } else if (getnameinfo((struct sockaddr *)&addr, len, host,
+                    sizeof(host), serv, sizeof(serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+            sprintf(peer, addr.ss_family == AF_INET6 ? "[%s]:%s" : "%s:%s",
+                    host, serv);
+        } else {
+            strcpy(peer, "?");
+        }
+
+        vp_stack_push_num(&_result, "%d", fd);
+        vp_stack_push_str(&_result, peer);
+        vp_stack_push_num(&_result, "%ld", uid);
+        vp_stack_push_num(&_result, "%ld", pid);
+        ++n;
+    }
+    return vp_stack_return(&_result);
+}
+
+/*
+ * HTTP/1.1 client.  See vimhttp.c.
+ * The requests of one call go to one host:port and are pipelined.  A
+ * connection is kept for the next call unless the server closes it; a
+ * kept connection which became readable has been closed by the server.
+ * When a reused connection fails before a byte of the answer, the
+ * requests are sent again once on a new one, unless one of them may
+ * change the server: it may have been done before the failure.
+ */
+#define VP_HTTP_CONN_MAX        8
+#define VP_HTTP_PIPELINE_MAX    32
+
+static struct {
+    int fd;             /* 0 if unused */
+    long used;          /* vp_msec_now() */
+    char host[256];
+    char port[32];
+} vp_http_conns[VP_HTTP_CONN_MAX];
+
+/* Take the kept connection to host:port, or -1. */
+static int
+vp_http_conn_take(const char *host, const char *port)
+{
+    struct pollfd pfd = {0, POLLIN, 0};
+    int i;
+
+    for (i = 0; i < VP_HTTP_CONN_MAX; ++i) {
+        if (vp_http_conns[i].fd == 0 || strcmp(vp_http_conns[i].host, host)
+                || strcmp(vp_http_conns[i].port, port))
+            continue;
+        pfd.fd = vp_http_conns[i].fd;
+        vp_http_conns[i].fd = 0;
+        if (poll(&pfd, 1, 0) != 0) {
+            close(pfd.fd);
+            return -1;
+        }
+        return pfd.fd;
+    }
+    return -1;
+}
+
+/* The least recently used one goes when the table is full. */
+static void
+vp_http_conn_keep(int fd, const char *host, const char *port)
+{
+    int i, slot = 0;
+
+    if (strlen(host) >= sizeof(vp_http_conns[0].host)
+            || strlen(port) >= sizeof(vp_http_conns[0].port)) {
+        close(fd);
+        return;
+    }
+    for (i = 0; i < VP_HTTP_CONN_MAX; ++i) {
+        if (vp_http_conns[i].fd == 0) {
+            slot = i;
+            break;
+        }
+        if (vp_http_conns[i].used < vp_http_conns[slot].used)
+            slot = i;
+    }
+    if (vp_http_conns[slot].fd != 0)
+        close(vp_http_conns[slot].fd);
+    vp_http_conns[slot].fd = fd;
+    vp_http_conns[slot].used = vp_msec_now();
+    strcpy(vp_http_conns[slot].host, host);
+    strcpy(vp_http_conns[slot].port, port);
+}
+
+/* Milliseconds left until deadline for poll(). */
+static int
+vp_http_wait(long deadline)
+{
+    long left;
+
+    if (deadline < 0)
+        return -1;
+    left = deadline - vp_msec_now();
+    return left > 0 ? (int)left : 0;
+}
+
+/* Returns -1 with errno. */
+static int
+vp_http_send(int fd, const char *buf, size_t len, long deadline)
+{
+    struct pollfd pfd = {0, POLLOUT, 0};
+    ssize_t n;
+
+    pfd.fd = fd;
+    while (len > 0) {
+        n = poll(&pfd, 1, vp_http_wait(deadline));
+        if (n == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        } else if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        n = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Append what is readable.  Returns the count, 0 at eof, -1 with errno. */
+static long
+vp_http_recv(int fd, vp_http_buf_t *in, long deadline)
+{
+    struct pollfd pfd = {0, POLLIN, 0};
+    char buf[65536];
+    ssize_t n;
+
+    pfd.fd = fd;
+    for (;;) {
+        n = poll(&pfd, 1, vp_http_wait(deadline));
+        if (n == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        } else if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (n > 0 && (n = recv(fd, buf, sizeof(buf), 0)) >= 0)
+            break;
+        if (n < 0 && errno != EINTR && errno != EAGAIN)
+            return -1;
+    }
+    if (n > 0 && vp_http_buf_add(in, buf, n) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return (long)n;
+}
+
+static int
+vp_http_connect(const char *host, unsigned short nport, long deadline,
+        const char **errfmt, const char **err)
+{
+    static char msg[512];
+    struct sockaddr_storage addr[VP_DNS_ADDR_MAX];
+    socklen_t addrlen[VP_DNS_ADDR_MAX];
+    int naddr, fd, ret, one = 1;
+
+    if ((ret = vp_dns_lookup(host, addr, addrlen, &naddr)) != 0) {
+        snprintf(msg, sizeof(msg), "getaddrinfo() error: %s: %s",
+                host, gai_strerror(ret));
+        *err = msg;
+        return -1;
+    }
+    if ((fd = vp_socket_connect(addr, addrlen, naddr, nport,
+                    vp_http_wait(deadline))) == -1) {
+        *errfmt = "connect() error: %s";
+        return -1;
+    }
+    /* Requests are written whole; do not wait for more. */
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+const char *
+vp_http_request(char *args)
+{
+    vp_stack_t stack;
+    char *host, *port;
+    int timeout;
+    size_t maxsize;
+    int nreq, nheader;
+    char *method, *path, *body;
+    size_t body_len;
+    char *name[VP_HTTP_HEADER_MAX], *value[VP_HTTP_HEADER_MAX];
+    size_t offset[VP_HTTP_PIPELINE_MAX + 1];
+    int head_only[VP_HTTP_PIPELINE_MAX];
+    int safe[VP_HTTP_PIPELINE_MAX];
+    vp_http_buf_t req = {NULL, 0, 0}, in = {NULL, 0, 0};
+    vp_http_resp_t resp;
+    unsigned short nport;
+    const char *errfmt = NULL, *err = NULL;
+    char line[512];
+    long deadline, n, nrecv;
+    int fd = -1, reused, retried = 0, eof, keep;
+    int done, i, j, has_host, has_length;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &host));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &port));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%zu", &maxsize));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nreq));
+    if (nreq < 1 || nreq > VP_HTTP_PIPELINE_MAX)
+        return vp_stack_return_error(&_result, "too many requests: %d", nreq);
+    if (vp_socket_port(port, &nport) < 0)
+        return vp_stack_return_error(&_result, "getservbyname() error: %s",
+                port);
+    if (!vp_http_is_line(host))
+        return vp_stack_return_error(&_result, "invalid host");
+
+    /* All the requests in one buffer, for one send(). */
+    for (i = 0; i < nreq; ++i) {
+        VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &method));
+        VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
+        /* Else a request of its own could follow this one. */
+        if (*method == '\0' || strchr(method, ' ') != NULL
+                || !vp_http_is_line(method)
+                || strchr(path, ' ') != NULL || !vp_http_is_line(path)) {
+            free(req.data);
+            return vp_stack_return_error(&_result, "invalid request line");
+        }
+        VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nheader));
+        if (nheader < 0 || nheader > VP_HTTP_HEADER_MAX) {
+            free(req.data);
+            return vp_stack_return_error(&_result, "too many headers: %d",
+                    nheader);
+        }
+        has_host = has_length = 0;
+        for (j = 0; j < nheader; ++j) {
+            VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &name[j]));
+            VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &value[j]));
+            if (*name[j] == '\0' || strchr(name[j], ':') != NULL
+                    || !vp_http_is_line(name[j])
+                    || !vp_http_is_line(value[j])) {
+                free(req.data);
+                return vp_stack_return_error(&_result, "invalid header");
+            }
+            has_host |= strcasecmp(name[j], "Host") == 0;
+            has_length |= strcasecmp(name[j], "Content-Length") == 0;
+        }
+        VP_RETURN_IF_FAIL(vp_stack_pop_bin(&stack, &body, &body_len));
+        head_only[i] = strcmp(method, "HEAD") == 0;
+        safe[i] = head_only[i] || strcmp(method, "GET") == 0
+            || strcmp(method, "OPTIONS") == 0 || strcmp(method, "TRACE") == 0;
+        offset[i] = req.len;
+
+        if (vp_http_buf_str(&req, method) < 0
+                || vp_http_buf_str(&req, " ") < 0
+                || vp_http_buf_str(&req, *path == '\0' ? "/" : path) < 0
+                || vp_http_buf_str(&req, " HTTP/1.1\r\n") < 0)
+            goto nomem;
+        if (!has_host) {
+            snprintf(line, sizeof(line),
+                    strchr(host, ':') != NULL ? "Host: [%s]" : "Host: %s",
+                    host);
+            if (vp_http_buf_str(&req, line) < 0
+                    || (ntohs(nport) != 80
+                        && (vp_http_buf_str(&req, ":") < 0
+                            || vp_http_buf_str(&req, port) < 0))
+                    || vp_http_buf_str(&req, "\r\n") < 0)
+                goto nomem;
+        }
+        for (j = 0; j < nheader; ++j) {
+            if (vp_http_buf_str(&req, name[j]) < 0
+                    || vp_http_buf_str(&req, ": ") < 0
+                    || vp_http_buf_str(&req, value[j]) < 0
+                    || vp_http_buf_str(&req, "\r\n") < 0)
+                goto nomem;
+        }
+        if (!has_length && (body_len > 0 || strcmp(method, "POST") == 0
+                    || strcmp(method, "PUT") == 0
+                    || strcmp(method, "PATCH") == 0)) {
+            snprintf(line, sizeof(line), "Content-Length: %zu\r\n",
+                    body_len);
+            if (vp_http_buf_str(&req, line) < 0)
+                goto nomem;
+        }
+        if (vp_http_buf_str(&req, "\r\n") < 0
+                || vp_http_buf_add(&req, body, body_len) < 0)
+            goto nomem;
+    }
+    offset[nreq] = req.len;
+
+    deadline = (timeout < 0) ? -1 : vp_msec_now() + timeout;
+    done = 0;
+    while (done < nreq) {
+        reused = 0;
+        if ((fd = vp_http_conn_take(host, port)) != -1) {
+            /* Whether a failure may be retried. */
+            reused = !retried;
+            for (i = done; i < nreq; ++i)
+                reused &= safe[i];
+        }
+        else if ((fd = vp_http_connect(host, nport, deadline, &errfmt,
+                        &err)) == -1)
+            goto error;
+        if (vp_http_send(fd, req.data + offset[done],
+                    offset[nreq] - offset[done], deadline) < 0) {
+            if (reused)
+                goto retry;
+            errfmt = "send() error: %s";
+            goto error;
+        }
+
+        in.len = 0;
+        nrecv = 0;
+        eof = 0;
+        while (done < nreq) {
+            n = vp_http_parse(in.len > 0 ? in.data : "", in.len,
+                    head_only[done], eof, maxsize, &resp, &err);
+            if (n < 0) {
+                if (reused && nrecv == 0)
+                    goto retry;
+                goto error;
+            } else if (n == 0) {
+                if ((n = vp_http_recv(fd, &in, deadline)) < 0) {
+                    if (reused && nrecv == 0 && errno != ETIMEDOUT)
+                        goto retry;
+                    errfmt = "recv() error: %s";
+                    goto error;
+                }
+                eof = (n == 0);
+                nrecv += n;
+                continue;
+            }
+            memmove(in.data, in.data + n, in.len - n);
+            in.len -= n;
+            if (resp.status < 200) {
+                /* 100 Continue and the like */
+                vp_http_resp_free(&resp);
+                continue;
+            }
+
+            /* The server may send any byte but NUL, even EOV. */
+            vp_stack_push_num(&_result, "%d", resp.status);
+            vp_stack_push_bin(&_result, resp.reason, strlen(resp.reason));
+            vp_stack_push_num(&_result, "%d", resp.nheader);
+            for (j = 0; j < resp.nheader; ++j) {
+                vp_stack_push_bin(&_result, resp.name[j],
+                        strlen(resp.name[j]));
+                vp_stack_push_bin(&_result, resp.value[j],
+                        strlen(resp.value[j]));
+            }
+            vp_stack_push_bin(&_result, resp.body == NULL ? "" : resp.body,
+                    resp.body_len);
+            keep = resp.keep_alive;
+            vp_http_resp_free(&resp);
+            ++done;
+            if (!keep) {
+                /* The rest are sent again on a new connection. */
+                close(fd);
+                fd = -1;
+                break;
+            }
+        }
+        continue;
+
+retry:
+        close(fd);
+        fd = -1;
+        retried = 1;
+    }
+
+    if (fd != -1) {
+        if (in.len == 0)
+            vp_http_conn_keep(fd, host, port);
+        else
+            close(fd);
+    }
+    free(req.data);
+    free(in.data);
+    return vp_stack_return(&_result);
+
+nomem:
+    errno = ENOMEM;
+    errfmt = "vp_http_request: %s";
+error:
+    if (fd != -1)
+        close(fd);
+    free(req.data);
+    free(in.data);
+    /* Drop the answers of the requests before. */
+    _result.top = _result.buf;
+    if (errfmt != NULL)
+        return vp_stack_return_error(&_result, errfmt, strerror(errno));
+    return vp_stack_return_error(&_result, "%s", err);
+}
+
+/*
+ * Detachable pty sessions.  See vimsession.c.
+ */
+static char vp_session_reply[VP_SESS_LINE_MAX];
+
+static const char *
+vp_session_call(const char *path, int start, const char **req, int nreq,
+        char **words, int *nwords, int *sock)
+{
+    const char *errfmt;
+
+    errfmt = vp_sess_call(path, start, req, nreq, vp_session_reply,
+            sizeof(vp_session_reply), words, nwords, sock);
+    if (errfmt != NULL)
+        return vp_stack_return_error(&_result, errfmt, strerror(errno));
+    if (*nwords < 0)
+        return vp_stack_return_error(&_result, "session daemon: %s",
+                words[1]);
+    return NULL;
+}
+
+const char *
+vp_session_open(char *args)
+{
+    vp_stack_t stack;
+    char *socket_path;
+    char *name;
+    char *cwd;
+    int cols, rows;
+    int argc;
+    char **argv;
+    char path[4096];
+    char ncols[16], nrows[16];
+    const char *req[VP_SESS_WORD_MAX];
+    char *words[VP_SESS_WORD_MAX];
+    int nwords;
+    int i;
+    const char *err;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &socket_path));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &name));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &cols));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &rows));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &cwd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
+    if (argc > VP_SESS_WORD_MAX - 7)
+        return vp_stack_return_error(&_result, "argc range error.");
+    VP_RETURN_IF_FAIL(pop_argv(&stack, argc, &argv));
+    if ((err = resolve_argv0(argv[0], cwd, NULL, path, sizeof(path)))
+            != NULL) {
+        free(argv);
+        return err;
+    }
+
+    sprintf(ncols, "%d", cols);
+    sprintf(nrows, "%d", rows);
+    req[0] = "open";
+    req[1] = ncols;
+    req[2] = nrows;
+    req[3] = name;
+    req[4] = cwd;
+    req[5] = path;
+    for (i = 0; i < argc; ++i)
+        req[6 + i] = argv[i];
+    free(argv);
+    VP_RETURN_IF_FAIL(vp_session_call(socket_path, 1, req, 6 + argc,
+                words, &nwords, NULL));
+
+    vp_stack_push_str(&_result, words[1]);
+    vp_stack_push_str(&_result, words[2]);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_session_list(char *args)
+{
+    vp_stack_t stack;
+    char *socket_path;
+    const char *req[1];
+    char *words[VP_SESS_WORD_MAX];
+    int nwords;
+    int i;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &socket_path));
+
+    req[0] = "list";
+    if (vp_sess_call(socket_path, 0, req, 1, vp_session_reply,
+                sizeof(vp_session_reply), words, &nwords, NULL) != NULL) {
+        /* no daemon, no sessions */
+        return NULL;
+    }
+    if (nwords < 0)
+        return vp_stack_return_error(&_result, "session daemon: %s",
+                words[1]);
+    for (i = 1; i < nwords; ++i)
+        vp_stack_push_str(&_result, words[i]);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_session_attach(char *args)
+{
+    vp_stack_t stack;
+    char *socket_path;
+    char *id;
+    char *since;
+    const char *req[3];
+    char *words[VP_SESS_WORD_MAX];
+    int nwords;
+    int sock;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &socket_path));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &id));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &since));
+
+    req[0] = "attach";
+    req[1] = id;
+    req[2] = since;
+    VP_RETURN_IF_FAIL(vp_session_call(socket_path, 0, req, 3,
+                words, &nwords, &sock));
+
+    vp_stack_push_num(&_result, "%d", sock);
+    vp_stack_push_str(&_result, words[1]);
+    vp_stack_push_str(&_result, words[2]);
+    return vp_stack_return(&_result);
+}
+
+/* resize, kill and close */
+const char *
+vp_session_control(char *args)
+{
+    vp_stack_t stack;
+    char *socket_path;
+    const char *req[4];
+    char *words[VP_SESS_WORD_MAX];
+    int nwords;
+    int nreq = 0;
+    char *arg;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &socket_path));
+    while (nreq < 4 && stack.top > stack.buf) {
+        VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &arg));
+        req[nreq++] = arg;
+    }
+    if (nreq < 2)
+        return vp_stack_return_error(&_result, "too few arguments");
+    return vp_session_call(socket_path, 0, req, nreq, words, &nwords, NULL);
+}
+
+/*
+ * Added by Richard Emberson
+ * Check to see if a host exists.
+ */
+const char *
+vp_host_exists(char *args)
+{
+    vp_stack_t stack;
+    char *host;
+    struct sockaddr_storage addr[VP_DNS_ADDR_MAX];
+    socklen_t addrlen[VP_DNS_ADDR_MAX];
+    int naddr;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &host));
+
+    if (vp_dns_lookup(host, addr, addrlen, &naddr) == 0) {
+        vp_stack_push_num(&_result, "%d", 1);
+    } else {
+        vp_stack_push_num(&_result, "%d", 0);
+    }
+
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Asynchronous vp_dns_lookup() for vimproc#open().  A thread resolves
+ * each handle, because getaddrinfo() cannot be interrupted.  A handle
+ * closed while resolving is freed by its thread, which is joined when the
+ * slot is taken again or the library is unloaded.
+ */
+#define VP_RESOLVE_MAX  16
+
+typedef struct vp_resolve_t {
+    int used;
+    int done;
+    int closed;
+    int error;          /* EAI_* */
+    int naddr;
+    int joinable;
+    pthread_t thread;
+    char host[256];
+    struct sockaddr_storage addr[VP_DNS_ADDR_MAX];
+    socklen_t addrlen[VP_DNS_ADDR_MAX];
+} vp_resolve_t;
+
+static vp_resolve_t vp_resolves[VP_RESOLVE_MAX];
+static pthread_mutex_t vp_resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vp_resolve_cond = PTHREAD_COND_INITIALIZER;
+
+static void *
+vp_resolve_thread(void *arg)
+{
+    vp_resolve_t *r = arg;
+    struct sockaddr_storage addr[VP_DNS_ADDR_MAX];
+    socklen_t addrlen[VP_DNS_ADDR_MAX];
+    int naddr = 0;
+    int error;
+
+    /* host does not change while used. */
+    error = vp_dns_lookup(r->host, addr, addrlen, &naddr);
+
+    pthread_mutex_lock(&vp_resolve_lock);
+    r->error = error;
+    r->naddr = naddr;
+    memcpy(r->addr, addr, sizeof(addr[0]) * naddr);
+    memcpy(r->addrlen, addrlen, sizeof(addrlen[0]) * naddr);
+    r->done = 1;
+    if (r->closed)
+        r->used = 0;
+    pthread_cond_broadcast(&vp_resolve_cond);
+    pthread_mutex_unlock(&vp_resolve_lock);
+    return NULL;
+}
+
+const char *
+vp_resolve_start(char *args)
+{
+    vp_stack_t stack;
+    char *host;
+    vp_resolve_t *r;
+    int id, ret;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &host));
+    if (strlen(host) >= sizeof(vp_resolves[0].host))
+        return vp_stack_return_error(&_result, "too long host: %s", host);
+
+    pthread_mutex_lock(&vp_resolve_lock);
+    for (id = 0; id < VP_RESOLVE_MAX && vp_resolves[id].used; ++id)
+        ;
+    if (id == VP_RESOLVE_MAX) {
+        pthread_mutex_unlock(&vp_resolve_lock);
+        return vp_stack_return_error(&_result, "too many resolves");
+    }
+    r = &vp_resolves[id];
+    /* An unused slot's thread has released the lock for good. */
+    if (r->joinable)
+        pthread_join(r->thread, NULL);
+    memset(r, 0, sizeof(*r));
+    r->used = 1;
+    strcpy(r->host, host);
+    ret = pthread_create(&r->thread, NULL, vp_resolve_thread, r);
+    if (ret != 0)
+        r->used = 0;
+    r->joinable = (ret == 0);
+    pthread_mutex_unlock(&vp_resolve_lock);
+
+    if (ret != 0)
+        return vp_stack_return_error(&_result, "pthread_create() error: %s",
+                strerror(ret));
+    vp_stack_push_num(&_result, "%d", id);
+    return vp_stack_return(&_result);
+}
+
+/* A finished handle is closed by the poll. */
+const char *
+vp_resolve_poll(char *args)
+{
+    vp_stack_t stack;
+    vp_resolve_t *r;
+    int id, timeout, i;
+    long until;
+    char buf[NI_MAXHOST];
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &id));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+    if (id < 0 || id >= VP_RESOLVE_MAX)
+        return vp_stack_return_error(&_result, "invalid id: %d", id);
+
+    r = &vp_resolves[id];
+    until = (timeout < 0) ? -1 : vp_msec_now() + timeout;
+    pthread_mutex_lock(&vp_resolve_lock);
+    if (!r->used || r->closed) {
+        pthread_mutex_unlock(&vp_resolve_lock);
+        return vp_stack_return_error(&_result, "invalid id: %d", id);
+    }
+    while (!r->done && (until < 0 || vp_msec_now() < until))
+        vp_cond_wait(&vp_resolve_cond, &vp_resolve_lock, until);
+    if (!r->done) {
+        pthread_mutex_unlock(&vp_resolve_lock);
+        vp_stack_push_str(&_result, "run");
+        return vp_stack_return(&_result);
+    }
+    if (r->error != 0) {
+        vp_stack_push_str(&_result, "fail");
+        vp_stack_push_str(&_result, gai_strerror(r->error));
+    } else {
+        vp_stack_push_str(&_result, "ok");
+        for (i = 0; i < r->naddr; ++i) {
+            if (getnameinfo((struct sockaddr *)&r->addr[i], r->addrlen[i],
+                        buf, sizeof(buf), NULL, 0, NI_NUMERICHOST) == 0)
+                vp_stack_push_str(&_result, buf);
+        }
+    }
+    r->used = 0;
+    pthread_mutex_unlock(&vp_resolve_lock);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_resolve_close(char *args)
+{
+    vp_stack_t stack;
+    int id;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &id));
+
+    if (id >= 0 && id < VP_RESOLVE_MAX) {
+        pthread_mutex_lock(&vp_resolve_lock);
+        if (vp_resolves[id].done)
+            vp_resolves[id].used = 0;
+        else
+            vp_resolves[id].closed = 1;
+        pthread_mutex_unlock(&vp_resolve_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Join the resolving threads, waiting up to timeout for a lookup.
+ * Returns -1 if one is still in getaddrinfo().
+ */
+static int
+vp_resolve_stop(int timeout)
+{
+    long until = vp_msec_now() + timeout;
+    int id, busy = 0;
+
+    pthread_mutex_lock(&vp_resolve_lock);
+    for (id = 0; id < VP_RESOLVE_MAX; ++id) {
+        vp_resolve_t *r = &vp_resolves[id];
+
+        while (r->joinable && !r->done && vp_msec_now() < until)
+            vp_cond_wait(&vp_resolve_cond, &vp_resolve_lock, until);
+        if (r->joinable && !r->done) {
+            busy = 1;
+        } else if (r->joinable) {
+            pthread_join(r->thread, NULL);
+            r->joinable = 0;
+        }
     }
-    /* DO NOT REACH HERE */
-    return NULL;
+    pthread_mutex_unlock(&vp_resolve_lock);
+    return busy ? -1 : 0;
+}
 
-    /* error */
-error:
-    close_fds(fd);
-    return vp_stack_return_error(&_result, errfmt, strerror(errno));
+/*
+ * Called by vp_dlclose(): no thread may run the code of the library after
+ * it is unloaded.  Returns -1 if one cannot be stopped.
+ */
+static int
+vp_threads_stop(void)
+{
+    vp_mmap_t *m;
+    int i;
 
-child_error:
-    dummy = write(STDOUT_FILENO, strerror(errno), strlen(strerror(errno)));
-    _exit(EXIT_FAILURE);
-#undef VP_GOTO_ERROR
+    for (i = 0; i < VP_COALESCE_MAX; ++i)
+        vp_coalesce_stop(&vp_coalesce[i]);
+    for (m = vp_mmap_list; m != NULL; m = m->next)
+        (void)vp_mmap_index(m);
+#ifdef TIOCSCTTY
+    vp_pty_pool_stop();
+#endif
+    return vp_resolve_stop(1000);
 }
 
 const char *
-vp_pipe_close(char *args)
+vp_readdir(char *args)
 {
-    return vp_file_close(args);
+    vp_stack_t stack;
+    char *dirname;
+    char buf[1024];
+
+    DIR *dir;
+    struct dirent *dp;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &dirname));
+
+    if ((dir=opendir(dirname)) == NULL) {
+        return vp_stack_return_error(&_result, "opendir() error: %s",
+                strerror(errno));
+    }
+
+    if (strcmp(dirname, "/") == 0) {
+        dirname[0] = '\0';
+    }
+
+    for (dp = readdir(dir); dp != NULL; dp = readdir(dir)) {
+        if (strcmp(dp->d_name, ".") && strcmp(dp->d_name, "..")) {
+            snprintf(buf, sizeof(buf), "%s/%s", dirname, dp->d_name);
+            vp_stack_push_str(&_result, buf);
+        }
+    }
+    closedir(dir);
+
+    return vp_stack_return(&_result);
 }
 
 const char *
-vp_pipe_read(char *args)
+vp_which(char *args)
 {
-    return vp_file_read(args);
+    vp_stack_t stack;
+    char *path;
+    char *name;
+    char buf[4096];
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
+    if (path[0] == '\0' && (path = getenv("PATH")) == NULL)
+        path = "";
+
+    while (stack.top != stack.buf) {
+        VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &name));
+        if (vp_which_lookup(path, name, buf, sizeof(buf)) != 0)
+            buf[0] = '\0';
+        vp_stack_push_str(&_result, buf);
+    }
+    return vp_stack_return(&_result);
 }
 
-const char *
-vp_pipe_write(char *args)
+/*
+ * Parse cache for vp_parse_cmdline().
+ * The results are keyed on the command line and the environment
+ * generation, which is a hash of the whole environment: $HOME and the
+ * variables are expanded from it.  Results which expanded wildcards are
+ * not cached.
+ */
+#define VP_PARSE_CACHE_SIZE 64
+
+typedef struct vp_parse_cache_t {
+    char *cmdline;
+    unsigned long hash;     /* hash of cmdline */
+    unsigned long envgen;
+    char *result;
+    size_t size;
+    unsigned long used;     /* LRU clock */
+} vp_parse_cache_t;
+
+static vp_parse_cache_t vp_parse_cache[VP_PARSE_CACHE_SIZE];
+static unsigned long vp_parse_clock;
+
+static unsigned long
+vp_parse_envgen(void)
 {
-    return vp_file_write(args);
+    unsigned long h = 2166136261UL;
+    char **env;
+
+    for (env = environ; env != NULL && *env != NULL; ++env) {
+        h = vp_which_hash(*env) ^ (h * 16777619UL);
+    }
+    return h;
 }
 
 const char *
-vp_pty_open(char *args)
+vp_parse_cmdline(char *args)
 {
-#define VP_GOTO_ERROR(_fmt) do { errfmt = (_fmt); goto error; } while(0)
     vp_stack_t stack;
-    int argc;
-    int fd[3][2] = {{0}};
-    pid_t pid;
-    struct winsize ws = {0, 0, 0, 0};
-    int dummy;
-    int hstdin, hstderr, hstdout;
-    int fdm;
-    int npipe;
-    char *errfmt;
+    char *cmdline;
+    vp_parser_t parser = {NULL, 0};
+    vp_parse_cache_t *ent, *lru;
+    unsigned long hash, envgen;
+    size_t start, size;
+    int i;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &npipe));
-    if (npipe != 2 && npipe != 3)
-        return vp_stack_return_error(&_result, "npipe range error. wrong pipes.");
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_col)));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_row)));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstdin));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstdout));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &hstderr));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &cmdline));
 
-    /* Set pipe */
-    if (hstdin > 0) {
-        fd[0][0] = hstdin;
-        fd[0][1] = 0;
-    }
-    if (hstdout > 1) {
-        fd[1][1] = hstdout;
-        fd[1][0] = 0;
-    } else if (hstdout == 1) {
-        if (pipe(fd[1]) < 0) {
-            VP_GOTO_ERROR("pipe() error: %s");
+    hash = vp_which_hash(cmdline);
+    envgen = vp_parse_envgen();
+    lru = &vp_parse_cache[0];
+    for (i = 0; i < VP_PARSE_CACHE_SIZE; ++i) {
+        ent = &vp_parse_cache[i];
+        if (ent->cmdline != NULL && ent->hash == hash && ent->envgen == envgen
+                && strcmp(ent->cmdline, cmdline) == 0) {
+            ent->used = ++vp_parse_clock;
+            VP_RETURN_IF_FAIL(vp_stack_reserve(&_result,
+                        (_result.top - _result.buf) + ent->size + 1));
+            memcpy(_result.top, ent->result, ent->size);
+            _result.top += ent->size;
+            return vp_stack_return(&_result);
         }
+        if (ent->used < lru->used)
+            lru = ent;
     }
-    if (hstderr > 1) {
-        fd[2][1] = hstderr;
-        fd[2][0] = 0;
-    } else if (npipe == 3) {
-        if (hstderr == 1){
-            if (pipe(fd[2]) < 0) {
-                VP_GOTO_ERROR("pipe() error: %s");
-            }
-        } else if (hstderr == 0) {
-            if (openpty(&fd[2][0], &fd[2][1], NULL, NULL, &ws) < 0) {
-                VP_GOTO_ERROR("openpty() error: %s");
-            }
-        }
+
+    start = _result.top - _result.buf;
+    vp_parser_parse(&parser, &_result, cmdline);
+    if (parser.err != NULL) {
+        _result.top = _result.buf + start;
+        return vp_stack_return_error(&_result, "%s", parser.err);
     }
+    if (parser.uncacheable)
+        return vp_stack_return(&_result);
 
-    pid = forkpty(&fdm, NULL, NULL, &ws);
-    if (pid < 0) {
-        VP_GOTO_ERROR("fork() error: %s");
-    } else if (pid == 0) {
-        /* child */
-        char **argv;
-        int i;
+    /* Store to the least recently used entry. */
+    size = (_result.top - _result.buf) - start;
+    free(lru->cmdline);
+    free(lru->result);
+    lru->cmdline = strdup(cmdline);
+    lru->result = malloc(size);
+    if (lru->cmdline == NULL || lru->result == NULL) {
+        free(lru->cmdline);
+        free(lru->result);
+        memset(lru, 0, sizeof(*lru));
+        return vp_stack_return(&_result);
+    }
+    memcpy(lru->result, _result.buf + start, size);
+    lru->size = size;
+    lru->hash = hash;
+    lru->envgen = envgen;
+    lru->used = ++vp_parse_clock;
+    return vp_stack_return(&_result);
+}
 
-        /* Close pipe */
-        if (fd[1][0] > 0) {
-            close(fd[1][0]);
-        }
-        if (fd[2][0] > 0) {
-            close(fd[2][0]);
-        }
+const char *
+vp_decode(char *args)
+{
+    vp_stack_t stack;
+    size_t len;
+    char *str;
+    char *p, *q;
 
-        if (fd[0][0] > 0) {
-            if (dup2(fd[0][0], STDIN_FILENO) != STDIN_FILENO) {
-                goto child_error;
-            }
-            close(fd[0][0]);
-        }
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &str));
 
-        if (fd[1][1] > 0) {
-            if (dup2(fd[1][1], STDOUT_FILENO) != STDOUT_FILENO) {
-                goto child_error;
-            }
-            close(fd[1][1]);
-        }
+    len = strlen(str);
+    if (len % 2 != 0) {
+        return "vp_decode: invalid data length";
+    }
 
-        if (fd[2][1] > 0) {
-            if (dup2(fd[2][1], STDERR_FILENO) != STDERR_FILENO) {
-                goto child_error;
-            }
-            close(fd[2][1]);
-        }
+    VP_RETURN_IF_FAIL(vp_stack_reserve(&_result,
+            (_result.top - _result.buf) + (len / 2) + sizeof(VP_EOV_STR)));
 
-        argv = malloc(sizeof(char *) * (argc+1));
-        if (argv == NULL) {
-            goto child_error;
-        }
-        for (i = 0; i < argc; ++i) {
-            if (vp_stack_pop_str(&stack, &(argv[i]))) {
-                free(argv);
-                goto child_error;
-            }
-        }
-        argv[argc] = NULL;
+    for (p = str, q = _result.top; p < str + len; ) {
+        char hb, lb;
 
-        execv(argv[0], argv);
-        /* error */
-        goto child_error;
-    } else {
-        /* parent */
-        if (fd[1][1] > 0) {
-            close(fd[1][1]);
-        }
-        if (fd[2][1] > 0) {
-            close(fd[2][1]);
+        hb = CHR2XD[(int)*(p++)];
+        lb = CHR2XD[(int)*(p++)];
+        if (hb >= 0 && lb >= 0) {
+            *(q++) = (char)((hb << 4) | lb);
         }
+    }
+    *(q++) = VP_EOV;
+    *q = '\0';
+    _result.top = q;
 
-        if (hstdin == 0) {
-            fd[0][1] = fdm;
-        }
-        if (hstdout == 0) {
-            fd[1][0] = hstdin == 0 ? dup(fdm) : fdm;
-        }
+    return vp_stack_return(&_result);
+}
 
-        vp_stack_push_num(&_result, "%d", pid);
-        vp_stack_push_num(&_result, "%d", fd[0][1]);
-        vp_stack_push_num(&_result, "%d", fd[1][0]);
-        if (npipe == 3) {
-            vp_stack_push_num(&_result, "%d", fd[2][0]);
-        }
-        return vp_stack_return(&_result);
+/* The last used conversion.  Output is converted in one call per command,
+ * so a single descriptor is enough. */
+static struct {
+    iconv_t cd;
+    char from[64];
+    char to[64];
+} _iconv = {(iconv_t)-1, "", ""};
+
+/* "char" is the locale encoding, like termencoding() and friends. */
+static const char *
+vp_iconv_name(const char *name)
+{
+    const char *codeset;
+
+    if (strcmp(name, "char") != 0)
+        return name;
+    codeset = nl_langinfo(CODESET);
+    return (codeset == NULL) ? "" : codeset;
+}
+
+/* Compare encoding names ignoring case, '-' and '_'. */
+static int
+vp_iconv_same(const char *a, const char *b)
+{
+    for (;;) {
+        while (*a == '-' || *a == '_')
+            ++a;
+        while (*b == '-' || *b == '_')
+            ++b;
+        if (tolower((unsigned char)*a) != tolower((unsigned char)*b))
+            return 0;
+        if (*a == '\0')
+            return 1;
+        ++a, ++b;
     }
-    /* DO NOT REACH HERE */
-    return NULL;
+}
 
-    /* error */
-error:
-    close_fds(fd);
-    return vp_stack_return_error(&_result, errfmt, strerror(errno));
+/* Whether ASCII bytes stand for themselves in the encoding.  Wide, stateful
+ * and EBCDIC encodings are excluded; unknown names are not. */
+static int
+vp_iconv_ascii_compatible(const char *name)
+{
+    static const char *const excludes[] = {
+        "16", "32", "ucs", "utf7", "2022", "hz", "ebcdic",
+        "037", "500", "1047", NULL
+    };
+    char buf[64];
+    size_t i;
 
-child_error:
-    dummy = write(STDOUT_FILENO, strerror(errno), strlen(strerror(errno)));
-    _exit(EXIT_FAILURE);
-#undef VP_GOTO_ERROR
+    for (i = 0; *name != '\0' && i < sizeof(buf) - 1; ++name)
+        if (*name != '-' && *name != '_')
+            buf[i++] = (char)tolower((unsigned char)*name);
+    buf[i] = '\0';
+    for (i = 0; excludes[i] != NULL; ++i)
+        if (strstr(buf, excludes[i]) != NULL)
+            return 0;
+    return 1;
 }
 
-const char *
-vp_pty_close(char *args)
+/* Check 32 bytes at a time; compilers turn the OR into vector ops. */
+static int
+vp_is_ascii(const char *buf, size_t len)
 {
-    return vp_file_close(args);
+    const unsigned long long mask = 0x8080808080808080ULL;
+    const char *end = buf + len;
+    unsigned long long w[4];
+
+    for (; end - buf >= (ptrdiff_t)sizeof(w); buf += sizeof(w)) {
+        memcpy(w, buf, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3]) & mask)
+            return 0;
+    }
+    for (; buf < end; ++buf)
+        if (*buf & 0x80)
+            return 0;
+    return 1;
 }
 
-const char *
-vp_pty_read(char *args)
+/* Convert into a malloc()ed buffer.  NULL when iconv cannot do it, in which
+ * case the caller keeps the original like vimproc#util#iconv(). */
+static char *
+vp_iconv_conv(const char *from, const char *to, char *str, size_t len,
+        size_t *outlen)
 {
-    return vp_file_read(args);
+    char *buf, *newbuf;
+    size_t size, used;
+    char *in, *out;
+    size_t inleft, outleft;
+
+    if (_iconv.cd == (iconv_t)-1 || strcmp(_iconv.from, from) != 0
+            || strcmp(_iconv.to, to) != 0) {
+        if (_iconv.cd != (iconv_t)-1)
+            iconv_close(_iconv.cd);
+        _iconv.from[0] = _iconv.to[0] = '\0';
+        if (strlen(from) >= sizeof(_iconv.from)
+                || strlen(to) >= sizeof(_iconv.to))
+            return NULL;
+        if ((_iconv.cd = iconv_open(to, from)) == (iconv_t)-1)
+            return NULL;
+        strcpy(_iconv.from, from);
+        strcpy(_iconv.to, to);
+    } else {
+        iconv(_iconv.cd, NULL, NULL, NULL, NULL);
+    }
+
+    size = len + len / 2 + 16;
+    if ((buf = malloc(size)) == NULL)
+        return NULL;
+    in = str, inleft = len;
+    out = buf, outleft = size;
+    while (inleft > 0
+            || iconv(_iconv.cd, NULL, NULL, &out, &outleft) == (size_t)-1) {
+        if (inleft > 0
+                && iconv(_iconv.cd, &in, &inleft, &out, &outleft) != (size_t)-1)
+            continue;
+        used = out - buf;
+        if (errno != E2BIG || (newbuf = realloc(buf, size * 2)) == NULL) {
+            free(buf);
+            return NULL;
+        }
+        out = newbuf + used;
+        outleft += size;
+        size *= 2;
+        buf = newbuf;
+    }
+    *outlen = out - buf;
+    return buf;
 }
 
-const char *
-vp_pty_write(char *args)
+/* "dos" drops CR before NL, "mac" turns lone CR into NL. */
+static size_t
+vp_iconv_newline(char *buf, size_t len, const char *newline)
 {
-    return vp_file_write(args);
+    char *p, *q, *end = buf + len;
+    int dos = (strcmp(newline, "dos") == 0);
+
+    if ((p = memchr(buf, '\r', len)) == NULL)
+        return len;
+    for (q = p; p < end; ++p) {
+        if (*p != '\r')
+            *q++ = *p;
+        else if (p + 1 < end && p[1] == '\n')
+            *q++ = dos ? '\n' : '\r', p += dos;
+        else
+            *q++ = dos ? '\r' : '\n';
+    }
+    return q - buf;
 }
 
 const char *
-vp_pty_get_winsize(char *args)
+vp_iconv(char *args)
 {
     vp_stack_t stack;
-    int fd;
-    struct winsize ws = {0, 0, 0, 0};
+    char *str;
+    size_t len;
+    char *from, *to, *newline;
+    char *buf = NULL;
+    int nl;
+    const char *ret;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_bin(&stack, &str, &len));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &from));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &to));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &newline));
 
-    if (ioctl(fd, TIOCGWINSZ, &ws) < 0)
-        return vp_stack_return_error(&_result, "ioctl() error: %s",
-                strerror(errno));
-    vp_stack_push_num(&_result, "%hu", ws.ws_col);
-    vp_stack_push_num(&_result, "%hu", ws.ws_row);
+    from = (char *)vp_iconv_name(from);
+    to = (char *)vp_iconv_name(to);
+    if (*from != '\0' && *to != '\0' && !vp_iconv_same(from, to)
+            && !(vp_iconv_ascii_compatible(from)
+                && vp_iconv_ascii_compatible(to) && vp_is_ascii(str, len))) {
+        buf = vp_iconv_conv(from, to, str, len, &len);
+    }
+    nl = (*newline != '\0' && memchr(buf != NULL ? buf : str, '\r', len) != NULL);
+    if (buf == NULL && !nl) {
+        /* Nothing to do; Vim keeps its string. */
+        vp_stack_push_num(&_result, "%d", 0);
+        return vp_stack_return(&_result);
+    }
+
+    if (buf == NULL)
+        buf = str;
+    if (nl)
+        len = vp_iconv_newline(buf, len, newline);
+    vp_stack_push_num(&_result, "%d", 1);
+    ret = vp_lines_push(&_result, buf, len);
+    if (buf != str)
+        free(buf);
+    VP_RETURN_IF_FAIL(ret);
     return vp_stack_return(&_result);
 }
-const char *
-vp_pty_set_winsize(char *args)
+
+/*
+ * Persistent shells for vp_shell_exec().
+ * A /bin/sh is kept per working directory and environment, and commands
+ * are eval'ed in it.  Each command is followed by a sentinel line with the
+ * exit status and $PWD, so a "cd" moves the shell to the new directory.
+ * A shell which died is started again by the next command.
+ */
+#define VP_SHELL_MAX 4
+#define VP_SHELL_PATH "/bin/sh"
+
+typedef struct vp_shell_t {
+    pid_t pid;              /* 0 if unused */
+    int in;                 /* commands */
+    int out;                /* stdout and stderr */
+    char *cwd;
+    unsigned long envgen;
+    unsigned long used;     /* LRU clock */
+    unsigned long seq;
+} vp_shell_t;
+
+static vp_shell_t vp_shells[VP_SHELL_MAX];
+static unsigned long vp_shell_clock;
+
+/* Returns the exit status like the shell's $?. */
+static int
+vp_shell_kill(vp_shell_t *sh)
 {
-    vp_stack_t stack;
-    int fd;
-    struct winsize ws = {0, 0, 0, 0};
+    int status = 0;
 
-    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_col)));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_row)));
+    close(sh->in);
+    close(sh->out);
+    kill(-sh->pid, SIGKILL);
+    if (waitpid(sh->pid, &status, 0) == sh->pid)
+        status = WIFEXITED(status) ? WEXITSTATUS(status)
+            : 128 + WTERMSIG(status);
+    free(sh->cwd);
+    memset(sh, 0, sizeof(*sh));
+    return status;
+}
 
-    if (ioctl(fd, TIOCSWINSZ, &ws) < 0)
-        return vp_stack_return_error(&_result, "ioctl() error: %s",
+static const char *
+vp_shell_spawn(vp_shell_t *sh, const char *cwd, unsigned long envgen)
+{
+    int in[2], out[2];
+    pid_t pid;
+
+    if ((sh->cwd = strdup(cwd)) == NULL)
+        return "vp_shell_spawn: NOMEM";
+    if (pipe(in) < 0) {
+        free(sh->cwd);
+        return vp_stack_return_error(&_result, "pipe() error: %s",
+                strerror(errno));
+    }
+    if (pipe(out) < 0) {
+        close(in[0]);
+        close(in[1]);
+        free(sh->cwd);
+        return vp_stack_return_error(&_result, "pipe() error: %s",
+                strerror(errno));
+    }
+    pid = fork();
+    if (pid < 0) {
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        free(sh->cwd);
+        return vp_stack_return_error(&_result, "fork() error: %s",
                 strerror(errno));
+    } else if (pid == 0) {
+        /* child */
+        setsid();
+        if (dup2(in[0], STDIN_FILENO) != STDIN_FILENO
+                || dup2(out[1], STDOUT_FILENO) != STDOUT_FILENO
+                || dup2(out[1], STDERR_FILENO) != STDERR_FILENO)
+            _exit(EXIT_FAILURE);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        vp_close_from(STDERR_FILENO + 1);
+        if (chdir(cwd) < 0)
+            _exit(EXIT_FAILURE);
+        execl(VP_SHELL_PATH, "sh", (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    /* parent */
+    close(in[0]);
+    close(out[1]);
+    (void)fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(out[0], F_SETFD, FD_CLOEXEC);
+    sh->pid = pid;
+    sh->in = in[1];
+    sh->out = out[0];
+    sh->envgen = envgen;
     return NULL;
 }
 
-const char *
-vp_kill(char *args)
+/* Write the whole script.  Returns non-zero if the shell is gone. */
+static int
+vp_shell_write(vp_shell_t *sh, const char *buf, size_t size)
 {
-    vp_stack_t stack;
-    pid_t pid, pgid;
-    int sig;
-    int ret;
+    ssize_t n;
 
-    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &pid));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &sig));
+    while (size > 0) {
+        n = write(sh->in, buf, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
 
-    ret = kill(pid, sig);
-    if (ret < 0)
-        return vp_stack_return_error(&_result, "kill() error: %s",
-                strerror(errno));
+/* Wrap cmdline in eval '...' and the sentinel printf. */
+static char *
+vp_shell_script(const char *cmdline, const char *sentinel)
+{
+    static const char head[] = "{ eval '";
+    static const char tail[] = "'\n} </dev/null; printf '\\n%s %d %s\\n' ";
+    static const char args[] = " \"$?\" \"$PWD\"\n";
+    size_t n = 0;
+    const char *p;
+    char *script, *q;
 
-    if (sig != 0) {
-        /* Kill by the process group. */
-        pgid = getpgid(pid);
-        if (pgid > 0) {
-            kill(-pgid, sig);
+    for (p = cmdline; *p != '\0'; ++p)
+        n += (*p == '\'') ? 4 : 1;
+    script = malloc(sizeof(head) + n + sizeof(tail) + strlen(sentinel)
+            + sizeof(args));
+    if (script == NULL)
+        return NULL;
+    q = script + sprintf(script, "%s", head);
+    for (p = cmdline; *p != '\0'; ++p) {
+        if (*p == '\'') {
+            memcpy(q, "'\\''", 4);
+            q += 4;
+        } else {
+            *q++ = *p;
         }
     }
-
-    vp_stack_push_num(&_result, "%d", ret);
-    return vp_stack_return(&_result);
+    sprintf(q, "%s%s%s", tail, sentinel, args);
+    return script;
 }
 
 const char *
-vp_waitpid(char *args)
+vp_shell_exec(char *args)
 {
     vp_stack_t stack;
-    pid_t pid, pgid;
-    pid_t n;
+    char *cmdline;
+    char *cwd;
+    int timeout;
+    unsigned long envgen;
+    long deadline;
+    vp_shell_t *sh, *lru;
+    char sentinel[64];
+    size_t slen;
+    char *script;
+    char *buf = NULL, *newbuf;
+    size_t len = 0, size = 0, searched = 0;
+    char *mark = NULL, *eol = NULL, *p;
+    struct pollfd pfd = {0, POLLIN, 0};
     int status;
+    int retry;
+    int i, n;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &pid));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &cmdline));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &cwd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
 
-    n = waitpid(pid, &status, WNOHANG | WUNTRACED);
-    if (n == -1)
-        return vp_stack_return_error(&_result, "waitpid() error: %s",
-                strerror(errno));
-    if (n == 0 || WIFCONTINUED(status)) {
-        vp_stack_push_str(&_result, "run");
-        vp_stack_push_num(&_result, "%d", 0);
-    } else if (WIFEXITED(status)) {
-        /* Kill by the process group. */
-        pgid = getpgid(pid);
-        if (pgid > 0) {
-            kill(-pgid, 15);
+    envgen = vp_parse_envgen();
+    for (retry = 0; ; ++retry) {
+        sh = NULL;
+        lru = &vp_shells[0];
+        for (i = 0; i < VP_SHELL_MAX; ++i) {
+            if (vp_shells[i].pid != 0 && vp_shells[i].envgen == envgen
+                    && strcmp(vp_shells[i].cwd, cwd) == 0) {
+                sh = &vp_shells[i];
+                break;
+            }
+            if (vp_shells[i].used < lru->used)
+                lru = &vp_shells[i];
         }
+        if (sh == NULL) {
+            sh = lru;
+            if (sh->pid != 0)
+                vp_shell_kill(sh);
+            VP_RETURN_IF_FAIL(vp_shell_spawn(sh, cwd, envgen));
+        }
+        sh->used = ++vp_shell_clock;
 
-        vp_stack_push_str(&_result, "exit");
-        vp_stack_push_num(&_result, "%d", WEXITSTATUS(status));
-    } else if (WIFSIGNALED(status)) {
-        vp_stack_push_str(&_result, "signal");
-        vp_stack_push_num(&_result, "%d", WTERMSIG(status));
-    } else if (WIFSTOPPED(status)) {
-        vp_stack_push_str(&_result, "stop");
-        vp_stack_push_num(&_result, "%d", WSTOPSIG(status));
-    } else {
-        return vp_stack_return_error(&_result,
-                "waitpid() unknown status: status=%d", status);
+        /* The pid of Vim keeps the sentinel apart from other instances'. */
+        snprintf(sentinel, sizeof(sentinel), "__vimproc_%ld_%lu_%lu__",
+                (long)getpid(), (unsigned long)sh->pid, ++sh->seq);
+        if ((script = vp_shell_script(cmdline, sentinel)) == NULL)
+            return "vp_shell_exec: NOMEM";
+        n = vp_shell_write(sh, script, strlen(script)) == 0 ? 0 : errno;
+        free(script);
+        if (n == 0)
+            break;
+        /* The shell has gone since the last command. */
+        vp_shell_kill(sh);
+        if (retry > 0)
+            return vp_stack_return_error(&_result, "write() error: %s",
+                    strerror(n));
+    }
+
+    /* Read until "\n<sentinel> <status> <pwd>\n". */
+    slen = strlen(sentinel);
+    pfd.fd = sh->out;
+    deadline = vp_msec_now() + timeout;
+    while (eol == NULL) {
+        if (len + VP_READ_BUFSIZE + 1 > size) {
+            size = (size == 0) ? VP_READ_BUFSIZE * 2 : size * 2;
+            if ((newbuf = realloc(buf, size)) == NULL) {
+                free(buf);
+                return "vp_shell_exec: NOMEM";
+            }
+            buf = newbuf;
+        }
+        n = poll(&pfd, 1, (timeout <= 0) ? -1 : (int)(deadline > vp_msec_now()
+                    ? deadline - vp_msec_now() : 0));
+        if (n == 0) {
+            /* timeout */
+            vp_shell_kill(sh);
+            free(buf);
+            return "vp_shell_exec: timeout";
+        }
+        n = (n < 0) ? -1 : read(sh->out, buf + len, VP_READ_BUFSIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            /* The command exited the shell. */
+            status = vp_shell_kill(sh);
+            vp_stack_push_num(&_result, "%d", status);
+            VP_RETURN_IF_FAIL(vp_lines_push(&_result, buf, len));
+            free(buf);
+            return vp_stack_return(&_result);
+        }
+        len += n;
+        buf[len] = '\0';
+        if (mark == NULL) {
+            for (p = buf + searched; (p = memchr(p, '\n', buf + len - p))
+                    != NULL; ++p) {
+                if ((size_t)(buf + len - p) <= slen + 1) {
+                    break;
+                } else if (memcmp(p + 1, sentinel, slen) == 0
+                        && p[slen + 1] == ' ') {
+                    mark = p;
+                    break;
+                }
+            }
+            searched = (mark != NULL) ? (size_t)(mark - buf)
+                : (p != NULL) ? (size_t)(p - buf) : len;
+        }
+        if (mark != NULL)
+            eol = memchr(mark + slen + 2, '\n', buf + len - (mark + slen + 2));
     }
 
+    status = (int)strtol(mark + slen + 2, &p, 10);
+    if (*p == ' ') {
+        *eol = '\0';
+        if ((p = strdup(p + 1)) != NULL) {
+            free(sh->cwd);
+            sh->cwd = p;
+        }
+    }
+    vp_stack_push_num(&_result, "%d", status);
+    VP_RETURN_IF_FAIL(vp_lines_push(&_result, buf, mark - buf));
+    free(buf);
     return vp_stack_return(&_result);
 }
 
 /*
- * This is based on socket.diff.gz written by Yasuhiro Matsumoto.
- * see: http://marc.theaimsgroup.com/?l=vim-dev&m=105289857008664&w=2
+ * Job scheduler for vp_jobs_submit().
+ * Submitted commands wait in a priority queue, and at most vp_jobs_max of
+ * them run at once.  Jobs are started and their output is collected
+ * while vp_jobs_poll() runs; it returns the records of finished jobs.
  */
-const char *
-vp_socket_open(char *args)
+#define VP_JOBS_MAX 256
+#define VP_JOBS_OUT_MAX (4 * 1024 * 1024)   /* the tail kept of a job */
+
+typedef struct vp_job_t {
+    int id;
+    int priority;
+    unsigned long seq;      /* FIFO among the same priority */
+    char *path;
+    char *cwd;
+    char **argv;            /* one block with path, cwd and the strings */
+    pid_t pid;
+    int fd;                 /* stdout and stderr; -1 at eof */
+    int status;
+    char *out;              /* ring buffer once size is VP_JOBS_OUT_MAX */
+    size_t head;
+    size_t len;
+    size_t size;
+    size_t dropped;         /* bytes before the tail kept */
+} vp_job_t;
+
+static int vp_jobs_max = 0;     /* 0: the number of CPUs */
+static int vp_jobs_lastid = 0;
+static unsigned long vp_jobs_seq = 0;
+static vp_job_t **vp_jobs_queue = NULL; /* heap */
+static size_t vp_jobs_nqueue = 0;
+static size_t vp_jobs_queuesize = 0;
+static vp_job_t *vp_jobs_running[VP_JOBS_MAX];
+static size_t vp_jobs_nrunning = 0;
+
+static int
+vp_jobs_before(const vp_job_t *a, const vp_job_t *b)
 {
-    vp_stack_t stack;
-    char *host;
-    char *port;
-    char *p;
-    int n;
-    unsigned short nport;
-    int sock;
-    struct sockaddr_in sockaddr;
-    struct hostent *hostent;
-    struct servent *servent;
+    return (a->priority != b->priority) ? a->priority > b->priority
+        : a->seq < b->seq;
+}
 
-    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &host));
-    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &port));
+static const char *
+vp_jobs_enqueue(vp_job_t *job)
+{
+    size_t i;
+    vp_job_t *t;
 
-    n = strtol(port, &p, 10);
-    if (p == port + strlen(port)) {
-        nport = htons(n);
-    } else {
-        servent = getservbyname(port, NULL);
-        if (servent == NULL)
-            return vp_stack_return_error(&_result, "getservbyname() error: %s",
-                    port);
-        nport = servent->s_port;
+    if (vp_jobs_nqueue == vp_jobs_queuesize) {
+        size_t newsize = (vp_jobs_queuesize == 0) ? 64 : vp_jobs_queuesize * 2;
+        vp_job_t **newqueue = realloc(vp_jobs_queue,
+                sizeof(vp_job_t *) * newsize);
+
+        if (newqueue == NULL)
+            return "vp_jobs_enqueue: NOMEM";
+        vp_jobs_queue = newqueue;
+        vp_jobs_queuesize = newsize;
+    }
+    i = vp_jobs_nqueue++;
+    vp_jobs_queue[i] = job;
+    for (; i > 0 && vp_jobs_before(vp_jobs_queue[i],
+                vp_jobs_queue[(i - 1) / 2]); i = (i - 1) / 2) {
+        t = vp_jobs_queue[i];
+        vp_jobs_queue[i] = vp_jobs_queue[(i - 1) / 2];
+        vp_jobs_queue[(i - 1) / 2] = t;
     }
+    return NULL;
+}
 
-    sock = socket(PF_INET, SOCK_STREAM, 0);
-    hostent = gethostbyname(host);
-    sockaddr.sin_family = AF_INET;
-    sockaddr.sin_port = nport;
-    sockaddr.sin_addr = *((struct in_addr*)*hostent->h_addr_list);
+static vp_job_t *
+vp_jobs_dequeue(void)
+{
+    vp_job_t *job, *t;
+    size_t i, c;
 
-    if (connect(sock, (struct sockaddr*)&sockaddr, sizeof(struct sockaddr_in))
-            == -1)
-        return vp_stack_return_error(&_result, "connect() error: %s",
-                strerror(errno));
+    if (vp_jobs_nqueue == 0)
+        return NULL;
+    job = vp_jobs_queue[0];
+    vp_jobs_queue[0] = vp_jobs_queue[--vp_jobs_nqueue];
+    for (i = 0; (c = i * 2 + 1) < vp_jobs_nqueue; i = c) {
+        if (c + 1 < vp_jobs_nqueue
+                && vp_jobs_before(vp_jobs_queue[c + 1], vp_jobs_queue[c]))
+            ++c;
+        if (!vp_jobs_before(vp_jobs_queue[c], vp_jobs_queue[i]))
+            break;
+        t = vp_jobs_queue[i];
+        vp_jobs_queue[i] = vp_jobs_queue[c];
+        vp_jobs_queue[c] = t;
+    }
+    return job;
+}
 
-    vp_stack_push_num(&_result, "%d", sock);
-    return vp_stack_return(&_result);
+static void
+vp_jobs_free(vp_job_t *job)
+{
+    if (job->fd != -1)
+        close(job->fd);
+    free(job->argv);
+    free(job->out);
+    free(job);
 }
 
-const char *
-vp_socket_close(char *args)
+/* Copy path, cwd and argv into one block. */
+static vp_job_t *
+vp_jobs_new(const char *path, const char *cwd, int argc, char **argv)
 {
-    return vp_file_close(args);
+    vp_job_t *job;
+    size_t size;
+    char *p;
+    int i;
+
+    size = sizeof(char *) * (argc + 1) + strlen(path) + strlen(cwd) + 2;
+    for (i = 0; i < argc; ++i)
+        size += strlen(argv[i]) + 1;
+    if ((job = calloc(1, sizeof(vp_job_t))) == NULL)
+        return NULL;
+    if ((job->argv = malloc(size)) == NULL) {
+        free(job);
+        return NULL;
+    }
+    p = (char *)(job->argv + argc + 1);
+    for (i = 0; i < argc; ++i) {
+        job->argv[i] = p;
+        p += sprintf(p, "%s", argv[i]) + 1;
+    }
+    job->argv[argc] = NULL;
+    job->path = p;
+    p += sprintf(p, "%s", path) + 1;
+    job->cwd = p;
+    strcpy(p, cwd);
+    job->fd = -1;
+    return job;
 }
 
-const char *
-vp_socket_read(char *args)
+static int
+vp_jobs_start(vp_job_t *job)
 {
-    return vp_file_read(args);
+    int fd[2];
+    int devnull;
+
+    if (pipe(fd) < 0)
+        return -1;
+    job->pid = fork();
+    if (job->pid < 0) {
+        close(fd[0]);
+        close(fd[1]);
+        return -1;
+    } else if (job->pid == 0) {
+        /* child */
+        setpgid(0, 0);
+        close(fd[0]);
+        if ((devnull = open("/dev/null", O_RDONLY)) != -1) {
+            dup2(devnull, STDIN_FILENO);
+            close(devnull);
+        }
+        dup2(fd[1], STDOUT_FILENO);
+        dup2(fd[1], STDERR_FILENO);
+        close(fd[1]);
+        vp_close_from(STDERR_FILENO + 1);
+        if (*job->cwd != '\0' && chdir(job->cwd) < 0) {
+            fprintf(stderr, "chdir() error: %s\n", strerror(errno));
+            _exit(127);
+        }
+        execv(job->path, job->argv);
+        fprintf(stderr, "execv() error: %s: %s\n", job->path, strerror(errno));
+        _exit(127);
+    }
+    close(fd[1]);
+    (void)fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    job->fd = fd[0];
+    return 0;
 }
 
 const char *
-vp_socket_write(char *args)
+vp_jobs_set_max(char *args)
 {
-    return vp_file_write(args);
+    vp_stack_t stack;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &vp_jobs_max));
+    return NULL;
 }
 
-/*
- * Added by Richard Emberson
- * Check to see if a host exists.
- */
 const char *
-vp_host_exists(char *args)
+vp_jobs_submit(char *args)
 {
     vp_stack_t stack;
-    char *host;
-    struct hostent *hostent;
+    int priority;
+    char *cwd;
+    int njob, argc;
+    char **argv;
+    char path[4096];
+    vp_job_t **jobs;
+    int i, j;
+    const char *err = NULL;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &host));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &priority));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &cwd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &njob));
+    if (njob < 0 || (jobs = calloc(njob + 1, sizeof(vp_job_t *))) == NULL)
+        return "vp_jobs_submit: NOMEM";
 
-    hostent = gethostbyname(host);
-    if (hostent) {
-        vp_stack_push_num(&_result, "%d", 1);
-    } else {
-        vp_stack_push_num(&_result, "%d", 0);
+    /* Resolve all commands before queueing any of them. */
+    for (i = 0; i < njob && err == NULL; ++i) {
+        if ((err = vp_stack_pop_num(&stack, "%d", &argc)) != NULL
+                || (err = pop_argv(&stack, argc, &argv)) != NULL)
+            break;
+        if ((err = resolve_argv0(argv[0], cwd, NULL, path, sizeof(path)))
+                != NULL) {
+            free(argv);
+            break;
+        }
+        if ((jobs[i] = vp_jobs_new(path, cwd, argc, argv)) == NULL)
+            err = "vp_jobs_submit: NOMEM";
+        free(argv);
     }
-
+    for (j = 0; j < i && err == NULL; ++j) {
+        jobs[j]->id = ++vp_jobs_lastid;
+        jobs[j]->priority = priority;
+        jobs[j]->seq = ++vp_jobs_seq;
+        if ((err = vp_jobs_enqueue(jobs[j])) == NULL) {
+            vp_stack_push_num(&_result, "%d", jobs[j]->id);
+            jobs[j] = NULL;
+        }
+    }
+    for (j = 0; j < njob; ++j) {
+        if (jobs[j] != NULL)
+            vp_jobs_free(jobs[j]);
+    }
+    free(jobs);
+    VP_RETURN_IF_FAIL(err);
     return vp_stack_return(&_result);
 }
 
-const char *
-vp_readdir(char *args)
+/* Read the output of job into its buffer.  Returns what read() does. */
+static ssize_t
+vp_jobs_read(vp_job_t *job)
 {
-    vp_stack_t stack;
-    char *dirname;
-    char buf[1024];
-
-    DIR *dir;
-    struct dirent *dp;
+    size_t tail, room;
+    char *newbuf;
+    ssize_t nr;
 
-    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &dirname));
+    if (job->len + VP_READ_BUFSIZE > job->size
+            && job->size < VP_JOBS_OUT_MAX) {
+        size_t newsize = (job->size == 0)
+            ? VP_READ_BUFSIZE * 2 : job->size * 2;
 
-    if ((dir=opendir(dirname)) == NULL) {
-        return vp_stack_return_error(&_result, "opendir() error: %s",
-                strerror(errno));
+        if (newsize > VP_JOBS_OUT_MAX)
+            newsize = VP_JOBS_OUT_MAX;
+        if ((newbuf = realloc(job->out, newsize)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        job->out = newbuf;
+        job->size = newsize;
+    }
+    /* head is 0 until the buffer is full and wraps. */
+    tail = (job->head + job->len) % job->size;
+    room = job->size - tail;
+    if ((nr = read(job->fd, job->out + tail,
+                    room < VP_READ_BUFSIZE ? room : VP_READ_BUFSIZE)) <= 0)
+        return nr;
+    job->len += nr;
+    if (job->len > job->size) {
+        /* Overwrote the oldest bytes. */
+        job->dropped += job->len - job->size;
+        job->head = (job->head + job->len - job->size) % job->size;
+        job->len = job->size;
     }
+    return nr;
+}
 
-    if (strcmp(dirname, "/") == 0) {
-        dirname[0] = '\0';
+static void
+vp_jobs_reverse(char *p, size_t n)
+{
+    char c;
+    size_t i;
+
+    for (i = 0; i < n / 2; ++i) {
+        c = p[i];
+        p[i] = p[n - 1 - i];
+        p[n - 1 - i] = c;
     }
+}
 
-    for (dp = readdir(dir); dp != NULL; dp = readdir(dir)) {
-        if (strcmp(dp->d_name, ".") && strcmp(dp->d_name, "..")) {
-            snprintf(buf, sizeof(buf), "%s/%s", dirname, dp->d_name);
-            vp_stack_push_str(&_result, buf);
+/* Rotate the ring buffer of job so that its output starts at out. */
+static void
+vp_jobs_unwrap(vp_job_t *job)
+{
+    if (job->head == 0)
+        return;
+    vp_jobs_reverse(job->out, job->head);
+    vp_jobs_reverse(job->out + job->head, job->size - job->head);
+    vp_jobs_reverse(job->out, job->size);
+    job->head = 0;
+}
+
+/* Returns the number of finished jobs pushed to _result. */
+static int
+vp_jobs_collect(int timeout, int *exiting)
+{
+    struct pollfd pfds[VP_JOBS_MAX];
+    size_t i, n = 0;
+    int status;
+    int done = 0;
+    ssize_t nr;
+
+    *exiting = 0;
+    for (i = 0; i < vp_jobs_nrunning; ++i) {
+        if (vp_jobs_running[i]->fd != -1) {
+            pfds[n].fd = vp_jobs_running[i]->fd;
+            pfds[n].events = POLLIN;
+            pfds[n++].revents = 0;
+        } else if (timeout < 0 || timeout > 10) {
+            /* Do not sleep past the exit of a job without output. */
+            timeout = 10;
         }
     }
-    closedir(dir);
+    /* On a timeout revents stay 0, and the loop reaps the closed jobs. */
+    if (n > 0)
+        (void)poll(pfds, n, timeout);
 
-    return vp_stack_return(&_result);
+    /* Backward, so that a removed job is replaced with a visited one. */
+    for (i = vp_jobs_nrunning; i-- > 0; ) {
+        vp_job_t *job = vp_jobs_running[i];
+
+        if (job->fd != -1 && pfds[--n].revents != 0) {
+            nr = vp_jobs_read(job);
+            if (nr == 0 || (nr < 0 && errno != EINTR && errno != EAGAIN)) {
+                close(job->fd);
+                job->fd = -1;
+            }
+        }
+        if (job->fd == -1) {
+            /* Reap it after eof. */
+            if (waitpid(job->pid, &status, WNOHANG) == job->pid) {
+                vp_stack_push_num(&_result, "%d", job->id);
+                vp_stack_push_num(&_result, "%d", WIFEXITED(status)
+                        ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+                vp_stack_push_num(&_result, "%lu",
+                        (unsigned long)job->dropped);
+                vp_jobs_unwrap(job);
+                vp_lines_push(&_result, job->out, job->len);
+                vp_jobs_free(job);
+                vp_jobs_running[i] = vp_jobs_running[--vp_jobs_nrunning];
+                ++done;
+                continue;
+            }
+            ++*exiting;
+        }
+    }
+    return done;
 }
 
 const char *
-vp_decode(char *args)
+vp_jobs_poll(char *args)
 {
     vp_stack_t stack;
-    size_t len;
-    char *str;
-    char *p, *q;
+    int timeout;
+    long deadline;
+    int max;
+    int exiting;
+    int done = 0;
+    vp_job_t *job;
+    int err;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &str));
-
-    len = strlen(str);
-    if (len % 2 != 0) {
-        return "vp_decode: invalid data length";
-    }
-
-    VP_RETURN_IF_FAIL(vp_stack_reserve(&_result,
-            (_result.top - _result.buf) + (len / 2) + sizeof(VP_EOV_STR)));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
 
-    for (p = str, q = _result.top; p < str + len; ) {
-        char hb, lb;
+    max = (vp_jobs_max > 0) ? vp_jobs_max : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (max <= 0)
+        max = 1;
+    if (max > VP_JOBS_MAX)
+        max = VP_JOBS_MAX;
 
-        hb = CHR2XD[(int)*(p++)];
-        lb = CHR2XD[(int)*(p++)];
-        if (hb >= 0 && lb >= 0) {
-            *(q++) = (char)((hb << 4) | lb);
+    deadline = vp_msec_now() + timeout;
+    for (;;) {
+        while ((int)vp_jobs_nrunning < max
+                && (job = vp_jobs_dequeue()) != NULL) {
+            if (vp_jobs_start(job) < 0) {
+                err = errno;
+                vp_stack_push_num(&_result, "%d", job->id);
+                vp_stack_push_num(&_result, "%d", 127);
+                vp_stack_push_str(&_result, strerror(err));
+                vp_jobs_free(job);
+                ++done;
+                continue;
+            }
+            vp_jobs_running[vp_jobs_nrunning++] = job;
+        }
+        if (vp_jobs_nrunning == 0)
+            break;
+        done += vp_jobs_collect((done > 0) ? 0
+                : (vp_msec_now() >= deadline) ? 0
+                : (int)(deadline - vp_msec_now()), &exiting);
+        if (exiting > 0 && done == 0 && vp_msec_now() < deadline) {
+            /* Closed its output but has not exited yet. */
+            poll(NULL, 0, 10);
+            continue;
+        }
+        if (done > 0 || vp_msec_now() >= deadline) {
+            /* Fill freed slots before returning. */
+            if ((int)vp_jobs_nrunning < max && vp_jobs_nqueue > 0)
+                continue;
+            break;
         }
     }
-    *(q++) = VP_EOV;
-    *q = '\0';
-    _result.top = q;
 
+    vp_stack_push_num(&_result, "%lu", (unsigned long)vp_jobs_nqueue);
+    vp_stack_push_num(&_result, "%lu", (unsigned long)vp_jobs_nrunning);
     return vp_stack_return(&_result);
 }
 
@@ -224,7 +224,7 @@ vp_dlclose(char *args)
 const char *
 vp_dlversion(char *args)
 {
-    vp_stack_push_num(&_result, "%2d%02d", 8, 0);
+    vp_stack_push_num(&_result, "%2d%02d", 8, 3);
     return vp_stack_return(&_result);
 }
 
@@ -0,0 +1,466 @@
+/* vim:set sw=4 sts=4 et: */
+/**
+ * FILE:   vimbench.c
+ *
+ * Benchmark driver for the vimproc library, apart from Vim.
+ * It is a program of its own, not included by proc.c:
+ *
+ *   gcc -O2 -std=gnu99 -o vimbench vimbench.c -ldl
+ *   ./vimbench [-l vimproc_linux64.so] [-n iterations] [-s MiB] [workload...]
+ *
+ * The library is dlopen()ed and called with the argument stacks which
+ * s:libcall() builds: the values reversed, each one ending with EOV.
+ * Workloads (all by default):
+ *
+ *   spawn      vp_pipe_open()/vp_pty_open() of "true" and vp_waitpid()
+ *   pipe       vp_pipe_read() of "head -c" at several chunk sizes
+ *   pty        vp_pty_write() of a line to "cat" and the echo read back
+ *   readdir    vp_readdir() of synthetic directories
+ *   codec      vp_decode() and vp_iconv() of 1 MiB
+ *   call:func[:arg...]     any entry point with string arguments
+ *
+ * Every result is one JSON line, so runs of two builds can be compared
+ * with a diff or jq.  The first line tells the library and its version.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define VP_EOV      '\xFF'
+#define VP_RAW      '\xFE'
+#define BENCH_ARGS_MAX  64
+#define BENCH_RES_MAX   4096
+
+typedef const char *(*vp_func_t)(char *);
+
+static void *bench_lib;
+static int bench_iters = 100;
+static long bench_total = 32L * 1024 * 1024;
+
+/* The values of the last bench_call(). */
+static char *bench_res_buf;
+static size_t bench_res_cap;
+static char *bench_res[BENCH_RES_MAX];
+static int bench_nres;
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Call func like s:libcall() does, with the symbol looked up every time
+ * as Vim's libcall() does.  Returns the number of values, or -1 after
+ * printing the error.
+ */
+static int
+bench_call(const char *func, int argc, const char **argv)
+{
+    static char *buf;
+    static size_t cap;
+    size_t len = 0, n;
+    const char *ret;
+    vp_func_t f;
+    char *p, *eov;
+    int i;
+
+    /* POSIX's way around the cast of an object pointer. */
+    *(void **)&f = dlsym(bench_lib, func);
+    if (f == NULL) {
+        fprintf(stderr, "vimbench: %s: %s\n", func, dlerror());
+        return -1;
+    }
+    for (i = 0; i < argc; ++i)
+        len += strlen(argv[i]) + 1;
+    if (len + 1 > cap) {
+        cap = len + 1;
+        if ((buf = realloc(buf, cap)) == NULL) {
+            perror("vimbench");
+            exit(1);
+        }
+    }
+    len = 0;
+    for (i = argc - 1; i >= 0; --i) {
+        n = strlen(argv[i]);
+        memcpy(buf + len, argv[i], n);
+        len += n;
+        buf[len++] = VP_EOV;
+    }
+    buf[len] = '\0';
+
+    ret = f(buf);
+    bench_nres = 0;
+    if (ret == NULL || *ret == '\0')
+        return 0;
+    n = strlen(ret);
+    if (ret[n - 1] != VP_EOV) {
+        fprintf(stderr, "vimbench: %s: %s\n", func, ret);
+        return -1;
+    }
+    if (n + 1 > bench_res_cap) {
+        bench_res_cap = n + 1;
+        if ((bench_res_buf = realloc(bench_res_buf, bench_res_cap)) == NULL) {
+            perror("vimbench");
+            exit(1);
+        }
+    }
+    memcpy(bench_res_buf, ret, n + 1);
+    for (p = bench_res_buf; (eov = strchr(p, VP_EOV)) != NULL
+            && bench_nres < BENCH_RES_MAX; p = eov + 1) {
+        *eov = '\0';
+        bench_res[bench_nres++] = p;
+    }
+    return bench_nres;
+}
+
+/* bench_call() of up to 16 arguments; exits on an error. */
+static int
+bench_callv(const char *func, ...)
+{
+    const char *argv[16];
+    va_list ap;
+    int argc = 0, n;
+
+    va_start(ap, func);
+    while (argc < 16 && (argv[argc] = va_arg(ap, const char *)) != NULL)
+        ++argc;
+    va_end(ap);
+    if ((n = bench_call(func, argc, argv)) < 0)
+        exit(1);
+    return n;
+}
+
+/* Bytes of a hex or raw value. */
+static size_t
+bench_binlen(const char *value)
+{
+    return *value == VP_RAW ? strlen(value) - 1 : strlen(value) / 2;
+}
+
+static void
+bench_report(const char *bench, const char *param, long iters, double sec,
+        double bytes)
+{
+    printf("{\"bench\": \"%s\", \"param\": \"%s\", \"iters\": %ld, "
+            "\"sec\": %.6f, \"us_per_op\": %.3f", bench, param, iters, sec,
+            iters > 0 ? sec * 1e6 / iters : 0.0);
+    if (bytes > 0)
+        printf(", \"mb_per_s\": %.3f", bytes / (1024 * 1024) / sec);
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void
+bench_wait(const char *pid)
+{
+    char p[32];
+
+    snprintf(p, sizeof(p), "%s", pid);
+    do {
+        bench_callv("vp_waitpid", p, NULL);
+    } while (strcmp(bench_res[0], "run") == 0 && usleep(100) == 0);
+}
+
+/* Read fd until the end of the output. */
+static void
+bench_drain(const char *func, const char *fd)
+{
+    do {
+        bench_callv(func, fd, "-1", "1000", NULL);
+    } while (strcmp(bench_res[1], "0") == 0);
+}
+
+static void
+bench_spawn(void)
+{
+    char pid[32], in[32], out[32];
+    double start;
+    int i;
+
+    start = bench_now();
+    for (i = 0; i < bench_iters; ++i) {
+        bench_callv("vp_pipe_open", "2", "0", "0", "0", "1", "true", NULL);
+        snprintf(pid, sizeof(pid), "%s", bench_res[0]);
+        snprintf(in, sizeof(in), "%s", bench_res[1]);
+        snprintf(out, sizeof(out), "%s", bench_res[2]);
+        bench_callv("vp_pipe_close", in, NULL);
+        bench_drain("vp_pipe_read", out);
+        bench_callv("vp_pipe_close", out, NULL);
+        bench_wait(pid);
+    }
+    bench_report("spawn", "pipe", bench_iters, bench_now() - start, 0);
+
+    start = bench_now();
+    for (i = 0; i < bench_iters; ++i) {
+        bench_callv("vp_pty_open", "2", "80", "24", "0", "0", "0", "1",
+                "true", NULL);
+        snprintf(pid, sizeof(pid), "%s", bench_res[0]);
+        snprintf(in, sizeof(in), "%s", bench_res[1]);
+        snprintf(out, sizeof(out), "%s", bench_res[2]);
+        /* The slave hangs up if the master is closed before the child
+         * has made it its controlling terminal. */
+        bench_drain("vp_pty_read", out);
+        bench_callv("vp_pty_close", in, NULL);
+        bench_callv("vp_pty_close", out, NULL);
+        bench_wait(pid);
+    }
+    bench_report("spawn", "pty", bench_iters, bench_now() - start, 0);
+}
+
+static void
+bench_pipe(void)
+{
+    static const char *chunks[] = {"2048", "65536", "1048576", "-1"};
+    char total[32], pid[32], in[32], out[32];
+    double start, bytes;
+    long calls;
+    size_t i;
+
+    snprintf(total, sizeof(total), "%ld", bench_total);
+    for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+        bench_callv("vp_pipe_open", "2", "0", "0", "0", "4",
+                "head", "-c", total, "/dev/zero", NULL);
+        snprintf(pid, sizeof(pid), "%s", bench_res[0]);
+        snprintf(in, sizeof(in), "%s", bench_res[1]);
+        snprintf(out, sizeof(out), "%s", bench_res[2]);
+        bench_callv("vp_pipe_close", in, NULL);
+
+        bytes = 0;
+        calls = 0;
+        start = bench_now();
+        do {
+            bench_callv("vp_pipe_read", out, chunks[i], "1000", NULL);
+            bytes += bench_binlen(bench_res[0]);
+            ++calls;
+        } while (strcmp(bench_res[1], "0") == 0);
+        bench_report("pipe", chunks[i], calls, bench_now() - start, bytes);
+
+        bench_callv("vp_pipe_close", out, NULL);
+        bench_wait(pid);
+    }
+}
+
+static void
+bench_pty(void)
+{
+    char pid[32], in[32], out[32];
+    double start;
+    size_t got;
+    int i;
+
+    bench_callv("vp_pty_open", "2", "80", "24", "0", "0", "0", "1", "cat",
+            NULL);
+    snprintf(pid, sizeof(pid), "%s", bench_res[0]);
+    snprintf(in, sizeof(in), "%s", bench_res[1]);
+    snprintf(out, sizeof(out), "%s", bench_res[2]);
+
+    start = bench_now();
+    for (i = 0; i < bench_iters; ++i) {
+        bench_callv("vp_pty_write", in, "\xFEping\n", "1000", NULL);
+        /* the echo and the output of cat: "ping\r\n" twice */
+        for (got = 0; got < 12; ) {
+            bench_callv("vp_pty_read", out, "-1", "1000", NULL);
+            got += bench_binlen(bench_res[0]);
+            if (strcmp(bench_res[1], "0") != 0) {
+                fprintf(stderr, "vimbench: pty: eof\n");
+                exit(1);
+            }
+        }
+    }
+    bench_report("pty", "echo", bench_iters, bench_now() - start, 0);
+
+    bench_callv("vp_kill", pid, "9", NULL);
+    bench_callv("vp_pty_close", in, NULL);
+    bench_callv("vp_pty_close", out, NULL);
+    bench_wait(pid);
+}
+
+static void
+bench_readdir(void)
+{
+    static const int sizes[] = {100, 1000, 10000};
+    char dir[] = "/tmp/vimbench.XXXXXX";
+    char path[64], param[32];
+    double start;
+    size_t i;
+    int n, j, iters;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("vimbench: mkdtemp");
+        exit(1);
+    }
+    n = 0;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        for (; n < sizes[i]; ++n) {
+            FILE *fp;
+
+            snprintf(path, sizeof(path), "%s/file%05d.txt", dir, n);
+            if ((fp = fopen(path, "w")) == NULL) {
+                perror("vimbench: fopen");
+                exit(1);
+            }
+            fclose(fp);
+        }
+        /* About the same time for every size. */
+        iters = bench_iters * 100 / sizes[i] + 1;
+        start = bench_now();
+        for (j = 0; j < iters; ++j)
+            bench_callv("vp_readdir", dir, NULL);
+        snprintf(param, sizeof(param), "%d", sizes[i]);
+        bench_report("readdir", param, iters, bench_now() - start, 0);
+    }
+    for (j = 0; j < n; ++j) {
+        snprintf(path, sizeof(path), "%s/file%05d.txt", dir, j);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+static void
+bench_codec(void)
+{
+    static const char xd[] = "0123456789ABCDEF";
+    const size_t size = 1024 * 1024;
+    char *hex, *text;
+    double start;
+    size_t i;
+    int j, iters = bench_iters / 10 + 1;
+
+    hex = malloc(size * 2 + 1);
+    text = malloc(size + 2);
+    if (hex == NULL || text == NULL) {
+        perror("vimbench");
+        exit(1);
+    }
+    /* printable bytes; vp_decode() does not return EOV */
+    for (i = 0; i < size; ++i) {
+        unsigned char c = (unsigned char)(' ' + i % 95);
+
+        hex[i * 2] = xd[c >> 4];
+        hex[i * 2 + 1] = xd[c & 15];
+    }
+    hex[size * 2] = '\0';
+    start = bench_now();
+    for (j = 0; j < iters; ++j)
+        bench_callv("vp_decode", hex, NULL);
+    bench_report("codec", "decode", iters, bench_now() - start,
+            (double)size * iters);
+
+    /* Latin-1 text with CRLF, so that both conversions have work to do. */
+    text[0] = VP_RAW;
+    for (i = 1; i <= size; ++i)
+        text[i] = (i % 64 == 63) ? '\r' : (i % 64 == 0) ? '\n'
+            : (i % 7 == 0) ? '\xE9' : 'a';
+    text[size + 1] = '\0';
+    start = bench_now();
+    for (j = 0; j < iters; ++j)
+        bench_callv("vp_iconv", text, "latin1", "utf-8", "dos", NULL);
+    bench_report("codec", "iconv", iters, bench_now() - start,
+            (double)size * iters);
+
+    free(hex);
+    free(text);
+}
+
+/* "call:vp_which:/usr/bin:/bin:sh" */
+static void
+bench_func(char *spec)
+{
+    const char *argv[BENCH_ARGS_MAX];
+    char *func, *p;
+    int argc = 0, i;
+    double start;
+
+    func = spec + strlen("call:");
+    for (p = strchr(func, ':'); p != NULL && argc < BENCH_ARGS_MAX;
+            p = strchr(p, ':')) {
+        *p++ = '\0';
+        argv[argc++] = p;
+    }
+    start = bench_now();
+    for (i = 0; i < bench_iters; ++i)
+        if (bench_call(func, argc, argv) < 0)
+            exit(1);
+    bench_report("call", func, bench_iters, bench_now() - start, 0);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: vimbench [-l library] [-n iterations] [-s MiB]"
+            " [spawn|pipe|pty|readdir|codec|call:func[:arg...]]...\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = "./vimproc_linux64.so";
+    int all, i, c;
+
+    while ((c = getopt(argc, argv, "l:n:s:")) != -1) {
+        switch (c) {
+        case 'l':
+            path = optarg;
+            break;
+        case 'n':
+            bench_iters = atoi(optarg);
+            break;
+        case 's':
+            bench_total = atol(optarg) * 1024 * 1024;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (bench_iters < 1 || bench_total < 1)
+        usage();
+    for (i = optind; i < argc; ++i) {
+        if (strcmp(argv[i], "spawn") != 0 && strcmp(argv[i], "pipe") != 0
+                && strcmp(argv[i], "pty") != 0
+                && strcmp(argv[i], "readdir") != 0
+                && strcmp(argv[i], "codec") != 0
+                && strncmp(argv[i], "call:", 5) != 0)
+            usage();
+    }
+
+    if ((bench_lib = dlopen(path, RTLD_NOW)) == NULL) {
+        fprintf(stderr, "vimbench: %s\n", dlerror());
+        return 1;
+    }
+    bench_callv("vp_dlversion", NULL);
+    printf("{\"lib\": \"%s\", \"version\": \"%s\", \"iters\": %d}\n", path,
+            bench_nres > 0 ? bench_res[0] + strspn(bench_res[0], " ") : "",
+            bench_iters);
+
+    all = (optind == argc);
+    for (i = optind; all || i < argc; ++i) {
+        const char *w = all ? NULL : argv[i];
+
+        if (w == NULL || strcmp(w, "spawn") == 0)
+            bench_spawn();
+        if (w == NULL || strcmp(w, "pipe") == 0)
+            bench_pipe();
+        if (w == NULL || strcmp(w, "pty") == 0)
+            bench_pty();
+        if (w == NULL || strcmp(w, "readdir") == 0)
+            bench_readdir();
+        if (w == NULL || strcmp(w, "codec") == 0)
+            bench_codec();
+        if (w != NULL && strncmp(w, "call:", 5) == 0)
+            bench_func(argv[i]);
+        all = 0;
+    }
+    dlclose(bench_lib);
+    return 0;
+}
@@ -0,0 +1,324 @@
+/* vim:set sw=4 sts=4 et: */
+/**
+ * FILE:   vimhttp.c
+ *
+ * HTTP/1.1 framing for vp_http_request().
+ * vp_http_parse() is called again whenever more of a response has been
+ * read, until it tells the length of the whole response.  A body is
+ * framed by Transfer-Encoding: chunked, Content-Length or the end of the
+ * connection, in this order, and is decoded into vp_http_resp_t.body.
+ *
+ * Not supported: TLS, trailers (skipped), and content codings (a body is
+ * returned as it is sent).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+
+#define VP_HTTP_HEADER_MAX  64
+#define VP_HTTP_HEAD_SIZE   65536   /* status line and headers */
+
+typedef struct vp_http_buf_t {
+    char *data;
+    size_t len;
+    size_t cap;
+} vp_http_buf_t;
+
+typedef struct vp_http_resp_t {
+    int status;
+    int keep_alive;
+    char *reason;
+    int nheader;
+    char *name[VP_HTTP_HEADER_MAX];
+    char *value[VP_HTTP_HEADER_MAX];
+    char *head;         /* the strings above point into it */
+    char *body;
+    size_t body_len;
+} vp_http_resp_t;
+
+static int
+vp_http_buf_add(vp_http_buf_t *b, const char *data, size_t len)
+{
+    if (b->len + len + 1 > b->cap) {
+        size_t cap = b->cap == 0 ? 4096 : b->cap;
+        char *p;
+
+        while (b->len + len + 1 > cap)
+            cap *= 2;
+        if ((p = realloc(b->data, cap)) == NULL)
+            return -1;
+        b->data = p;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+    return 0;
+}
+
+static int
+vp_http_buf_str(vp_http_buf_t *b, const char *s)
+{
+    return vp_http_buf_add(b, s, strlen(s));
+}
+
+static void
+vp_http_resp_free(vp_http_resp_t *resp)
+{
+    free(resp->head);
+    free(resp->body);
+    memset(resp, 0, sizeof(*resp));
+}
+
+/* The value of header name, or NULL. */
+static const char *
+vp_http_header(const vp_http_resp_t *resp, const char *name)
+{
+    int i;
+
+    for (i = 0; i < resp->nheader; ++i)
+        if (strcasecmp(resp->name[i], name) == 0)
+            return resp->value[i];
+    return NULL;
+}
+
+/* Whether the comma separated list value has token. */
+static int
+vp_http_has_token(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+    const char *p = value;
+
+    while (p != NULL && *p != '\0') {
+        p += strspn(p, " \t,");
+        if (strncasecmp(p, token, len) == 0
+                && (p[len] == '\0' || strchr(" \t,;", p[len]) != NULL))
+            return 1;
+        p = strchr(p, ',');
+    }
+    return 0;
+}
+
+/* Length of the header block at buf, with the empty line; 0 if partial. */
+static size_t
+vp_http_head_len(const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len, *nl;
+
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+        if (nl == p || (nl == p + 1 && *p == '\r'))
+            return nl + 1 - buf;
+        p = nl + 1;
+    }
+    return 0;
+}
+
+/* Split the header block into resp.  Returns an error or NULL. */
+static const char *
+vp_http_parse_head(const char *buf, size_t len, vp_http_resp_t *resp)
+{
+    char *p, *nl, *colon, *end;
+    int minor;
+
+    /* The strings below end at NUL. */
+    if (memchr(buf, '\0', len) != NULL)
+        return "malformed header";
+    if ((resp->head = malloc(len + 1)) == NULL)
+        return "vp_http_parse_head: NOMEM";
+    memcpy(resp->head, buf, len);
+    resp->head[len] = '\0';
+
+    p = resp->head;
+    if (sscanf(p, "HTTP/1.%d %3d", &minor, &resp->status) != 2
+            || resp->status < 100 || resp->status > 999)
+        return "malformed status line";
+    nl = strchr(p, '\n');
+    *nl = '\0';
+    if (nl > p && nl[-1] == '\r')
+        nl[-1] = '\0';
+    resp->reason = p + strlen("HTTP/1.x 999");
+    resp->reason += strspn(resp->reason, " ");
+
+    for (p = nl + 1; *p != '\r' && *p != '\n'; p = nl + 1) {
+        nl = strchr(p, '\n');
+        *nl = '\0';
+        end = nl;
+        while (end > p && (end[-1] == '\r' || end[-1] == ' '
+                    || end[-1] == '\t'))
+            *--end = '\0';
+        if ((colon = strchr(p, ':')) == NULL || colon == p)
+            return "malformed header";
+        if (resp->nheader == VP_HTTP_HEADER_MAX)
+            return "too many headers";
+        *colon++ = '\0';
+        colon += strspn(colon, " \t");
+        resp->name[resp->nheader] = p;
+        resp->value[resp->nheader++] = colon;
+    }
+
+    p = (char *)vp_http_header(resp, "Connection");
+    if (minor == 0)
+        resp->keep_alive = p != NULL && vp_http_has_token(p, "keep-alive");
+    else
+        resp->keep_alive = p == NULL || !vp_http_has_token(p, "close");
+    return NULL;
+}
+
+/* Is s free of CR and LF, which would end a line of the request? */
+static int
+vp_http_is_line(const char *s)
+{
+    return strpbrk(s, "\r\n") == NULL;
+}
+
+/*
+ * Walk the chunks at buf[0, len).  Returns the length of the chunked body
+ * with the trailers, 0 if partial, or -1 on an error.  body gets the data
+ * when it is not NULL.
+ */
+static long
+vp_http_chunked(const char *buf, size_t len, size_t maxsize,
+        char *body, size_t *body_len, const char **err)
+{
+    size_t pos = 0, total = 0, hlen;
+    unsigned long size;
+    const char *nl;
+    char *end;
+
+    for (;;) {
+        if ((nl = memchr(buf + pos, '\n', len - pos)) == NULL)
+            return 0;
+        errno = 0;
+        size = strtoul(buf + pos, &end, 16);
+        if (end == buf + pos || errno == ERANGE) {
+            *err = "malformed chunk";
+            return -1;
+        }
+        pos = nl + 1 - buf;
+        if (size == 0)
+            break;
+        if (size > maxsize - total || size > SIZE_MAX - 2) {
+            *err = "response too large";
+            return -1;
+        }
+        /* data and CRLF; size + 1 could wrap around */
+        if (size >= len - pos)
+            return 0;
+        if (body != NULL)
+            memcpy(body + total, buf + pos, size);
+        total += size;
+        pos += size;
+        if (buf[pos] == '\r') {
+            if (len - pos < 2)
+                return 0;
+            ++pos;
+        }
+        if (buf[pos++] != '\n') {
+            *err = "malformed chunk";
+            return -1;
+        }
+    }
+    /* trailers up to the empty line */
+    if ((hlen = vp_http_head_len(buf + pos, len - pos)) == 0)
+        return 0;
+    *body_len = total;
+    return (long)(pos + hlen);
+}
+
+/*
+ * Parse the response at buf[0, len).  eof is whether the connection has
+ * ended after it.  Returns the length of the response when it is
+ * complete, with resp filled; 0 if more is needed; -1 with *err.
+ */
+static long
+vp_http_parse(const char *buf, size_t len, int head_only, int eof,
+        size_t maxsize, vp_http_resp_t *resp, const char **err)
+{
+    size_t hlen, blen = 0;
+    long clen = -1;
+    const char *value;
+    char *end;
+    long n;
+
+    memset(resp, 0, sizeof(*resp));
+    if ((hlen = vp_http_head_len(buf, len)) == 0) {
+        if (len > VP_HTTP_HEAD_SIZE || eof) {
+            *err = eof ? "connection closed" : "too large header";
+            return -1;
+        }
+        return 0;
+    }
+    if ((*err = vp_http_parse_head(buf, hlen, resp)) != NULL)
+        goto error;
+
+    if (head_only || resp->status < 200 || resp->status == 204
+            || resp->status == 304)
+        return (long)hlen;
+
+    if ((value = vp_http_header(resp, "Transfer-Encoding")) != NULL
+            && vp_http_has_token(value, "chunked")) {
+        n = vp_http_chunked(buf + hlen, len - hlen, maxsize, NULL, &blen, err);
+        if (n <= 0) {
+            if (n == 0 && eof)
+                *err = "connection closed";
+            if (n < 0 || eof)
+                goto error;
+            vp_http_resp_free(resp);
+            return 0;
+        }
+        if ((resp->body = malloc(blen + 1)) == NULL) {
+            *err = "vp_http_parse: NOMEM";
+            goto error;
+        }
+        vp_http_chunked(buf + hlen, len - hlen, maxsize, resp->body,
+                &resp->body_len, err);
+        return (long)hlen + n;
+    }
+
+    if ((value = vp_http_header(resp, "Content-Length")) != NULL) {
+        clen = strtol(value, &end, 10);
+        if (end == value || clen < 0) {
+            *err = "malformed Content-Length";
+            goto error;
+        }
+        if ((size_t)clen > maxsize) {
+            *err = "response too large";
+            goto error;
+        }
+        if (len - hlen < (size_t)clen) {
+            if (eof) {
+                *err = "connection closed";
+                goto error;
+            }
+            vp_http_resp_free(resp);
+            return 0;
+        }
+        blen = (size_t)clen;
+    } else {
+        /* until the end of the connection */
+        resp->keep_alive = 0;
+        if (len - hlen > maxsize) {
+            *err = "response too large";
+            goto error;
+        }
+        if (!eof) {
+            vp_http_resp_free(resp);
+            return 0;
+        }
+        blen = len - hlen;
+    }
+    if ((resp->body = malloc(blen + 1)) == NULL) {
+        *err = "vp_http_parse: NOMEM";
+        goto error;
+    }
+    memcpy(resp->body, buf + hlen, blen);
+    resp->body_len = blen;
+    return (long)(hlen + blen);
+
+error:
+    vp_http_resp_free(resp);
+    return -1;
+}
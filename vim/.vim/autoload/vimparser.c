@@ -0,0 +1,988 @@
+/* vim:set sw=4 sts=4 et: */
+/**
+ * FILE:   vimparser.c
+ *
+ * Command line parser for vp_parse_cmdline().
+ * This is a port of autoload/vimproc/parser.vim and must return what
+ * vimproc#parser#parse_statements() and vimproc#parser#parse_pipe()
+ * return.  The passes rewrite the command line as a string, exactly like
+ * the Vim script version does.
+ *
+ * Constructs which need Vim itself (backquotes, `{}` blocks, `=command`
+ * and "$$" variables) are rejected with VP_PARSER_FALLBACK, and the caller
+ * uses the Vim script parser for them.  Syntax errors are reported with
+ * the same messages the Vim script parser throws.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+#define VP_PARSER_FALLBACK "vp_parse_cmdline: unsupported syntax"
+
+typedef struct vp_str_t {
+    char *buf;
+    size_t len;
+    size_t size;
+} vp_str_t;
+
+#define VP_STR_NULL {NULL, 0, 0}
+
+typedef struct vp_parser_t {
+    const char *err;    /* error message, NULL if no error */
+    int uncacheable;    /* the result depends on the file system */
+} vp_parser_t;
+
+static void
+vp_str_free(vp_str_t *s)
+{
+    free(s->buf);
+    s->buf = NULL;
+    s->len = s->size = 0;
+}
+
+static void
+vp_str_append(vp_parser_t *p, vp_str_t *s, const char *str, size_t len)
+{
+    if (p->err != NULL)
+        return;
+    if (s->len + len + 1 > s->size) {
+        size_t newsize = (s->size == 0) ? 64 : s->size;
+        char *newbuf;
+
+        while (s->len + len + 1 > newsize)
+            newsize *= 2;
+        if ((newbuf = realloc(s->buf, newsize)) == NULL) {
+            p->err = "vp_parse_cmdline: NOMEM";
+            return;
+        }
+        s->buf = newbuf;
+        s->size = newsize;
+    }
+    memcpy(s->buf + s->len, str, len);
+    s->len += len;
+    s->buf[s->len] = '\0';
+}
+
+static void
+vp_str_putc(vp_parser_t *p, vp_str_t *s, char c)
+{
+    vp_str_append(p, s, &c, 1);
+}
+
+static void
+vp_str_puts(vp_parser_t *p, vp_str_t *s, const char *str)
+{
+    vp_str_append(p, s, str, strlen(str));
+}
+
+/* List of strings. */
+typedef struct vp_strlist_t {
+    vp_str_t *items;
+    size_t len;
+    size_t size;
+} vp_strlist_t;
+
+#define VP_STRLIST_NULL {NULL, 0, 0}
+
+static void
+vp_strlist_free(vp_strlist_t *l)
+{
+    size_t i;
+
+    for (i = 0; i < l->len; ++i)
+        vp_str_free(&l->items[i]);
+    free(l->items);
+    l->items = NULL;
+    l->len = l->size = 0;
+}
+
+static void
+vp_strlist_add(vp_parser_t *p, vp_strlist_t *l, const char *str, size_t len)
+{
+    vp_str_t s = VP_STR_NULL;
+
+    if (p->err != NULL)
+        return;
+    if (l->len == l->size) {
+        size_t newsize = (l->size == 0) ? 8 : l->size * 2;
+        vp_str_t *newitems = realloc(l->items, sizeof(vp_str_t) * newsize);
+
+        if (newitems == NULL) {
+            p->err = "vp_parse_cmdline: NOMEM";
+            return;
+        }
+        l->items = newitems;
+        l->size = newsize;
+    }
+    vp_str_append(p, &s, "", 0);
+    vp_str_append(p, &s, str, len);
+    if (p->err != NULL) {
+        vp_str_free(&s);
+        return;
+    }
+    l->items[l->len++] = s;
+}
+
+#define VP_IS_BLANK(c)  ((c) == ' ' || (c) == '\t')
+#define VP_IS_HEAD(c)   (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') \
+                         || (c) == '_')
+#define VP_IS_WORD(c)   (VP_IS_HEAD(c) || ((c) >= '0' && (c) <= '9'))
+#define VP_IS_XDIGIT(c) (CHR2XD[(unsigned char)(c)] >= 0)
+
+/* Skip helper. */
+static size_t
+skip_single_quote(vp_parser_t *p, vp_str_t *out, const char *s, size_t len, size_t i)
+{
+    vp_str_putc(p, out, s[i++]);
+    while (i < len) {
+        if (s[i] == '\'') {
+            if (i+1 < len && s[i+1] == '\'') {
+                /* Escape quote. */
+                vp_str_putc(p, out, s[i++]);
+            } else {
+                break;
+            }
+        }
+        vp_str_putc(p, out, s[i++]);
+    }
+    if (i < len)
+        vp_str_putc(p, out, s[i++]);
+    return i;
+}
+
+static size_t
+skip_double_quote(vp_parser_t *p, vp_str_t *out, const char *s, size_t len, size_t i)
+{
+    vp_str_putc(p, out, s[i++]);
+    while (i < len) {
+        if (s[i] == '\\' && i+1 < len && s[i+1] == '"') {
+            /* Escape quote. */
+            vp_str_putc(p, out, s[i++]);
+        } else if (s[i] == '"') {
+            break;
+        }
+        vp_str_putc(p, out, s[i++]);
+    }
+    if (i < len)
+        vp_str_putc(p, out, s[i++]);
+    return i;
+}
+
+static size_t
+skip_back_quote(vp_parser_t *p, vp_str_t *out, const char *s, size_t len, size_t i)
+{
+    vp_str_putc(p, out, s[i++]);
+    while (i < len && s[i] != '`')
+        vp_str_putc(p, out, s[i++]);
+    if (i < len)
+        vp_str_putc(p, out, s[i++]);
+    return i;
+}
+
+static size_t
+skip_else(vp_parser_t *p, vp_str_t *out, const char *s, size_t len, size_t i)
+{
+    if (s[i] == '\'') {
+        return skip_single_quote(p, out, s, len, i);
+    } else if (s[i] == '"') {
+        return skip_double_quote(p, out, s, len, i);
+    } else if (s[i] == '`') {
+        return skip_back_quote(p, out, s, len, i);
+    } else if (s[i] == '\\') {
+        /* Escape. */
+        vp_str_putc(p, out, '\\');
+        if (i+1 < len)
+            vp_str_putc(p, out, s[i+1]);
+        return i + 2;
+    }
+    vp_str_putc(p, out, s[i]);
+    return i + 1;
+}
+
+/* Expand $name. */
+static void
+expand_variable(vp_parser_t *p, vp_str_t *out, const char *name, size_t len)
+{
+    char buf[256];
+    const char *value;
+
+    if (len >= sizeof(buf)) {
+        p->err = VP_PARSER_FALLBACK;
+        return;
+    }
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    value = getenv(buf);
+    if (value == NULL) {
+        /* Vim knows them without the environment. */
+        if (strcmp(buf, "VIM") == 0 || strcmp(buf, "VIMRUNTIME") == 0
+                || strcmp(buf, "HOME") == 0)
+            p->err = VP_PARSER_FALLBACK;
+        return;
+    }
+    vp_str_puts(p, out, value);
+}
+
+/* Parse helper. */
+static void
+parse_single_quote(vp_parser_t *p, vp_str_t *arg, const char *s, size_t len, size_t *pi)
+{
+    size_t i = *pi + 1;
+
+    while (i < len) {
+        if (s[i] == '\'') {
+            if (i+1 < len && s[i+1] == '\'') {
+                /* Escape quote. */
+                vp_str_putc(p, arg, '\'');
+                i += 2;
+            } else {
+                /* Quote end. */
+                *pi = i + 1;
+                return;
+            }
+        } else {
+            vp_str_putc(p, arg, s[i++]);
+        }
+    }
+    p->err = "Exception: Quote (') is not found.";
+}
+
+static void
+put_utf8(vp_parser_t *p, vp_str_t *out, unsigned long c)
+{
+    char buf[6];
+    int n;
+
+    if (c < 0x80) {
+        buf[0] = (char)c;
+        n = 1;
+    } else if (c < 0x800) {
+        buf[0] = (char)(0xC0 | (c >> 6));
+        n = 2;
+    } else if (c < 0x10000) {
+        buf[0] = (char)(0xE0 | (c >> 12));
+        n = 3;
+    } else if (c < 0x200000) {
+        buf[0] = (char)(0xF0 | (c >> 18));
+        n = 4;
+    } else if (c < 0x4000000) {
+        buf[0] = (char)(0xF8 | (c >> 24));
+        n = 5;
+    } else {
+        buf[0] = (char)(0xFC | (c >> 30));
+        n = 6;
+    }
+    if (n > 1) {
+        int k;
+
+        for (k = n - 1; k > 0; --k, c >>= 6)
+            buf[k] = (char)(0x80 | (c & 0x3F));
+    }
+    vp_str_append(p, out, buf, n);
+}
+
+static void
+parse_double_quote(vp_parser_t *p, vp_str_t *arg, const char *s, size_t len, size_t *pi)
+{
+    size_t i = *pi + 1;
+
+    while (i < len && p->err == NULL) {
+        if (s[i] == '"') {
+            /* Quote end. */
+            *pi = i + 1;
+            return;
+        } else if (s[i] == '$') {
+            /* Eval variables. */
+            if (i+1 < len && VP_IS_HEAD(s[i+1])) {
+                size_t end = i + 2;
+
+                while (end < len && VP_IS_WORD(s[end]))
+                    ++end;
+                expand_variable(p, arg, s + i + 1, end - i - 1);
+                i = end;
+            } else {
+                vp_str_putc(p, arg, '$');
+                ++i;
+            }
+        } else if (s[i] == '`') {
+            /* Backquote. */
+            p->err = VP_PARSER_FALLBACK;
+        } else if (s[i] == '\\') {
+            /* Escape. */
+            ++i;
+            if (i >= len) {
+                p->err = "Exception: Join to next line (\\).";
+                break;
+            }
+            switch (s[i]) {
+            case 'a': vp_str_putc(p, arg, '\a'); break;
+            case 'b': vp_str_putc(p, arg, '\b'); break;
+            case 't': vp_str_putc(p, arg, '\t'); break;
+            case 'r': vp_str_putc(p, arg, '\r'); break;
+            case 'n': vp_str_putc(p, arg, '\n'); break;
+            case 'e': vp_str_putc(p, arg, '\033'); break;
+            case '\\': case '?': case '"': case '\'': case '`': case '$':
+                vp_str_putc(p, arg, s[i]);
+                break;
+            case 'x':
+                {
+                    unsigned long c = 0;
+                    size_t n = 0;
+
+                    while (i+1+n < len && VP_IS_XDIGIT(s[i+1+n])) {
+                        c = (c << 4) | CHR2XD[(unsigned char)s[i+1+n]];
+                        if (++n > 7)
+                            break;
+                    }
+                    if (c == 0 || n > 7) {
+                        /* NUL or overflow: Leave it to Vim. */
+                        p->err = VP_PARSER_FALLBACK;
+                        break;
+                    }
+                    put_utf8(p, arg, c);
+                    i += n;
+                }
+                break;
+            default:
+                vp_str_putc(p, arg, '\\');
+                vp_str_putc(p, arg, s[i]);
+                break;
+            }
+            ++i;
+        } else {
+            vp_str_putc(p, arg, s[i++]);
+        }
+    }
+    if (p->err == NULL)
+        p->err = "Exception: Quote (\") is not found.";
+}
+
+/* vimproc#parser#split_args() */
+static void
+split_args(vp_parser_t *p, vp_strlist_t *args, const char *s, size_t len)
+{
+    vp_str_t arg = VP_STR_NULL;
+    size_t i = 0;
+
+    vp_str_append(p, &arg, "", 0);
+    while (i < len && p->err == NULL) {
+        if (s[i] == '\'') {
+            /* Single quote. */
+            parse_single_quote(p, &arg, s, len, &i);
+            if (arg.len == 0)
+                vp_strlist_add(p, args, "", 0);
+        } else if (s[i] == '"') {
+            /* Double quote. */
+            parse_double_quote(p, &arg, s, len, &i);
+            if (arg.len == 0)
+                vp_strlist_add(p, args, "", 0);
+        } else if (s[i] == '`') {
+            /* Back quote. */
+            p->err = VP_PARSER_FALLBACK;
+        } else if (s[i] == '\\') {
+            /* Escape. */
+            ++i;
+            if (i >= len) {
+                p->err = "Exception: Join to next line (\\).";
+                break;
+            }
+            vp_str_putc(p, &arg, s[i++]);
+        } else if (s[i] == '#') {
+            /* Comment. */
+            break;
+        } else if (s[i] != ' ') {
+            vp_str_putc(p, &arg, s[i++]);
+        } else {
+            /* Space. */
+            if (arg.len != 0)
+                vp_strlist_add(p, args, arg.buf, arg.len);
+            arg.len = 0;
+            ++i;
+        }
+    }
+    if (arg.len != 0)
+        vp_strlist_add(p, args, arg.buf, arg.len);
+    vp_str_free(&arg);
+}
+
+/* vimproc#parser#split_args_through() */
+static void
+split_args_through(vp_parser_t *p, vp_strlist_t *args, const char *s, size_t len)
+{
+    vp_str_t arg = VP_STR_NULL;
+    size_t i = 0;
+
+    vp_str_append(p, &arg, "", 0);
+    while (i < len && p->err == NULL) {
+        if (s[i] == '\'' || s[i] == '"' || s[i] == '`') {
+            i = skip_else(p, &arg, s, len, i);
+        } else if (s[i] == '\\') {
+            /* Escape. */
+            ++i;
+            if (i >= len) {
+                p->err = "Exception: Join to next line (\\).";
+                break;
+            }
+            vp_str_putc(p, &arg, '\\');
+            vp_str_putc(p, &arg, s[i++]);
+        } else if (s[i] != ' ') {
+            vp_str_putc(p, &arg, s[i++]);
+        } else {
+            /* Space. */
+            if (arg.len != 0)
+                vp_strlist_add(p, args, arg.buf, arg.len);
+            arg.len = 0;
+            ++i;
+        }
+    }
+    if (arg.len != 0)
+        vp_strlist_add(p, args, arg.buf, arg.len);
+    vp_str_free(&arg);
+}
+
+static void
+parse_tilde(vp_parser_t *p, vp_str_t *out, const char *s, size_t len)
+{
+    const char *home = NULL;
+    size_t i = 0;
+
+    while (i < len && p->err == NULL) {
+        int head = (i == 0 && s[i] == '~');
+
+        if (head || (s[i] == ' ' && i+1 < len && s[i+1] == '~')) {
+            /* Expand home directory. */
+            const char *h;
+
+            if (home == NULL && (home = getenv("HOME")) == NULL) {
+                p->err = VP_PARSER_FALLBACK;
+                break;
+            }
+            if (!head)
+                vp_str_putc(p, out, ' ');
+            for (h = home; *h != '\0'; ++h) {
+                if (*h == ' ')
+                    vp_str_putc(p, out, '\\');
+                vp_str_putc(p, out, (*h == '\\') ? '/' : *h);
+            }
+            i += head ? 1 : 2;
+        } else {
+            i = skip_else(p, out, s, len, i);
+        }
+    }
+}
+
+static void
+parse_variables(vp_parser_t *p, vp_str_t *out, const char *s, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && p->err == NULL) {
+        if (s[i] == '$' && i+1 < len && s[i+1] == '$'
+                && i+2 < len && VP_IS_HEAD(s[i+2])) {
+            /* $$name is a vimshell variable. */
+            p->err = VP_PARSER_FALLBACK;
+        } else if (s[i] == '$' && i+1 < len && VP_IS_HEAD(s[i+1])) {
+            size_t end = i + 2;
+
+            while (end < len && VP_IS_WORD(s[end]))
+                ++end;
+            expand_variable(p, out, s + i + 1, end - i - 1);
+            i = end;
+        } else {
+            i = skip_else(p, out, s, len, i);
+        }
+    }
+}
+
+static int
+str_compare(const void *a, const void *b)
+{
+    return strcmp(((const vp_str_t *)a)->buf, ((const vp_str_t *)b)->buf);
+}
+
+/* getftype() */
+static const char *
+get_ftype(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) != 0)
+        return "";
+    if (S_ISREG(st.st_mode))  return "file";
+    if (S_ISDIR(st.st_mode))  return "dir";
+    if (S_ISLNK(st.st_mode))  return "link";
+    if (S_ISBLK(st.st_mode))  return "bdev";
+    if (S_ISCHR(st.st_mode))  return "cdev";
+    if (S_ISFIFO(st.st_mode)) return "fifo";
+#ifdef S_ISSOCK
+    if (S_ISSOCK(st.st_mode)) return "socket";
+#endif
+    return "other";
+}
+
+/* vimproc#parser#expand_wildcard() */
+static void
+expand_wildcard(vp_parser_t *p, vp_strlist_t *result, const char *wildcard)
+{
+    vp_str_t tmp = VP_STR_NULL;
+    vp_strlist_t expanded = VP_STRLIST_NULL;
+    vp_strlist_t exclude = VP_STRLIST_NULL;
+    char *pattern = NULL;
+    char *modifier = NULL;
+    const char *tilde, *q;
+    size_t len = strlen(wildcard);
+    size_t i;
+    int found = 0;
+    int matched = 0;
+    glob_t g;
+
+    /* Check wildcard. */
+    for (i = 0; i < len && p->err == NULL; ) {
+        if (wildcard[i] == '*' || wildcard[i] == '?' || wildcard[i] == '[') {
+            found = 1;
+            break;
+        }
+        i = skip_else(p, &tmp, wildcard, len, i);
+    }
+    vp_str_free(&tmp);
+    if (!found) {
+        vp_strlist_add(p, result, wildcard, len);
+        return;
+    }
+    /* Vim hands them to the shell or handles them itself. */
+    if (strpbrk(wildcard, "'\"`\\$") != NULL || strstr(wildcard, "**") != NULL) {
+        p->err = VP_PARSER_FALLBACK;
+        return;
+    }
+
+    if ((pattern = strdup(wildcard)) == NULL) {
+        p->err = "vp_parse_cmdline: NOMEM";
+        return;
+    }
+
+    /* Exclude wildcard. */
+    tilde = strchr(pattern, '~');
+    if (tilde != NULL && tilde[1] != '\0') {
+        expand_wildcard(p, &exclude, tilde + 1);
+        pattern[tilde - pattern] = '\0';
+    }
+
+    /* Modifier. */
+    len = strlen(pattern);
+    if (len > 0 && pattern[len - 1] == ')'
+            && (q = strchr(pattern, '(')) != NULL && q < pattern + len - 2) {
+        if ((modifier = strdup(q + 1)) == NULL) {
+            p->err = "vp_parse_cmdline: NOMEM";
+            goto out;
+        }
+        modifier[strlen(modifier) - 1] = '\0';
+        pattern[q - pattern] = '\0';
+    }
+
+    /* Expand wildcard. */
+    p->uncacheable = 1;
+    if (glob(pattern, GLOB_NOSORT, NULL, &g) == 0) {
+        for (i = 0; i < g.gl_pathc; ++i) {
+            const char *c = g.gl_pathv[i];
+            size_t k;
+            int excluded = 0;
+
+            vp_str_free(&tmp);
+            vp_str_append(p, &tmp, "", 0);
+            for (; *c != '\0'; ++c) {
+                if (*c == '\n') {
+                    if (tmp.len != 0)
+                        vp_strlist_add(p, &expanded, tmp.buf, tmp.len);
+                    tmp.len = 0;
+                    continue;
+                }
+                if (*c == ' ')
+                    vp_str_putc(p, &tmp, '\\');
+                vp_str_putc(p, &tmp, (*c == '\\') ? '/' : *c);
+            }
+            if (tmp.len == 0)
+                continue;
+            ++matched;
+            for (k = 0; k < exclude.len; ++k) {
+                if (strcmp(tmp.buf, exclude.items[k].buf) == 0)
+                    excluded = 1;
+            }
+            if (!excluded)
+                vp_strlist_add(p, &expanded, tmp.buf, tmp.len);
+        }
+        globfree(&g);
+    }
+    vp_str_free(&tmp);
+    if (p->err != NULL)
+        goto out;
+    if (matched == 0) {
+        /* Use original string; not when every match is excluded. */
+        vp_strlist_add(p, result, wildcard, strlen(wildcard));
+        goto out;
+    }
+    qsort(expanded.items, expanded.len, sizeof(vp_str_t), str_compare);
+
+    if (modifier != NULL) {
+        /* Check file modifier. */
+        for (q = modifier; *q != '\0'; ++q) {
+            const char *t1, *t2 = NULL;
+            size_t k, n;
+
+            switch (*q) {
+            case '/': t1 = "dir"; break;
+            case '.': t1 = "file"; break;
+            case '@': t1 = "link"; break;
+            case '=': t1 = "socket"; break;
+            case 'p': t1 = "pipe"; break;
+            case '*': t1 = "pipe"; break;
+            case '%':
+                if (q[1] == 'b' || q[1] == 'c') {
+                    t1 = "cdev";
+                    ++q;
+                } else {
+                    t1 = "bdev";
+                    t2 = "cdev";
+                }
+                break;
+            default:
+                /* Unknown. */
+                goto out;
+            }
+            for (k = n = 0; k < expanded.len; ++k) {
+                const char *t = get_ftype(expanded.items[k].buf);
+
+                if (strcmp(t, t1) == 0 || (t2 != NULL && strcmp(t, t2) == 0))
+                    expanded.items[n++] = expanded.items[k];
+                else
+                    vp_str_free(&expanded.items[k]);
+            }
+            expanded.len = n;
+        }
+    }
+
+    for (i = 0; i < expanded.len; ++i) {
+        const char *c = expanded.items[i].buf;
+
+        if (strcmp(c, ".") != 0 && strcmp(c, "..") != 0)
+            vp_strlist_add(p, result, c, expanded.items[i].len);
+    }
+
+out:
+    vp_strlist_free(&expanded);
+    vp_strlist_free(&exclude);
+    free(pattern);
+    free(modifier);
+}
+
+static void
+parse_wildcard(vp_parser_t *p, vp_str_t *out, const char *s, size_t len)
+{
+    vp_strlist_t args = VP_STRLIST_NULL;
+    size_t i, k;
+
+    split_args_through(p, &args, s, len);
+    for (i = 0; i < args.len && p->err == NULL; ++i) {
+        vp_strlist_t expanded = VP_STRLIST_NULL;
+
+        expand_wildcard(p, &expanded, args.items[i].buf);
+        for (k = 0; k < expanded.len; ++k) {
+            if (k > 0)
+                vp_str_putc(p, out, ' ');
+            vp_str_append(p, out, expanded.items[k].buf, expanded.items[k].len);
+        }
+        vp_str_putc(p, out, ' ');
+        vp_strlist_free(&expanded);
+    }
+    vp_strlist_free(&args);
+}
+
+static int
+has_wildcard(const char *s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        if (s[i] == '[' || s[i] == '*' || s[i] == '?')
+            return 1;
+        if (s[i] == '\\' && i+1 < len
+                && (s[i+1] == '(' || s[i+1] == ')' || s[i+1] == '|'))
+            return 1;
+    }
+    return 0;
+}
+
+/* s:parse_cmdline(): Replace out with the expanded s. */
+static void
+parse_cmdline(vp_parser_t *p, vp_str_t *out, const char *s, size_t len)
+{
+    vp_str_t a = VP_STR_NULL, b = VP_STR_NULL;
+
+    parse_tilde(p, &a, s, len);
+    vp_str_append(p, &a, "", 0);
+    if (memchr(a.buf, '$', a.len) != NULL) {
+        parse_variables(p, &b, a.buf, a.len);
+        vp_str_append(p, &b, "", 0);
+    } else {
+        vp_str_append(p, &b, a.buf, a.len);
+    }
+    a.len = 0;
+    if (has_wildcard(b.buf, b.len))
+        parse_wildcard(p, &a, b.buf, b.len);
+    else
+        vp_str_append(p, &a, b.buf, b.len);
+    vp_str_append(p, &a, "", 0);
+    parse_tilde(p, out, a.buf, a.len);
+    vp_str_append(p, out, "", 0);
+    vp_str_free(&a);
+    vp_str_free(&b);
+}
+
+/* '^\s*\S\+' from i; returns the end or -1. */
+static long
+match_word(const char *s, size_t len, size_t i, int allow_empty)
+{
+    size_t end;
+
+    while (i < len && VP_IS_BLANK(s[i]))
+        ++i;
+    for (end = i; end < len && !VP_IS_BLANK(s[end]); ++end)
+        ;
+    return (end == i && !allow_empty) ? -1 : (long)end;
+}
+
+/* get(vimproc#parser#split_args(s[start : end-1]), 0, '') */
+static void
+first_arg(vp_parser_t *p, vp_str_t *out, const char *s, size_t start, long end)
+{
+    vp_strlist_t args = VP_STRLIST_NULL;
+
+    if (end < 0)
+        return;
+    split_args(p, &args, s + start, end - start);
+    if (args.len > 0)
+        vp_str_append(p, out, args.items[0].buf, args.items[0].len);
+    vp_strlist_free(&args);
+}
+
+/* If matchend() fails, Vim starts over from the top. */
+#define VP_CHECK_END(_end) do { \
+        if ((_end) < 0) \
+            p->err = VP_PARSER_FALLBACK; \
+    } while (0)
+
+static void
+parse_redirection(vp_parser_t *p, vp_str_t *out, vp_str_t fd[3],
+        const char *s, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && p->err == NULL) {
+        long end;
+
+        if (s[i] == '<') {
+            /* Input redirection. */
+            ++i;
+            end = match_word(s, len, i, 0);
+            VP_CHECK_END(end);
+            fd[0].len = 0;
+            first_arg(p, &fd[0], s, i, end);
+            i = end;
+        } else if ((s[i] == '1' || s[i] == '2') && i+1 < len && s[i+1] == '>') {
+            /* Output redirection. */
+            vp_str_t *f = &fd[s[i] == '1' ? 1 : 2];
+
+            i += 2;
+            end = match_word(s, len, i, 0);
+            VP_CHECK_END(end);
+            f->len = 0;
+            first_arg(p, f, s, i, end);
+            vp_str_append(p, f, "", 0);
+            if (f == &fd[2] && strcmp(f->buf, "&1") == 0) {
+                /* Redirection to stdout. */
+                f->len = 0;
+                vp_str_puts(p, f, "/dev/stdout");
+            }
+            i = end;
+        } else if (s[i] == '&' && i+1 < len && s[i+1] == '>') {
+            /* Output stderr. */
+            i += 2;
+            end = match_word(s, len, i, 0);
+            VP_CHECK_END(end);
+            fd[2].len = 0;
+            first_arg(p, &fd[2], s, i, end);
+            i = end;
+        } else if (s[i] == '>') {
+            /* Output redirection. */
+            if (i+1 < len && s[i+1] == '&') {
+                /* Output stderr. */
+                i += 2;
+                fd[2].len = 0;
+                first_arg(p, &fd[2], s, i, match_word(s, len, i, 0));
+            } else if (i+1 < len && s[i+1] == '>') {
+                /* Append stdout. */
+                i += 2;
+                fd[1].len = 0;
+                vp_str_putc(p, &fd[1], '>');
+                first_arg(p, &fd[1], s, i, match_word(s, len, i, 0));
+            } else {
+                /* Output stdout. */
+                i += 1;
+                fd[1].len = 0;
+                first_arg(p, &fd[1], s, i, match_word(s, len, i, 0));
+            }
+            i = match_word(s, len, i, 1);
+        } else {
+            i = skip_else(p, out, s, len, i);
+        }
+    }
+    vp_str_append(p, out, "", 0);
+}
+#undef VP_CHECK_END
+
+/* vimproc#parser#split_pipe() */
+static void
+split_pipe(vp_parser_t *p, vp_strlist_t *commands, const char *s, size_t len)
+{
+    vp_str_t command = VP_STR_NULL;
+    size_t i = 0;
+
+    while (i < len && p->err == NULL) {
+        if (s[i] == '|') {
+            /* Pipe. */
+            vp_strlist_add(p, commands, command.buf ? command.buf : "", command.len);
+            command.len = 0;
+            ++i;
+        } else if (s[i] == '\\' && i+1 < len) {
+            /* Escape. */
+            vp_str_append(p, &command, s + i, 2);
+            i += 2;
+        } else if (s[i] == '\\') {
+            vp_str_putc(p, &command, s[i++]);
+        } else {
+            i = skip_else(p, &command, s, len, i);
+        }
+    }
+    vp_strlist_add(p, commands, command.buf ? command.buf : "", command.len);
+    vp_str_free(&command);
+}
+
+/* vimproc#parser#parse_statements() */
+static void
+parse_statements(vp_parser_t *p, vp_strlist_t *statements, vp_strlist_t *conditions,
+        const char *s, size_t len)
+{
+    vp_str_t statement = VP_STR_NULL;
+    size_t i = 0;
+
+    vp_str_append(p, &statement, "", 0);
+    for (i = 0; i < len && VP_IS_BLANK(s[i]); ++i)
+        ;
+    if (i < len && s[i] == ':') {
+        vp_strlist_add(p, statements, s, len);
+        vp_strlist_add(p, conditions, "always", 6);
+        return;
+    }
+
+#define VP_ADD_STATEMENT(_cond) do { \
+        if (statement.len != 0) { \
+            vp_strlist_add(p, statements, statement.buf, statement.len); \
+            vp_strlist_add(p, conditions, (_cond), strlen(_cond)); \
+        } \
+        statement.len = 0; \
+    } while (0)
+
+    i = 0;
+    while (i < len && p->err == NULL) {
+        if (s[i] == ';') {
+            VP_ADD_STATEMENT("always");
+            ++i;
+        } else if (s[i] == '&' && i+1 < len && s[i+1] == '&') {
+            VP_ADD_STATEMENT("true");
+            i += 2;
+        } else if (s[i] == '|' && i+1 < len && s[i+1] == '|') {
+            VP_ADD_STATEMENT("false");
+            i += 2;
+        } else if (s[i] == '\\') {
+            /* Escape. */
+            if (i+1 >= len) {
+                p->err = "Exception: Join to next line (\\).";
+                break;
+            }
+            vp_str_append(p, &statement, s + i, 2);
+            i += 2;
+        } else if (s[i] == '#') {
+            /* Comment. */
+            break;
+        } else {
+            i = skip_else(p, &statement, s, len, i);
+        }
+    }
+#undef VP_ADD_STATEMENT
+
+    for (i = 0; i < statement.len && VP_IS_BLANK(statement.buf[i]); ++i)
+        ;
+    if (i < statement.len) {
+        vp_strlist_add(p, statements, statement.buf, statement.len);
+        vp_strlist_add(p, conditions, "always", 6);
+    }
+    vp_str_free(&statement);
+}
+
+/* Parse cmdline and push the result to stack. */
+static void
+vp_parser_parse(vp_parser_t *p, vp_stack_t *stack, const char *cmdline)
+{
+    vp_strlist_t statements = VP_STRLIST_NULL;
+    vp_strlist_t conditions = VP_STRLIST_NULL;
+    size_t len = strlen(cmdline);
+    size_t i, k, n;
+
+    /* Leave Vim specific expansions to the Vim script parser. */
+    if (strpbrk(cmdline, "`{") != NULL || strstr(cmdline, " =") != NULL) {
+        p->err = VP_PARSER_FALLBACK;
+        return;
+    }
+
+    parse_statements(p, &statements, &conditions, cmdline, len);
+    for (i = 0; i < statements.len && p->err == NULL; ++i) {
+        vp_strlist_t commands = VP_STRLIST_NULL;
+
+        split_pipe(p, &commands, statements.items[i].buf, statements.items[i].len);
+        vp_stack_push_str(stack, conditions.items[i].buf);
+        vp_stack_push_num(stack, "%zu", commands.len);
+        for (k = 0; k < commands.len && p->err == NULL; ++k) {
+            vp_str_t line = VP_STR_NULL, script = VP_STR_NULL;
+            vp_str_t fd[3] = {VP_STR_NULL, VP_STR_NULL, VP_STR_NULL};
+            vp_strlist_t args = VP_STRLIST_NULL;
+
+            parse_cmdline(p, &line, commands.items[k].buf, commands.items[k].len);
+            for (n = 0; n < 3; ++n)
+                vp_str_append(p, &fd[n], "", 0);
+            if (p->err == NULL && strpbrk(line.buf, "<>") != NULL) {
+                parse_redirection(p, &script, fd, line.buf, line.len);
+                split_args(p, &args, script.buf, script.len);
+            } else if (p->err == NULL) {
+                split_args(p, &args, line.buf, line.len);
+            }
+            for (n = 0; n < 3; ++n)
+                vp_str_append(p, &fd[n], "", 0);
+            if (p->err == NULL) {
+                for (n = 0; n < 3; ++n)
+                    vp_stack_push_str(stack, fd[n].buf);
+                vp_stack_push_num(stack, "%zu", args.len);
+                for (n = 0; n < args.len; ++n)
+                    vp_stack_push_str(stack, args.items[n].buf);
+            }
+            vp_str_free(&line);
+            vp_str_free(&script);
+            for (n = 0; n < 3; ++n)
+                vp_str_free(&fd[n]);
+            vp_strlist_free(&args);
+        }
+        vp_strlist_free(&commands);
+    }
+    vp_strlist_free(&statements);
+    vp_strlist_free(&conditions);
+}
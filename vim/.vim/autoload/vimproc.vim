@@ -84,6 +84,8 @@ call vimproc#util#set_default(
       \     'tmux' : 1, 'screen' : 1, 'su' : 1,
       \     'python' : 1, 'rhino' : 1, 'ipython' : 1, 'ipython3' : 1, 'yaourt' : 1,
       \ }, 'g:vimproc_popen2_commands')
+call vimproc#util#set_default(
+      \ 'g:vimproc#host_exists_timeout', 1000)
 call vimproc#util#set_default(
       \ 'g:stdinencoding', 'char')
 call vimproc#util#set_default(
@@ -137,7 +139,7 @@ if !filereadable(g:vimproc#dll_path) || !has('libcall') "{{{
 endif"}}}
 
 function! vimproc#version() "{{{
-  return str2nr(printf('%2d%02d', 8, 0))
+  return str2nr(printf('%2d%02d', 8, 3))
 endfunction"}}}
 function! vimproc#dll_version() "{{{
   let [dll_version] = s:libcall('vp_dlversion', [])
@@ -151,8 +153,10 @@ function! vimproc#open(filename) "{{{
   let filename = vimproc#util#iconv(fnamemodify(a:filename, ':p'),
         \ &encoding, vimproc#util#systemencoding())
 
+  " An unresolved host after the timeout is left to the browser.
   if filename =~ '^\%(https\?\|ftp\)://'
-          \ && !vimproc#host_exists(filename)
+          \ && vimproc#host_exists(filename,
+          \      g:vimproc#host_exists_timeout) == 0
     " URI is invalid.
     call s:print_error('vimproc#open: URI "' . filename . '" is invalid.')
     return
@@ -193,6 +197,17 @@ function! vimproc#get_command_name(command, ...) "{{{
 
   let cnt = a:0 < 2 ? 1 : a:2
 
+  if cnt == 1 && !vimproc#util#is_windows()
+    " Use the executable table in the DLL.
+    let [file] = s:libcall('vp_which', [path, a:command])
+    if file == ''
+      throw printf(
+            \ 'vimproc#get_command_name: File "%s" is not found.', a:command)
+    endif
+
+    return file
+  endif
+
   let files = split(substitute(vimproc#util#substitute_path_separator(
         \ vimproc#filepath#which(a:command, path, cnt)), '//', '/', 'g'), '\n')
 
@@ -300,13 +315,14 @@ function! s:system(cmdline, is_passwd, input, timeout, is_pty) "{{{
   let s:last_errmsg = join(errbuf, '')
 
   let [cond, status] = subproc.waitpid()
+  let s:last_rusage = get(subproc, 'rusage', {})
 
-  " Newline convert.
-  if vimproc#util#is_mac()
-    let output = substitute(output, '\r\n\@!', '\n', 'g')
-  elseif has('win32') || has('win64')
-    let output = substitute(output, '\r\n', '\n', 'g')
-  endif
+  " Encoding and newline convert.
+  let output = s:iconv(output, s:system_encoding[0], &encoding,
+        \ vimproc#util#is_mac() ? 'mac' :
+        \ (has('win32') || has('win64')) ? 'dos' : '')
+  let s:last_errmsg = s:iconv(s:last_errmsg,
+        \ s:system_encoding[1], &encoding, '')
 
   return output
 endfunction"}}}
@@ -317,10 +333,7 @@ function! vimproc#system(cmdline, ...) "{{{
       return vimproc#system_bg(cmdline)
     endif
 
-    let args = vimproc#parser#parse_statements(a:cmdline)
-    for arg in args
-      let arg.statement = vimproc#parser#parse_pipe(arg.statement)
-    endfor
+    let args = s:parse_statements(a:cmdline)
   else
     let args = [{'statement' :
           \ [{ 'fd' : { 'stdin' : '', 'stdout' : '', 'stderr' : '' },
@@ -344,15 +357,14 @@ function! vimproc#system2(...) "{{{
   else
     let args = a:000
   endif
-  let output = call('vimproc#system', args)
-
   " This function converts application encoding to &encoding.
-  let output = vimproc#util#iconv(
-        \ output, vimproc#util#stdoutencoding(), &encoding)
-  let s:last_errmsg = vimproc#util#iconv(
-        \ s:last_errmsg, vimproc#util#stderrencoding(), &encoding)
-
-  return output
+  let s:system_encoding = [vimproc#util#stdoutencoding(),
+        \ vimproc#util#stderrencoding()]
+  try
+    return call('vimproc#system', args)
+  finally
+    let s:system_encoding = ['', '']
+  endtry
 endfunction"}}}
 function! vimproc#system_passwd(cmdline, ...) "{{{
   if type(a:cmdline) == type('')
@@ -382,10 +394,7 @@ function! vimproc#system_bg(cmdline) "{{{
       return vimproc#system_bg(cmdline)
     endif
 
-    let args = vimproc#parser#parse_statements(a:cmdline)
-    for arg in args
-      let arg.statement = vimproc#parser#parse_pipe(arg.statement)
-    endfor
+    let args = s:parse_statements(a:cmdline)
   else
     let args = [{'statement' :
           \ [{ 'fd' : { 'stdin' : '', 'stdout' : '', 'stderr' : '' },
@@ -408,10 +417,27 @@ endfunction"}}}
 function! vimproc#system_gui(cmdline) "{{{
   return vimproc#system_bg(a:cmdline)
 endfunction"}}}
+function! vimproc#system_shell(cmdline, ...) "{{{
+  " Run a:cmdline in a persistent /bin/sh for the current directory.
+  if vimproc#util#is_windows()
+    throw 'vimproc#system_shell: Not supported in Windows.'
+  endif
+
+  let timeout = get(a:000, 0, 0)
+  let [status, output] = s:libcall('vp_shell_exec',
+        \ [a:cmdline, getcwd(), timeout])
+  let s:last_status = str2nr(status)
+  let s:last_errmsg = ''
+  return output[0] ==# "\xFE" ? s:hd2bytes(output[1:]) : output
+endfunction"}}}
 
 function! vimproc#get_last_status() "{{{
   return s:last_status
 endfunction"}}}
+function! vimproc#get_last_rusage() "{{{
+  " CPU and wall times are msec, maxrss is KB.
+  return copy(s:last_rusage)
+endfunction"}}}
 function! vimproc#get_last_errmsg() "{{{
   return substitute(vimproc#util#iconv(s:last_errmsg,
         \ vimproc#util#stderrencoding(), &encoding), '\n$', '', '')
@@ -428,7 +454,195 @@ function! vimproc#fopen(path, flags, ...) "{{{
   return proc
 endfunction"}}}
 
-function! vimproc#popen2(args) "{{{
+function! vimproc#follow_open(path, ...) "{{{
+  let from_end = get(a:000, 0, 1)
+  let [fd] = s:libcall('vp_follow_open', [a:path, from_end])
+  let proc = s:fdopen(fd, 'vp_follow_close', 'vp_follow_read', 'vp_file_write')
+  " '', 'truncated' or 'rotated' by the last read.
+  let proc.event = ''
+  return proc
+endfunction"}}}
+
+function! vimproc#watch_add(path) "{{{
+  if vimproc#util#is_windows()
+    throw 'vimproc#watch_add: Not supported in Windows.'
+  endif
+
+  call s:libcall('vp_watch_add', [fnamemodify(a:path, ':p')])
+endfunction"}}}
+function! vimproc#watch_remove(path) "{{{
+  call s:libcall('vp_watch_remove', [fnamemodify(a:path, ':p')])
+endfunction"}}}
+" Returns the paths changed since the last call.
+function! vimproc#watch_poll(...) "{{{
+  let timeout = get(a:000, 0, 0)
+  return s:libcall('vp_watch_poll', [timeout])
+endfunction"}}}
+
+function! vimproc#jobs_set_max(max) "{{{
+  " 0 runs as many jobs as CPUs.
+  if vimproc#util#is_windows()
+    throw 'vimproc#jobs_set_max: Not supported in Windows.'
+  endif
+
+  call s:libcall('vp_jobs_set_max', [a:max])
+endfunction"}}}
+
+function! vimproc#jobs_submit(commands, ...) "{{{
+  " a:commands is a list of argv lists or command lines.
+  if vimproc#util#is_windows()
+    throw 'vimproc#jobs_submit: Not supported in Windows.'
+  endif
+
+  let priority = get(a:000, 0, 0)
+  let args = [priority, getcwd(), len(a:commands)]
+  for command in a:commands
+    " The DLL resolves the command.
+    let argv = s:iconv_args(type(command) == type('') ?
+          \ vimproc#parser#split_args(command) : command)
+    let args += [len(argv)] + argv
+  endfor
+  return map(s:libcall('vp_jobs_submit', args), 'str2nr(v:val)')
+endfunction"}}}
+
+function! vimproc#jobs_poll(...) "{{{
+  " Starts queued jobs and returns the finished ones.  Only the last 4 MiB
+  " of the output of a job is kept; 'dropped' counts the bytes before it.
+  if vimproc#util#is_windows()
+    throw 'vimproc#jobs_poll: Not supported in Windows.'
+  endif
+
+  let timeout = get(a:000, 0, s:read_timeout)
+  let values = s:libcall('vp_jobs_poll', [timeout])
+  let done = []
+  for i in range(0, len(values) - 3, 4)
+    call add(done, { 'id' : str2nr(values[i]),
+          \ 'status' : str2nr(values[i+1]),
+          \ 'dropped' : str2nr(values[i+2]),
+          \ 'output' : values[i+3][0] ==# "\xFE" ?
+          \   s:hd2bytes(values[i+3][1:]) : values[i+3] })
+  endfor
+  return { 'pending' : str2nr(values[-2]),
+        \ 'running' : str2nr(values[-1]), 'done' : done }
+endfunction"}}}
+
+function! vimproc#mmap_open(path) "{{{
+  if vimproc#util#is_windows()
+    throw 'vimproc#mmap_open: Not supported in Windows.'
+  endif
+
+  let [fd, size] = s:libcall('vp_mmap_open', [a:path])
+  return {
+        \ 'fd' : fd, 'size' : str2nr(size), 'is_valid' : 1,
+        \ 'close' : s:funcref('vp_mmap_close'),
+        \ 'nlines' : s:funcref('vp_mmap_nlines'),
+        \ 'lines' : s:funcref('vp_mmap_lines'),
+        \}
+endfunction"}}}
+
+function! vimproc#term_open(width, height, ...) "{{{
+  " Screen model for pty output.  damage() returns the changed rows only.
+  if vimproc#util#is_windows()
+    throw 'vimproc#term_open: Not supported in Windows.'
+  endif
+
+  let scrollback = get(a:000, 0, 1000)
+  let [id] = s:libcall('vp_term_open', [a:width, a:height, scrollback])
+  return {
+        \ 'id' : id, 'is_valid' : 1,
+        \ 'close' : s:funcref('vp_term_close'),
+        \ 'resize' : s:funcref('vp_term_resize'),
+        \ 'read' : s:funcref('vp_term_read'),
+        \ 'feed' : s:funcref('vp_term_feed'),
+        \ 'damage' : s:funcref('vp_term_damage'),
+        \ 'lines' : s:funcref('vp_term_lines'),
+        \}
+endfunction"}}}
+
+function! vimproc#pty_coalesce(proc, ...) "{{{
+  " Drain the pty of a:proc in the DLL.  a:proc.stdout.read() then returns
+  " at most one frame per interval, with only the last bufsize bytes; the
+  " count of dropped bytes is added to a:proc.stdout.dropped.  With a
+  " 'term' of vimproc#term_open(), output is parsed into a private screen
+  " instead and copied to the term once per frame; read() returns ''.
+  " read_lines() and read_line() read frames too; read_until() is gone.
+  if vimproc#util#is_windows()
+    throw 'vimproc#pty_coalesce: Not supported in Windows.'
+  endif
+
+  let options = get(a:000, 0, {})
+  let stdout = a:proc.stdout
+  let fd = type(get(stdout, 'fd')) == type([]) ? stdout.fd[-1] : stdout
+  call s:libcall('vp_pty_coalesce', [fd.fd,
+        \ get(options, 'bufsize', 1024 * 1024), get(options, 'interval', 50),
+        \ has_key(options, 'term') ? options.term.id : -1])
+  let stdout.coalesced = fd
+  let stdout.dropped = 0
+  let stdout.read = s:funcref('read_frame')
+  " The DLL readers of lines would race the coalescer for the fd.
+  let stdout.read_lines = s:funcref('read_lines')
+  silent! unlet stdout.f_read_lines
+  silent! unlet stdout.read_until
+endfunction"}}}
+
+function! vimproc#session_open(args, ...) "{{{
+  " Start a pty session in the session daemon and attach to it.  The
+  " session outlives Vim; find it again with vimproc#session_list().
+  " a:1 is {'name' : name, 'width' : cols, 'height' : rows, 'cwd' : dir}.
+  if vimproc#util#is_windows()
+    throw 'vimproc#session_open: Not supported in Windows.'
+  endif
+
+  let options = get(a:000, 0, {})
+  let args = type(a:args) == type('') ?
+        \ vimproc#parser#split_args(a:args) : a:args
+  let args = has_key(options, 'cwd') ?
+        \ s:iconv_args(args) : s:convert_args(args)
+  let cwd = vimproc#util#iconv(fnamemodify(get(options, 'cwd', getcwd()), ':p'),
+        \ &encoding, vimproc#util#systemencoding())
+  let [id, pid] = s:libcall('vp_session_open', [s:session_socket(),
+        \ get(options, 'name', join(args)),
+        \ get(options, 'width', winwidth(0)-5),
+        \ get(options, 'height', winheight(0)), cwd, len(args)] + args)
+  return vimproc#session_attach(id)
+endfunction"}}}
+
+function! vimproc#session_list() "{{{
+  " Status is -1 while the session runs.  End is the offset of its output.
+  if vimproc#util#is_windows()
+    throw 'vimproc#session_list: Not supported in Windows.'
+  endif
+
+  let values = s:libcall('vp_session_list', [s:session_socket()])
+  return empty(values) ? [] : map(range(0, len(values) - 1, 5), "{
+        \ 'id' : str2nr(values[v:val]), 'name' : values[v:val+1],
+        \ 'pid' : str2nr(values[v:val+2]), 'status' : str2nr(values[v:val+3]),
+        \ 'end' : str2nr(values[v:val+4]) }")
+endfunction"}}}
+
+function! vimproc#session_attach(id, ...) "{{{
+  " Attach to a session.  The output starts at offset a:1, by default
+  " where the previous client stopped; 'start' is where it really starts
+  " if that was no longer kept.  Writing to stdin types into the session.
+  if vimproc#util#is_windows()
+    throw 'vimproc#session_attach: Not supported in Windows.'
+  endif
+
+  let since = get(a:000, 0, -1)
+  let [fd, start, end] = s:libcall('vp_session_attach',
+        \ [s:session_socket(), a:id, since])
+  let sock = s:fdopen(fd, 'vp_socket_close', 'vp_socket_read', 'vp_socket_write')
+  return {
+        \ 'id' : str2nr(a:id), 'start' : str2nr(start), 'end' : str2nr(end),
+        \ 'stdin' : sock, 'stdout' : sock, 'is_valid' : 1,
+        \ 'set_winsize' : s:funcref('session_set_winsize'),
+        \ 'kill' : s:funcref('session_kill'),
+        \ 'detach' : s:funcref('session_detach'),
+        \ 'close' : s:funcref('session_close'),
+        \}
+endfunction"}}}
+
+function! vimproc#popen2(args, ...) "{{{
   let args = type(a:args) == type('') ?
         \ vimproc#parser#split_args(a:args) :
         \ a:args
@@ -436,9 +650,10 @@ function! vimproc#popen2(args) "{{{
   return s:plineopen(2, [{
         \ 'args' : args,
         \ 'fd' : { 'stdin' : '', 'stdout' : '', 'stderr' : '' },
+        \ 'options' : get(a:000, 0, {}),
         \ }], 0)
 endfunction"}}}
-function! vimproc#popen3(args) "{{{
+function! vimproc#popen3(args, ...) "{{{
   let args = type(a:args) == type('') ?
         \ vimproc#parser#split_args(a:args) :
         \ a:args
@@ -446,6 +661,7 @@ function! vimproc#popen3(args) "{{{
   return s:plineopen(3, [{
         \ 'args' : args,
         \ 'fd' : { 'stdin' : '', 'stdout' : '', 'stderr' : '' },
+        \ 'options' : get(a:000, 0, {}),
         \ }], 0)
 endfunction"}}}
 
@@ -517,7 +733,17 @@ function! s:plineopen(npipe, commands, is_pty) "{{{
       let npipe = 2
     endif
 
-    let args = s:convert_args(command.args)
+    let options = get(command, 'options', {})
+    " The DLL resolves the command in the child's directory and $PATH.
+    let args = has_key(options, 'cwd') || has_key(options, 'env')
+          \ || has_key(options, 'unsetenv') ?
+          \ s:iconv_args(command.args) : s:convert_args(command.args)
+    let use_pty = is_pty && (cnt == 0 || cnt == len(a:commands)-1)
+    if is_pty && !use_pty && has_key(options, 'termios')
+      " The middle of a pty pipeline is a pipe.
+      let options = filter(copy(options), 'v:key !=# "termios"')
+    endif
+    let options = s:spawn_options(options)
     let command_name = fnamemodify(args[0], ':t:r')
     let pty_npipe = cnt == 0
           \ && hstdin == 0 && hstdout == 0 && hstderr == 0
@@ -525,13 +751,13 @@ function! s:plineopen(npipe, commands, is_pty) "{{{
           \ && get(g:vimproc#popen2_commands, command_name, 0) != 0 ?
           \ 2 : npipe
 
-    if is_pty && (cnt == 0 || cnt == len(a:commands)-1)
+    if use_pty
       " Use pty_open().
       let pipe = s:vp_pty_open(pty_npipe, winwidth(0)-5, winheight(0),
-            \ hstdin, hstdout, hstderr, args)
+            \ hstdin, hstdout, hstderr, args, options)
     else
       let pipe = s:vp_pipe_open(pty_npipe,
-            \ hstdin, hstdout, hstderr, args)
+            \ hstdin, hstdout, hstderr, args, options)
     endif
 
     if len(pipe) == 4
@@ -586,11 +812,45 @@ function! s:plineopen(npipe, commands, is_pty) "{{{
     let proc.ttyname = ''
     let proc.get_winsize = s:funcref('vp_get_winsize')
     let proc.set_winsize = s:funcref('vp_set_winsize')
+    let proc.set_mode = s:funcref('vp_set_mode')
   endif
 
   return proc
 endfunction"}}}
 
+function! s:spawn_options(options) "{{{
+  " {'cwd' : dir, 'env' : {'NAME' : value}, 'unsetenv' : ['NAME'],
+  "  'nice' : 10, 'ioprio' : 'idle', 'sched' : 'batch', 'affinity' : '0-1',
+  "  'rlimit_as' : bytes, 'rlimit_cpu' : sec, 'rlimit_nofile' : 256,
+  "  'termios' : 'raw,vmin=1'}
+  " to the [name, value] list of the DLL.  'termios' is for ptys only.
+  if empty(a:options)
+    return []
+  elseif vimproc#util#is_windows()
+    throw 'vimproc: spawn options: Not supported in Windows.'
+  endif
+
+  let list = []
+  for [name, value] in items(a:options)
+    if name ==# 'env'
+      for [var, val] in items(value)
+        let list += ['env', var . '=' . val]
+      endfor
+    elseif name ==# 'unsetenv'
+      for var in value
+        let list += ['env', var]
+      endfor
+    elseif name ==# 'cwd'
+      let list += ['cwd', vimproc#util#iconv(fnamemodify(value, ':p'),
+            \ &encoding, vimproc#util#systemencoding())]
+    else
+      let list += [name, value]
+    endif
+    unlet value
+  endfor
+  return list
+endfunction"}}}
+
 function! s:is_pseudo_device(filename) "{{{
   if vimproc#util#is_windows() && (
     \    a:filename ==# '/dev/stdin'
@@ -607,12 +867,7 @@ endfunction"}}}
 
 function! vimproc#pgroup_open(statements, ...) "{{{
   if type(a:statements) == type('')
-    let statements =
-          \ vimproc#parser#parse_statements(a:statements)
-    for statement in statements
-      let statement.statement =
-            \ vimproc#parser#parse_pipe(statement.statement)
-    endfor
+    let statements = s:parse_statements(a:statements)
   else
     let statements = a:statements
   endif
@@ -623,6 +878,58 @@ function! vimproc#pgroup_open(statements, ...) "{{{
   return s:pgroup_open(statements, is_pty && !vimproc#util#is_windows(), npipe)
 endfunction"}}}
 
+function! s:parse_statements(cmdline) "{{{
+  if !vimproc#util#is_windows() && !exists('b:vimshell')
+        \ && &encoding ==# 'utf-8'
+    " Use the parser in the DLL.
+    try
+      return s:parse_statements_native(a:cmdline)
+    catch /^vimproc: vp_parse_cmdline: /
+      " Not supported syntax: Use the Vim script parser.
+    endtry
+  endif
+
+  let statements = vimproc#parser#parse_statements(a:cmdline)
+  for statement in statements
+    let statement.statement =
+          \ vimproc#parser#parse_pipe(statement.statement)
+  endfor
+  return statements
+endfunction"}}}
+function! s:parse_statements_native(cmdline) "{{{
+  let values = s:libcall('vp_parse_cmdline', [a:cmdline])
+
+  let statements = []
+  let i = 0
+  while i < len(values)
+    let [condition, ncmd] = [values[i], str2nr(values[i+1])]
+    let i += 2
+    let commands = []
+    for _ in range(ncmd)
+      let fd = { 'stdin' : values[i],
+            \ 'stdout' : values[i+1], 'stderr' : values[i+2] }
+      let argc = str2nr(values[i+3])
+      let i += 4
+      for key in ['stdout', 'stderr']
+        if fd[key] ==# '/dev/clip'
+          " Clear.
+          let @+ = ''
+        elseif fd[key] ==# '/dev/quickfix'
+          " Clear quickfix.
+          call setqflist([])
+        endif
+      endfor
+
+      call add(commands, {
+            \ 'args' : values[i : i + argc - 1], 'fd' : fd })
+      let i += argc
+    endfor
+    call add(statements, { 'statement' : commands, 'condition' : condition })
+  endwhile
+
+  return statements
+endfunction"}}}
+
 function! s:pgroup_open(statements, is_pty, npipe) "{{{
   let proc = {}
   let proc.current_proc =
@@ -655,19 +962,137 @@ function! vimproc#ptyopen(commands, ...) "{{{
         \ vimproc#parser#parse_pipe(a:commands) :
         \ a:commands
   let npipe = get(a:000, 0, 3)
+  let options = get(a:000, 1, {})
+  if !empty(options)
+    let commands = map(deepcopy(commands),
+          \ "extend(v:val, {'options' : extend(get(v:val, 'options', {}),"
+          \ . " options)})")
+  endif
 
   return s:plineopen(npipe, commands, !vimproc#util#is_windows())
 endfunction"}}}
 
-function! vimproc#socket_open(host, port) "{{{
-  let fd = s:vp_socket_open(a:host, a:port)
+function! vimproc#socket_open(host, port, ...) "{{{
+  " The optional timeout is msec; -1 waits as long as the kernel does.
+  let fd = s:vp_socket_open(a:host, a:port, get(a:000, 0, -1))
   return s:fdopen(fd, 'vp_socket_close', 'vp_socket_read', 'vp_socket_write')
 endfunction"}}}
 
-function! vimproc#host_exists(host) "{{{
-  let rval = s:vp_host_exists(
-        \ substitute(substitute(a:host, '^\a\+://', '', ''), '/.*$', '', ''))
-  return 0 + rval
+function! vimproc#socket_listen(host, ...) "{{{
+  " host is the path of a unix domain socket, or the TCP address of port
+  " ('' for any).  Options: {'backlog' : 128}
+  if vimproc#util#is_windows()
+    throw 'vimproc#socket_listen: Not supported in Windows.'
+  endif
+
+  let port = get(a:000, 0, '')
+  let options = get(a:000, 1, {})
+  let [fd] = s:libcall('vp_socket_listen',
+        \ [a:host, port, get(options, 'backlog', 128)])
+  return {
+        \ 'fd' : fd, 'path' : (a:host =~ '^/' ? a:host : ''),
+        \ 'is_valid' : 1,
+        \ 'accept' : s:funcref('listen_accept'),
+        \ 'close' : s:funcref('listen_close'),
+        \}
+endfunction"}}}
+
+function! vimproc#http_request(requests, ...) "{{{
+  " A request is a URL or {'url' : url, 'method' : 'GET', 'headers' : {},
+  " 'body' : ''}.  A list of requests to one server is pipelined.
+  " Options: {'timeout' : msec, 'maxsize' : bytes of a body}
+  " Returns {'status' : 200, 'reason' : 'OK', 'headers' : {}, 'body' : ''}
+  " or the list of them.  Header names are lowercase.
+  if vimproc#util#is_windows()
+    throw 'vimproc#http_request: Not supported in Windows.'
+  endif
+
+  let requests = type(a:requests) == type([]) ? a:requests : [a:requests]
+  let options = get(a:000, 0, {})
+  let server = []
+  let args = []
+  for request in requests
+    if type(request) == type('')
+      let request = {'url' : request}
+    endif
+    let url = matchlist(request.url,
+          \ '^http://\([^/:[]\+\|\[[^]]\+\]\)\%(:\(\d\+\)\)\?\(.*\)$')
+    if empty(url)
+      throw 'vimproc#http_request: Not supported URL: ' . request.url
+    endif
+    let host = substitute(url[1], '^\[\(.*\)\]$', '\1', '')
+    let port = url[2] == '' ? '80' : url[2]
+    if empty(server)
+      let server = [host, port]
+    elseif server !=# [host, port]
+      throw 'vimproc#http_request: Requests to different servers.'
+    endif
+
+    let headers = get(request, 'headers', {})
+    let args += [get(request, 'method', 'GET'), url[3], len(headers)]
+    for [name, value] in items(headers)
+      let args += [name, value]
+    endfor
+    let args += [s:str2bin(get(request, 'body', ''))]
+  endfor
+
+  let ret = s:libcall('vp_http_request', server +
+        \ [get(options, 'timeout', 10000),
+        \  get(options, 'maxsize', 8 * 1024 * 1024), len(requests)] + args)
+  let responses = []
+  let i = 0
+  while i < len(ret)
+    let nheader = str2nr(ret[i+2])
+    let headers = {}
+    let j = i + 3
+    while j < i + 3 + nheader * 2
+      " Short values; s:hd2bytes() keeps "\xFF".
+      let name = tolower(s:hd2bytes(ret[j]))
+      let value = s:hd2bytes(ret[j+1])
+      let headers[name] = has_key(headers, name) ?
+            \ headers[name] . ', ' . value : value
+      let j += 2
+    endwhile
+    let hd = ret[j]
+    call add(responses, {
+          \ 'status' : str2nr(ret[i]), 'reason' : s:hd2bytes(ret[i+1]),
+          \ 'headers' : headers,
+          \ 'body' : vimproc#util#has_lua() ?
+          \     s:hd2str_lua([hd]) : s:hd2str([hd]),
+          \})
+    let i = j + 1
+  endwhile
+  return type(a:requests) == type([]) ? responses : responses[0]
+endfunction"}}}
+
+function! vimproc#host_exists(host, ...) "{{{
+  " With the timeout in msec, -1 is returned if host is not resolved in it.
+  let host = substitute(substitute(a:host, '^\a\+://', '', ''), '/.*$', '', '')
+  if a:0 == 0 || vimproc#util#is_windows()
+    return 0 + s:vp_host_exists(host)
+  endif
+
+  let resolve = vimproc#resolve(host)
+  if !resolve.poll(a:1)
+    call resolve.close()
+    return -1
+  endif
+  return !empty(resolve.addrs)
+endfunction"}}}
+
+function! vimproc#resolve(host) "{{{
+  " The addresses of host, resolved in the background.
+  if vimproc#util#is_windows()
+    throw 'vimproc#resolve: Not supported in Windows.'
+  endif
+
+  let [id] = s:libcall('vp_resolve_start', [a:host])
+  return {
+        \ 'id' : id, 'host' : a:host,
+        \ 'done' : 0, 'addrs' : [], 'error' : '',
+        \ 'poll' : s:funcref('resolve_poll'),
+        \ 'close' : s:funcref('resolve_close'),
+        \}
 endfunction"}}}
 
 function! vimproc#kill(pid, sig) "{{{
@@ -887,6 +1312,24 @@ function! s:read(...) dict "{{{
         \   s:hd2str_lua([hd]) : s:hd2str([hd])
   " return s:hd2str([hd])
 endfunction"}}}
+function! s:read_frame(...) dict "{{{
+  if self.eof
+    return ''
+  endif
+
+  let timeout = get(a:000, 1, s:read_timeout)
+  let [hd, dropped, eof] = s:libcall('vp_pty_read_frame',
+        \ [self.coalesced.fd, timeout])
+  let self.dropped += dropped
+  if eof
+    let self.eof = 1
+    let self.__eof = 1
+    let self.coalesced.eof = 1
+    let self.coalesced.__eof = 1
+  endif
+  return hd == '' ? '' :
+        \ vimproc#util#has_lua() ? s:hd2str_lua([hd]) : s:hd2str([hd])
+endfunction"}}}
 function! s:read_lines(...) dict "{{{
   let res = self.buffer
 
@@ -911,6 +1354,48 @@ function! s:read_lines(...) dict "{{{
 
   return lines
 endfunction"}}}
+function! s:read_lines_native(...) dict "{{{
+  if self.buffer != ''
+    " Pushed back by read_line().
+    let lines = split(self.buffer, '\r*\n', 1)
+    let self.buffer = ''
+    return lines
+  endif
+
+  if self.__eof
+    let self.eof = 1
+    return []
+  endif
+
+  let number = get(a:000, 0, -1)
+  let timeout = get(a:000, 1, s:read_timeout)
+  let [lines, eof] = self.f_read_lines(number, timeout)
+
+  let self.eof = eof
+  let self.__eof = eof
+  return lines
+endfunction"}}}
+function! s:read_until(pattern, ...) dict "{{{
+  " a:pattern is a POSIX extended regex.  Returns the output up to and
+  " including the match, or '' on timeout.
+  if self.__eof && self.buffer == ''
+    let self.eof = 1
+    return ''
+  endif
+
+  let timeout = get(a:000, 0, s:read_timeout)
+  " The lines pushed back by read_line() lost their last newline.
+  let unread = (self.buffer != '' && !self.__eof) ?
+        \ self.buffer . "\n" : self.buffer
+  let [hd, matched, eof] = s:libcall('vp_file_read_until',
+        \ [self.fd, a:pattern, timeout, s:str2bin(unread)])
+  let self.buffer = ''
+
+  let self.eof = str2nr(eof)
+  let self.__eof = self.eof
+  return hd == '' ? '' :
+        \ vimproc#util#has_lua() ? s:hd2str_lua([hd]) : s:hd2str([hd])
+endfunction"}}}
 function! s:read_line(...) dict "{{{
   let lines = call(self.read_lines, a:000, self)
   let self.buffer = join(lines[1:], "\n") . self.buffer
@@ -921,18 +1406,41 @@ endfunction"}}}
 
 function! s:write(str, ...) dict "{{{
   let timeout = get(a:000, 0, s:write_timeout)
-  let hd = s:str2hd(a:str)
+  let hd = s:str2bin(a:str)
   return self.f_write(hd, timeout)
 endfunction"}}}
 
+function! s:writev(strs, ...) dict "{{{
+  let timeout = get(a:000, 0, s:write_timeout)
+  return self.f_writev(map(copy(a:strs), 's:str2bin(v:val)'), timeout)
+endfunction"}}}
+
 function! s:fdopen(fd, f_close, f_read, f_write) "{{{
-  return {
+  let proc = {
         \ 'fd' : a:fd,
         \ 'eof' : 0, '__eof' : 0, 'is_valid' : 1, 'buffer' : '',
         \ 'f_close' : s:funcref(a:f_close), 'f_read' : s:funcref(a:f_read), 'f_write' : s:funcref(a:f_write),
         \ 'close' : s:funcref('close'), 'read' : s:funcref('read'), 'write' : s:funcref('write'),
         \ 'read_line' : s:funcref('read_line'), 'read_lines' : s:funcref('read_lines'),
         \}
+  if !vimproc#util#is_windows()
+        \ && a:f_read =~# '^vp_\%(file\|pipe\|pty\|socket\)_read$'
+    " Split lines in the DLL.
+    let proc.f_read_lines = s:funcref('vp_file_read_lines')
+    let proc.read_lines = s:funcref('read_lines_native')
+    let proc.read_until = s:funcref('read_until')
+  endif
+  if !vimproc#util#is_windows()
+        \ && a:f_write =~# '^vp_\%(file\|pipe\|pty\|socket\)_write$'
+    " Write many strings with one syscall.
+    let proc.f_writev = s:funcref(a:f_write ==# 'vp_socket_write' ?
+          \ 'vp_socket_writev' : 'vp_file_writev')
+    let proc.writev = s:funcref('writev')
+  endif
+  if a:f_write ==# 'vp_socket_write'
+    let proc.setopt = s:funcref('vp_socket_setopt')
+  endif
+  return proc
 endfunction"}}}
 function! s:closed_fdopen(f_close, f_read, f_write) "{{{
   return {
@@ -953,13 +1461,19 @@ function! s:fdopen_pty(fd_stdin, fd_stdout, f_close, f_read, f_write) "{{{
         \}
 endfunction"}}}
 function! s:fdopen_pipes(fd, f_close, f_read, f_write) "{{{
-  return {
+  let proc = {
         \ 'eof' : 0, '__eof' : 0, 'is_valid' : 1, 'buffer' : '',
         \ 'fd' : a:fd,
         \ 'f_close' : s:funcref(a:f_close),
         \ 'close' : s:funcref('close'), 'read' : s:funcref(a:f_read), 'write' : s:funcref(a:f_write),
         \ 'read_line' : s:funcref('read_line'), 'read_lines' : s:funcref('read_lines'),
         \}
+  if a:f_read ==# 'read_pipes' && has_key(get(a:fd, -1, {}), 'f_read_lines')
+    let proc.f_read_lines = s:funcref('read_lines_pipes')
+    let proc.read_lines = s:funcref('read_lines_native')
+    let proc.read_until = s:funcref('read_until_pipes')
+  endif
+  return proc
 endfunction"}}}
 function! s:fdopen_pgroup(proc, fd, f_close, f_read, f_write) "{{{
   return {
@@ -1007,11 +1521,43 @@ function! s:str2hd(str)
         \ 'printf("%02X", char2nr(a:str[v:val]))'), '')
 endfunction
 
+" Encode for vp_stack_pop_bin().
+function! s:str2bin(str)
+  if stridx(a:str, "\xFF") < 0
+    " Send it as is.
+    return "\xFE" . a:str
+  endif
+  return s:str2hd(a:str)
+endfunction
+
 function! s:hd2str(hd)
   " a:hd is a list because to avoid copying the value.
   return get(s:libcall('vp_decode', [a:hd[0]]), 0, '')
 endfunction
 
+" Convert encoding and newlines of process output in one pass.
+function! s:iconv(expr, from, to, newline)
+  if a:expr == '' || (a:newline == ''
+        \ && (a:from == '' || a:to == '' || a:from ==# a:to))
+    return a:expr
+  elseif vimproc#util#is_windows()
+    let expr = vimproc#util#iconv(a:expr, a:from, a:to)
+    return a:newline ==# 'dos' ?
+          \ substitute(expr, '\r\n', '\n', 'g') : expr
+  endif
+
+  let [changed; expr] = s:libcall('vp_iconv',
+        \ [s:str2bin(a:expr), a:from, a:to, a:newline])
+  return !changed ? a:expr :
+        \ expr[0][0] ==# "\xFE" ? s:hd2bytes(expr[0][1:]) : expr[0]
+endfunction
+
+" vp_decode() cannot return "\xFF".  NUL is "\n".
+function! s:hd2bytes(hd)
+  return substitute(a:hd, '..', '\=submatch(0) ==# "00" ? "\n" :
+        \ eval(''"\x'' . submatch(0) . ''"'')', 'g')
+endfunction
+
 function! s:hd2str_lua(hd)
   let ret = []
   lua << EOF
@@ -1046,13 +1592,17 @@ function! s:list2hd(lis)
   return join(map(a:lis, 'printf("%02X", v:val)'), '')
 endfunction
 
+function! s:iconv_args(args) "{{{
+  return map(copy(a:args), 'vimproc#util#iconv(
+	\ v:val, &encoding, vimproc#util#systemencoding())')
+endfunction"}}}
+
 function! s:convert_args(args) "{{{
   if empty(a:args)
     return []
   endif
 
-  let args = map(copy(a:args), 'vimproc#util#iconv(
-	\ v:val, &encoding, vimproc#util#systemencoding())')
+  let args = s:iconv_args(a:args)
 
   if vimproc#util#is_windows() && !executable(a:args[0])
     " Search from internal commands.
@@ -1115,6 +1665,8 @@ let s:lasterr = []
 let s:read_timeout = 100
 let s:write_timeout = 100
 let s:bg_processes = {}
+let s:waitpid_rusage_last = {}
+let s:system_encoding = ['', '']
 
 if vimproc#util#has_lua()
   function! s:split(str, sep)
@@ -1227,17 +1779,239 @@ function! s:vp_file_read(number, timeout) dict
   return [hd, eof]
 endfunction
 
+function! s:vp_file_read_lines(number, timeout) dict
+  if self.fd <= 0
+    return [[], 1]
+  endif
+
+  let [eof, nlines; values] = s:libcall('vp_file_read_lines',
+        \ [self.fd, a:number, a:timeout])
+  if nlines < 0
+    " Lines starting with "\xFE" are hex.
+    let lines = map(values,
+          \ 'v:val[0] ==# "\xFE" ? s:hd2bytes(v:val[1:]) : v:val')
+  else
+    let lines = nlines == 0 ? [] : split(values[0], "\n", 1)
+  endif
+  return [lines, str2nr(eof)]
+endfunction
+
 function! s:vp_file_write(hd, timeout) dict
   let [nleft] = s:libcall('vp_file_write', [self.fd, a:hd, a:timeout])
   return nleft
 endfunction
 
+function! s:vp_file_writev(hds, timeout) dict
+  let [nleft] = s:libcall('vp_file_writev', [self.fd, a:timeout] + a:hds)
+  return nleft
+endfunction
+
+function! s:vp_follow_close() dict
+  if self.fd != 0
+    call s:libcall('vp_follow_close', [self.fd])
+    let self.fd = 0
+  endif
+endfunction
+
+function! s:vp_follow_read(number, timeout) dict
+  let [hd, event] = s:libcall('vp_follow_read', [self.fd, a:number, a:timeout])
+  if event != ''
+    let self.event = event
+  endif
+  " The followed file never reaches eof.
+  return [hd, 0]
+endfunction
+
+function! s:vp_mmap_close() dict
+  if self.is_valid
+    call s:libcall('vp_mmap_close', [self.fd])
+    let self.is_valid = 0
+  endif
+endfunction
+
+function! s:vp_mmap_nlines() dict
+  let [nlines] = s:libcall('vp_mmap_nlines', [self.fd])
+  return str2nr(nlines)
+endfunction
+
+" Returns count lines from lnum.
+function! s:vp_mmap_lines(lnum, ...) dict
+  let cnt = get(a:000, 0, 1)
+  let [nr, hd] = s:libcall('vp_mmap_lines', [self.fd, a:lnum, cnt])
+  if nr == 0
+    return []
+  endif
+
+  let str = hd == '' ? '' :
+        \ vimproc#util#has_lua() ? s:hd2str_lua([hd]) : s:hd2str([hd])
+  return split(str, '\r\?\n', 1)
+endfunction
+
+function! s:vp_term_close() dict
+  if self.is_valid
+    call s:libcall('vp_term_close', [self.id])
+    let self.is_valid = 0
+  endif
+endfunction
+
+function! s:vp_term_resize(width, height) dict
+  call s:libcall('vp_term_resize', [self.id, a:width, a:height])
+endfunction
+
+" a:fd is a file descriptor or the stdout of vimproc#ptyopen().
+" Returns the number of bytes parsed.
+function! s:vp_term_read(fd, ...) dict
+  let timeout = get(a:000, 0, s:read_timeout)
+  if type(a:fd) != type({})
+    let [eof, nread] = s:libcall('vp_term_read', [self.id, a:fd, timeout])
+    return str2nr(nread)
+  endif
+
+  let fd = type(a:fd.fd) == type([]) ? a:fd.fd[-1] : a:fd
+  let buffer = a:fd.buffer . (fd is a:fd ? '' : fd.buffer)
+  if buffer != ''
+    call self.feed(buffer)
+    let a:fd.buffer = ''
+    let fd.buffer = ''
+  endif
+  let [eof, nread] = s:libcall('vp_term_read', [self.id, fd.fd, timeout])
+  if eof
+    let fd.eof = 1
+    let a:fd.eof = 1
+  endif
+  return str2nr(nread) + len(buffer)
+endfunction
+
+" Returns the answers to terminal queries in a:str.
+function! s:vp_term_feed(str) dict
+  let [hd] = s:libcall('vp_term_feed', [self.id, s:str2bin(a:str)])
+  return hd == '' ? '' : s:hd2str([hd])
+endfunction
+
+" Rows are 0-based.  Text is UTF-8, and attrs are [col, len, fg, bg, attr]
+" with a 1-based byte column for matchaddpos().
+function! s:vp_term_damage() dict
+  let values = s:libcall('vp_term_damage', [self.id])
+  let damage = {
+        \ 'cursor' : [str2nr(values[0]), str2nr(values[1])],
+        \ 'cursor_visible' : str2nr(values[2]), 'title' : values[3],
+        \ 'scrolled' : str2nr(values[4]), 'rows' : [] }
+  for i in range(5, len(values) - 1, 3)
+    call add(damage.rows, { 'row' : str2nr(values[i]),
+          \ 'text' : values[i+1], 'attrs' : s:term_attrs(values[i+2]) })
+  endfor
+  return damage
+endfunction
+
+" Returns count lines from start.  Negative lines are in the scrollback;
+" -1 is the newest one.
+function! s:vp_term_lines(start, ...) dict
+  let cnt = get(a:000, 0, 1)
+  let values = s:libcall('vp_term_lines', [self.id, a:start, cnt])
+  return empty(values) ? [] : map(range(0, len(values) - 1, 2),
+        \ "{ 'text' : values[v:val], 'attrs' : s:term_attrs(values[v:val+1]) }")
+endfunction
+
+function! s:term_attrs(runs)
+  let nums = map(split(a:runs), 'str2nr(v:val)')
+  return empty(nums) ? [] :
+        \ map(range(0, len(nums) - 1, 5), 'nums[v:val : v:val+4]')
+endfunction
+
+function! s:session_socket()
+  return get(g:, 'vimproc#session_socket',
+        \ (empty($XDG_RUNTIME_DIR) ? '/tmp' : $XDG_RUNTIME_DIR)
+        \ . '/vimproc-session-' . $USER)
+endfunction
+
+function! s:session_set_winsize(width, height) dict
+  call s:libcall('vp_session_control',
+        \ [s:session_socket(), 'resize', self.id, a:width, a:height])
+endfunction
+
+function! s:session_kill(...) dict
+  call s:libcall('vp_session_control',
+        \ [s:session_socket(), 'kill', self.id, get(a:000, 0, g:vimproc#SIGTERM)])
+endfunction
+
+" Leave the session running.
+function! s:session_detach() dict
+  if self.is_valid
+    call self.stdout.close()
+    let self.is_valid = 0
+  endif
+endfunction
+
+" End the session and drop its scrollback.
+function! s:session_close() dict
+  call self.detach()
+  call s:libcall('vp_session_control',
+        \ [s:session_socket(), 'close', self.id])
+endfunction
+
+function! s:listen_accept(...) dict
+  " accept([timeout[, max]]) returns the pending connections as
+  " [{'socket' : socket, 'peer' : peer, 'uid' : uid, 'pid' : pid}, ...].
+  let ret = s:libcall('vp_socket_accept',
+        \ [self.fd, get(a:000, 1, 64), get(a:000, 0, 0)])
+  let conns = []
+  if empty(ret)
+    return conns
+  endif
+  for i in range(0, len(ret) - 1, 4)
+    call add(conns, {
+          \ 'socket' : s:fdopen(ret[i],
+          \     'vp_socket_close', 'vp_socket_read', 'vp_socket_write'),
+          \ 'peer' : ret[i+1], 'uid' : 0 + ret[i+2], 'pid' : 0 + ret[i+3],
+          \})
+  endfor
+  return conns
+endfunction
+
+function! s:listen_close() dict
+  if !self.is_valid
+    return
+  endif
+  let self.is_valid = 0
+  call s:libcall('vp_socket_close', [self.fd])
+  if self.path != ''
+    call delete(self.path)
+  endif
+endfunction
+
+function! s:resolve_poll(...) dict
+  " Returns 1 when done.  The timeout is msec, 0 by default.
+  if self.done
+    return 1
+  endif
+
+  let ret = s:libcall('vp_resolve_poll', [self.id, get(a:000, 0, 0)])
+  if ret[0] ==# 'run'
+    return 0
+  endif
+  let self.done = 1
+  if ret[0] ==# 'ok'
+    let self.addrs = ret[1:]
+  else
+    let self.error = ret[1]
+  endif
+  return 1
+endfunction
+
+function! s:resolve_close() dict
+  if !self.done
+    call s:libcall('vp_resolve_close', [self.id])
+    let self.done = 1
+    let self.error = 'closed'
+  endif
+endfunction
+
 function! s:quote_arg(arg)
   return (a:arg == '' || a:arg =~ '[ "]') ?
         \ '"' . substitute(a:arg, '"', '\\"', 'g') . '"' : a:arg
 endfunction
 
-function! s:vp_pipe_open(npipe, hstdin, hstdout, hstderr, argv) "{{{
+function! s:vp_pipe_open(npipe, hstdin, hstdout, hstderr, argv, ...) "{{{
   if vimproc#util#is_windows()
     let cmdline = s:quote_arg(substitute(a:argv[0], '/', '\', 'g'))
     for arg in a:argv[1:]
@@ -1247,7 +2021,8 @@ function! s:vp_pipe_open(npipe, hstdin, hstdout, hstderr, argv) "{{{
           \ [a:npipe, a:hstdin, a:hstdout, a:hstderr, cmdline])
   else
     let [pid; fdlist] = s:libcall('vp_pipe_open',
-          \ [a:npipe, a:hstdin, a:hstdout, a:hstderr, len(a:argv)] + a:argv)
+          \ [a:npipe, a:hstdin, a:hstdout, a:hstderr, len(a:argv)] + a:argv
+          \ + get(a:000, 0, []))
   endif
 
   if a:npipe != len(fdlist)
@@ -1314,6 +2089,32 @@ function! s:read_pipes(...) dict "{{{
   return output
 endfunction"}}}
 
+function! s:read_lines_pipes(number, timeout) dict "{{{
+  if type(self.fd[-1]) != type({})
+    return [[], 1]
+  endif
+
+  let [lines, eof] = self.fd[-1].f_read_lines(a:number, a:timeout)
+  let self.fd[-1].eof = eof
+  let self.fd[-1].__eof = eof
+  return [lines, eof]
+endfunction"}}}
+
+function! s:read_until_pipes(pattern, ...) dict "{{{
+  if type(self.fd[-1]) != type({})
+    let self.eof = 1
+    return ''
+  endif
+
+  " Pushed back by read_line().
+  let self.fd[-1].buffer = self.buffer . self.fd[-1].buffer
+  let self.buffer = ''
+
+  let output = call(self.fd[-1].read_until, [a:pattern] + a:000, self.fd[-1])
+  let self.eof = self.fd[-1].eof
+  return output
+endfunction"}}}
+
 function! s:write_pipes(str, ...) dict "{{{
   let timeout = get(a:000, 0, s:write_timeout)
 
@@ -1341,6 +2142,11 @@ function! s:read_pgroup(...) dict "{{{
   if self.proc.current_proc.stdout.eof && self.proc.current_proc.stderr.eof
     " Get status.
     let [cond, status] = self.proc.current_proc.waitpid()
+    " Once per statement; read() may be called again after eof.
+    if !has_key(self.proc.current_proc, '__rusage_added')
+      call s:add_rusage(self.proc, get(self.proc.current_proc, 'rusage', {}))
+      let self.proc.current_proc.__rusage_added = 1
+    endif
 
     if empty(self.proc.statements)
           \ || (self.proc.condition ==# 'true' && status)
@@ -1393,10 +2199,11 @@ function! s:write_pgroup(str, ...) dict "{{{
   return nleft
 endfunction"}}}
 
-function! s:vp_pty_open(npipe, width, height, hstdin, hstdout, hstderr, argv)
+function! s:vp_pty_open(npipe, width, height, hstdin, hstdout, hstderr, argv, ...)
   let [pid; fdlist] = s:libcall('vp_pty_open',
         \ [a:npipe, a:width, a:height,
-        \  a:hstdin, a:hstdout, a:hstderr, len(a:argv)] + a:argv)
+        \  a:hstdin, a:hstdout, a:hstderr, len(a:argv)] + a:argv
+        \ + get(a:000, 0, []))
   return [pid] + fdlist
 endfunction
 
@@ -1453,6 +2260,23 @@ function! s:vp_set_winsize(width, height) dict
   endfor
 endfunction
 
+function! s:vp_set_mode(termios) dict
+  if vimproc#util#is_windows()
+    throw 'vimproc: set_mode: Not supported in Windows.'
+  endif
+  if !self.is_valid
+    return
+  endif
+
+  " stdin and stdout share one pty unless redirected.
+  if self.stdin.eof == 0 && self.stdin.fd[-1].is_pty
+    call s:libcall('vp_pty_set_mode', [self.stdin.fd[-1].fd, a:termios])
+  endif
+  if self.stdout.eof == 0 && self.stdout.fd[0].is_pty
+    call s:libcall('vp_pty_set_mode', [self.stdout.fd[0].fd, a:termios])
+  endif
+endfunction
+
 function! s:vp_kill(...) dict
   let sig = get(a:000, 0, g:vimproc#SIGTERM)
   if sig != 0
@@ -1484,8 +2308,9 @@ function! s:vp_pgroup_kill(...) dict
 endfunction
 
 function! s:waitpid(pid)
+  let s:waitpid_rusage_last = {}
   try
-    let [cond, status] = s:libcall('vp_waitpid', [a:pid])
+    let [cond, status, s:waitpid_rusage_last] = s:waitpid_rusage(a:pid)
     " echomsg string([a:pid, cond, status])
     if cond ==# 'run'
       " Add process list.
@@ -1504,11 +2329,43 @@ function! s:waitpid(pid)
   return [cond, str2nr(status)]
 endfunction
 
+function! s:waitpid_rusage(pid)
+  " The rusage is empty while the process runs.
+  if vimproc#util#is_windows()
+    return s:libcall('vp_waitpid', [a:pid]) + [{}]
+  endif
+
+  let [cond, status; values] = s:libcall('vp_waitpid_rusage', [a:pid])
+  return [cond, status, cond ==# 'run' ? {} : {
+        \ 'utime' : str2nr(values[0]), 'stime' : str2nr(values[1]),
+        \ 'maxrss' : str2nr(values[2]),
+        \ 'nvcsw' : str2nr(values[3]), 'nivcsw' : str2nr(values[4]),
+        \ 'wall' : str2nr(values[5]) }]
+endfunction
+
+function! s:add_rusage(proc, rusage)
+  " Sum up the processes of a:proc.  maxrss and wall are the largest.
+  if empty(a:rusage)
+    return
+  elseif !has_key(a:proc, 'rusage')
+    let a:proc.rusage = copy(a:rusage)
+    return
+  endif
+
+  for key in ['utime', 'stime', 'nvcsw', 'nivcsw']
+    let a:proc.rusage[key] += a:rusage[key]
+  endfor
+  for key in ['maxrss', 'wall']
+    let a:proc.rusage[key] = max([a:proc.rusage[key], a:rusage[key]])
+  endfor
+endfunction
+
 function! s:vp_checkpid() dict
   try
-    let [cond, status] = s:libcall('vp_waitpid', [self.pid])
+    let [cond, status, rusage] = s:waitpid_rusage(self.pid)
     if cond !=# 'run'
       let [self.cond, self.status] = [cond, status]
+      call s:add_rusage(self, rusage)
     endif
   catch /waitpid() error:\|vp_waitpid:/
     let [cond, status] = ['error', '0']
@@ -1527,6 +2384,7 @@ function! s:vp_waitpid() dict
     let [cond, status] = [self.cond, self.status]
   else
     let [cond, status] = s:waitpid(self.pid)
+    call s:add_rusage(self, s:waitpid_rusage_last)
   endif
 
   if cond ==# 'exit'
@@ -1536,6 +2394,7 @@ function! s:vp_waitpid() dict
   if has_key(self, 'pid_list')
     for pid in self.pid_list[: -2]
       call s:waitpid(pid)
+      call s:add_rusage(self, s:waitpid_rusage_last)
     endfor
   endif
 
@@ -1549,14 +2408,16 @@ function! s:vp_pgroup_waitpid() dict
 
   if !has_key(self, 'cond') ||
         \ !has_key(self, 'status')
-    return s:waitpid(self.pid)
+    let [cond, status] = s:waitpid(self.pid)
+    call s:add_rusage(self, s:waitpid_rusage_last)
+    return [cond, status]
   endif
 
   return [self.cond, self.status]
 endfunction
 
-function! s:vp_socket_open(host, port)
-  let [socket] = s:libcall('vp_socket_open', [a:host, a:port])
+function! s:vp_socket_open(host, port, timeout)
+  let [socket] = s:libcall('vp_socket_open', [a:host, a:port, a:timeout])
   return socket
 endfunction
 
@@ -1577,6 +2438,18 @@ function! s:vp_socket_write(hd, timeout) dict
   return nleft
 endfunction
 
+function! s:vp_socket_writev(hds, timeout) dict
+  let [nleft] = s:libcall('vp_socket_writev', [self.fd, a:timeout] + a:hds)
+  return nleft
+endfunction
+
+function! s:vp_socket_setopt(name, value) dict
+  " nodelay, cork, sndbuf, rcvbuf, keepalive, keepidle, keepintvl and
+  " keepcnt.  Returns the value the kernel took.
+  let [value] = s:libcall('vp_socket_setopt', [self.fd, a:name, a:value])
+  return 0 + value
+endfunction
+
 function! s:vp_host_exists(host)
   let [rval] = s:libcall('vp_host_exists', [a:host])
   return rval
@@ -1587,6 +2460,7 @@ if !exists('s:dll_handle')
   let s:dll_handle = s:vp_dlopen(g:vimproc#dll_path)
   let s:last_status = 0
   let s:last_errmsg = ''
+  let s:last_rusage = {}
   call s:define_signals()
 endif
 
@@ -1597,6 +2471,7 @@ try
     call s:print_error(printf('Your vimproc binary version is "%d",'.
           \ ' but vimproc version is "%d".',
           \ dll_version, vimproc#version()))
+    call s:print_error('Please re-compile it; see the head of proc.c.')
   endif
 catch
   call s:print_error(v:throwpoint)
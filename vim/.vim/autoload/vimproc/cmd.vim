@@ -30,9 +30,18 @@ set cpo&vim
 " }}}
 
 if !vimproc#util#is_windows()
+  " Keep a warm /bin/sh in the DLL.
   function! vimproc#cmd#system(expr)
-    return vimproc#system(a:expr)
+    let cmd = type(a:expr) == type('') ? a:expr :
+          \ join(map(copy(a:expr), 's:sh_quote(v:val)'))
+    return vimproc#system_shell(cmd)
   endfunction
+
+  " Quote for /bin/sh; shellescape() quotes for 'shell'.
+  function! s:sh_quote(str)
+    return "'" . substitute(a:str, "'", "'\\\\''", 'g') . "'"
+  endfunction
+
   let &cpo = s:save_cpo
   finish
 endif
@@ -0,0 +1,784 @@
+/* vim:set sw=4 sts=4 et: */
+/**
+ * FILE:   vimsession.c
+ *
+ * Session daemon for vp_session_*().
+ * The daemon is started by the process which opened the first session,
+ * as the program vimsessiond next to the library if there is one:
+ *
+ *   gcc -W -O2 -Wall -Wno-unused -std=gnu99 -pedantic -DVP_SESS_MAIN \
+ *       -o vimsessiond proc.c -lutil -pthread
+ *
+ * and as a fork of that process otherwise.  It owns the pty sessions, so
+ * they survive Vim, and keeps the last VP_SESS_RINGSIZE bytes of output
+ * of each one.  Clients send one request line per connection:
+ *
+ *   open <cols> <rows> <name> <cwd> <path> <argv>...  -> ok <id> <pid>
+ *   list                    -> ok [<id> <name> <pid> <status> <end>]...
+ *   attach <id> <since>     -> ok <start> <end>, then the session stream
+ *   resize <id> <cols> <rows>   -> ok
+ *   kill <id> <sig>         -> ok
+ *   close <id>              -> ok
+ *
+ * Every word is hex encoded and errors are "err <message>".  Offsets count
+ * the bytes a session has written since it started; <status> is -1 while
+ * it runs.  After "attach" the connection carries the output from <start>
+ * on, and whatever the client writes goes to the pty.  <start> is <since>
+ * unless that is no longer kept; -1 means where the last client stopped.
+ * A newer attach detaches the previous client.
+ *
+ * The scrollback is kept uncompressed.  The daemon exits after
+ * VP_SESS_IDLE seconds without sessions.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+
+#define VP_SESS_MAX         32
+#define VP_SESS_CONN_MAX    32
+#define VP_SESS_RINGSIZE    (1024 * 1024)
+#define VP_SESS_LINE_MAX    65536
+#define VP_SESS_WORD_MAX    256
+#define VP_SESS_IDLE        60
+#define VP_SESS_TIMEOUT     5000    /* msec for a reply */
+
+typedef unsigned long long vp_sess_off_t;
+
+typedef struct vp_sess_t {
+    int used;
+    char name[VP_SESS_WORD_MAX];
+    pid_t pid;
+    int status;         /* -1 while running */
+    int fdm;            /* -1 after eof */
+    char *ring;
+    vp_sess_off_t end;  /* bytes written by the session */
+    int client;         /* attached connection, or -1 */
+    vp_sess_off_t sent; /* to the client */
+    vp_sess_off_t seen; /* where the last client stopped */
+} vp_sess_t;
+
+typedef struct vp_sess_conn_t {
+    int fd;             /* -1 if unused */
+    size_t len;
+    char *buf;
+} vp_sess_conn_t;
+
+/* Encode words as a request or reply line.  Returns the length, or 0 if
+ * it does not fit. */
+static size_t
+vp_sess_encode(char *line, size_t size, const char **words, int n)
+{
+    static const char xd[] = "0123456789abcdef";
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        const unsigned char *p = (const unsigned char *)words[i];
+
+        if (len + strlen(words[i]) * 2 + 2 > size)
+            return 0;
+        if (i > 0)
+            line[len++] = ' ';
+        for (; *p != '\0'; ++p) {
+            line[len++] = xd[*p >> 4];
+            line[len++] = xd[*p & 0xF];
+        }
+    }
+    line[len++] = '\n';
+    return len;
+}
+
+/* Decode a line without the newline in place.  Returns the number of
+ * words. */
+static int
+vp_sess_decode(char *line, char **words, int max)
+{
+    char *p = line, *q;
+    int n = 0;
+
+    while (*p != '\0' && n < max) {
+        words[n++] = q = p;
+        while (isxdigit((unsigned char)p[0])
+                && isxdigit((unsigned char)p[1])) {
+            char hex[3] = {p[0], p[1], '\0'};
+
+            *q++ = (char)strtol(hex, NULL, 16);
+            p += 2;
+        }
+        while (*p != '\0' && *p != ' ')
+            ++p;
+        if (*p == ' ')
+            ++p;
+        *q = '\0';
+    }
+    return n;
+}
+
+static int
+vp_sess_write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void
+vp_sess_reply(int fd, const char **words, int n)
+{
+    char line[VP_SESS_LINE_MAX];
+    size_t len = vp_sess_encode(line, sizeof(line), words, n);
+
+    if (len > 0)
+        (void)vp_sess_write_all(fd, line, len);
+}
+
+static void
+vp_sess_error(int fd, const char *msg)
+{
+    const char *words[2];
+
+    words[0] = "err";
+    words[1] = msg;
+    vp_sess_reply(fd, words, 2);
+}
+
+static void
+vp_sess_cloexec(int fd)
+{
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void
+vp_sess_detach(vp_sess_t *s)
+{
+    if (s->client >= 0) {
+        close(s->client);
+        s->client = -1;
+    }
+}
+
+static void
+vp_sess_free(vp_sess_t *s)
+{
+    vp_sess_detach(s);
+    if (s->fdm >= 0)
+        close(s->fdm);
+    if (s->status == -1 && s->pid > 0)
+        kill(-s->pid, SIGHUP);
+    free(s->ring);
+    memset(s, 0, sizeof(*s));
+}
+
+/* Read the output of s into its ring. */
+static void
+vp_sess_drain(vp_sess_t *s)
+{
+    char buf[65536];
+    ssize_t n = read(s->fdm, buf, sizeof(buf));
+    size_t i, pos, first;
+
+    if (n <= 0) {
+        if (n == -1 && (errno == EINTR || errno == EAGAIN))
+            return;
+        /* EIO: the session has exited */
+        close(s->fdm);
+        s->fdm = -1;
+        return;
+    }
+    i = (n > VP_SESS_RINGSIZE) ? n - VP_SESS_RINGSIZE : 0;
+    pos = (s->end + i) % VP_SESS_RINGSIZE;
+    first = (n - i < VP_SESS_RINGSIZE - pos) ? n - i : VP_SESS_RINGSIZE - pos;
+    memcpy(s->ring + pos, buf + i, first);
+    memcpy(s->ring, buf + i + first, n - i - first);
+    s->end += n;
+}
+
+/* Send what the client of s has not seen yet. */
+static void
+vp_sess_flush(vp_sess_t *s)
+{
+    vp_sess_off_t start = (s->end > VP_SESS_RINGSIZE)
+        ? s->end - VP_SESS_RINGSIZE : 0;
+    size_t pos, len;
+    ssize_t n;
+
+    if (s->sent < start)
+        s->sent = start;
+    while (s->sent < s->end) {
+        pos = s->sent % VP_SESS_RINGSIZE;
+        len = (s->end - s->sent < VP_SESS_RINGSIZE - pos)
+            ? s->end - s->sent : VP_SESS_RINGSIZE - pos;
+        if ((n = write(s->client, s->ring + pos, len)) < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+            vp_sess_detach(s);
+            return;
+        }
+        s->sent += n;
+        s->seen = s->sent;
+    }
+    if (s->fdm < 0)
+        vp_sess_detach(s);
+}
+
+static void
+vp_sess_open(vp_sess_t *sessions, int fd, char **words, int n)
+{
+    struct winsize ws = {0, 0, 0, 0};
+    char buf[64];
+    const char *reply[3];
+    vp_sess_t *s = NULL;
+    pid_t pid;
+    int fdm;
+    int i;
+
+    if (n < 7) {
+        vp_sess_error(fd, "open: too few arguments");
+        return;
+    }
+    for (i = 0; i < VP_SESS_MAX; ++i)
+        if (!sessions[i].used) {
+            s = &sessions[i];
+            break;
+        }
+    if (s == NULL) {
+        vp_sess_error(fd, "open: too many sessions");
+        return;
+    }
+    ws.ws_col = (unsigned short)atoi(words[1]);
+    ws.ws_row = (unsigned short)atoi(words[2]);
+    if ((s->ring = malloc(VP_SESS_RINGSIZE)) == NULL) {
+        vp_sess_error(fd, strerror(errno));
+        return;
+    }
+
+    pid = forkpty(&fdm, NULL, NULL, &ws);
+    if (pid < 0) {
+        free(s->ring);
+        s->ring = NULL;
+        vp_sess_error(fd, strerror(errno));
+        return;
+    } else if (pid == 0) {
+        sigset_t set;
+
+        /* child; words[] is NUL terminated in place */
+        words[n] = NULL;
+        /* The daemon's ignored signals would survive execv(). */
+        signal(SIGHUP, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+        if (words[4][0] != '\0' && chdir(words[4]) < 0)
+            _exit(EXIT_FAILURE);
+        execv(words[5], &words[6]);
+        _exit(127);
+    }
+    vp_sess_cloexec(fdm);
+    s->used = 1;
+    strncpy(s->name, words[3], sizeof(s->name) - 1);
+    s->pid = pid;
+    s->status = -1;
+    s->fdm = fdm;
+    s->end = s->sent = s->seen = 0;
+    s->client = -1;
+
+    sprintf(buf, "%d", (int)(s - sessions));
+    reply[0] = "ok";
+    reply[1] = buf;
+    sprintf(buf + 32, "%d", (int)pid);
+    reply[2] = buf + 32;
+    vp_sess_reply(fd, reply, 3);
+}
+
+static void
+vp_sess_list(vp_sess_t *sessions, int fd)
+{
+    char nums[VP_SESS_MAX][4][32];
+    const char *reply[1 + VP_SESS_MAX * 5];
+    int n = 0;
+    int i;
+
+    reply[n++] = "ok";
+    for (i = 0; i < VP_SESS_MAX; ++i) {
+        if (!sessions[i].used)
+            continue;
+        sprintf(nums[i][0], "%d", i);
+        sprintf(nums[i][1], "%d", (int)sessions[i].pid);
+        sprintf(nums[i][2], "%d", sessions[i].status);
+        sprintf(nums[i][3], "%llu", sessions[i].end);
+        reply[n++] = nums[i][0];
+        reply[n++] = sessions[i].name;
+        reply[n++] = nums[i][1];
+        reply[n++] = nums[i][2];
+        reply[n++] = nums[i][3];
+    }
+    vp_sess_reply(fd, reply, n);
+}
+
+/* Returns 1 if fd became the client of a session. */
+static int
+vp_sess_request(vp_sess_t *sessions, int fd, char *line)
+{
+    char *words[VP_SESS_WORD_MAX + 1];
+    const char *reply[3];
+    char start[32], end[32];
+    const char *err = NULL;
+    vp_sess_t *s = NULL;
+    int n = vp_sess_decode(line, words, VP_SESS_WORD_MAX);
+    int id;
+
+    if (n == 0) {
+        vp_sess_error(fd, "empty request");
+        return 0;
+    }
+    if (strcmp(words[0], "open") == 0) {
+        vp_sess_open(sessions, fd, words, n);
+        return 0;
+    }
+    if (strcmp(words[0], "list") == 0) {
+        vp_sess_list(sessions, fd);
+        return 0;
+    }
+
+    id = (n > 1) ? atoi(words[1]) : -1;
+    if (id >= 0 && id < VP_SESS_MAX && sessions[id].used)
+        s = &sessions[id];
+    if (s == NULL) {
+        vp_sess_error(fd, "no such session");
+        return 0;
+    }
+
+    reply[0] = "ok";
+    if (strcmp(words[0], "attach") == 0 && n == 3) {
+        long long since = atoll(words[2]);
+        vp_sess_off_t first = (s->end > VP_SESS_RINGSIZE)
+            ? s->end - VP_SESS_RINGSIZE : 0;
+
+        vp_sess_detach(s);
+        s->sent = (since < 0) ? s->seen
+            : ((vp_sess_off_t)since > s->end) ? s->end
+            : (vp_sess_off_t)since;
+        if (s->sent < first)
+            s->sent = first;
+        sprintf(start, "%llu", s->sent);
+        sprintf(end, "%llu", s->end);
+        reply[1] = start;
+        reply[2] = end;
+        vp_sess_reply(fd, reply, 3);
+        s->client = fd;
+        (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        return 1;
+    } else if (strcmp(words[0], "resize") == 0 && n == 4) {
+        struct winsize ws = {0, 0, 0, 0};
+
+        ws.ws_col = (unsigned short)atoi(words[2]);
+        ws.ws_row = (unsigned short)atoi(words[3]);
+        if (s->fdm >= 0 && ioctl(s->fdm, TIOCSWINSZ, &ws) < 0)
+            err = strerror(errno);
+    } else if (strcmp(words[0], "kill") == 0 && n == 3) {
+        if (s->status == -1 && kill(-s->pid, atoi(words[2])) < 0
+                && kill(s->pid, atoi(words[2])) < 0)
+            err = strerror(errno);
+    } else if (strcmp(words[0], "close") == 0 && n == 2) {
+        vp_sess_free(s);
+    } else {
+        err = "bad request";
+    }
+    if (err != NULL)
+        vp_sess_error(fd, err);
+    else
+        vp_sess_reply(fd, reply, 1);
+    return 0;
+}
+
+static void
+vp_sess_reap(vp_sess_t *sessions)
+{
+    pid_t pid;
+    int status;
+    int i;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        for (i = 0; i < VP_SESS_MAX; ++i)
+            if (sessions[i].used && sessions[i].pid == pid)
+                sessions[i].status = WIFEXITED(status)
+                    ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* The daemon main loop.  Never returns. */
+static void
+vp_sess_daemon(int lfd)
+{
+    static vp_sess_t sessions[VP_SESS_MAX];
+    static vp_sess_conn_t conns[VP_SESS_CONN_MAX];
+    struct pollfd pfds[1 + VP_SESS_MAX * 2 + VP_SESS_CONN_MAX];
+    time_t idle = time(NULL);
+    int nsess;
+    int i, n;
+
+    for (i = 0; i < VP_SESS_CONN_MAX; ++i)
+        conns[i].fd = -1;
+
+    for (;;) {
+        vp_sess_reap(sessions);
+
+        n = 0;
+        nsess = 0;
+        pfds[n].fd = lfd;
+        pfds[n++].events = POLLIN;
+        for (i = 0; i < VP_SESS_MAX; ++i) {
+            vp_sess_t *s = &sessions[i];
+
+            if (!s->used)
+                continue;
+            ++nsess;
+            pfds[n].fd = s->fdm;
+            pfds[n++].events = POLLIN;
+            pfds[n].fd = s->client;
+            pfds[n++].events = POLLIN | ((s->sent < s->end) ? POLLOUT : 0);
+        }
+        for (i = 0; i < VP_SESS_CONN_MAX; ++i) {
+            pfds[n].fd = conns[i].fd;
+            pfds[n++].events = POLLIN;
+        }
+
+        if (nsess > 0)
+            idle = time(NULL);
+        else if (time(NULL) - idle > VP_SESS_IDLE)
+            _exit(EXIT_SUCCESS);
+
+        if (poll(pfds, n, 1000) <= 0)
+            continue;
+
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept(lfd, NULL, NULL);
+
+            for (i = 0; fd >= 0 && i < VP_SESS_CONN_MAX; ++i)
+                if (conns[i].fd < 0
+                        && (conns[i].buf = malloc(VP_SESS_LINE_MAX)) != NULL) {
+                    vp_sess_cloexec(fd);
+                    conns[i].fd = fd;
+                    conns[i].len = 0;
+                    fd = -1;
+                }
+            if (fd >= 0)
+                close(fd);
+        }
+
+        n = 1;
+        for (i = 0; i < VP_SESS_MAX; ++i) {
+            vp_sess_t *s = &sessions[i];
+
+            if (!s->used)
+                continue;
+            if (s->fdm >= 0 && pfds[n].revents != 0)
+                vp_sess_drain(s);
+            ++n;
+            if (s->client >= 0 && (pfds[n].revents & (POLLIN | POLLHUP))) {
+                char buf[4096];
+                ssize_t r = read(s->client, buf, sizeof(buf));
+
+                if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+                    vp_sess_detach(s);
+                else if (r > 0 && s->fdm >= 0)
+                    (void)vp_sess_write_all(s->fdm, buf, r);
+            }
+            ++n;
+            if (s->client >= 0)
+                vp_sess_flush(s);
+        }
+
+        for (i = 0; i < VP_SESS_CONN_MAX; ++i, ++n) {
+            vp_sess_conn_t *c = &conns[i];
+            char *nl;
+            ssize_t r;
+
+            if (c->fd < 0 || pfds[n].revents == 0)
+                continue;
+            r = read(c->fd, c->buf + c->len, VP_SESS_LINE_MAX - 1 - c->len);
+            if (r > 0)
+                c->len += r;
+            c->buf[c->len] = '\0';
+            if ((nl = strchr(c->buf, '\n')) != NULL) {
+                *nl = '\0';
+                if (vp_sess_request(sessions, c->fd, c->buf))
+                    c->fd = -1;
+            } else if (r > 0 && c->len < VP_SESS_LINE_MAX - 1) {
+                continue;
+            }
+            if (c->fd >= 0)
+                close(c->fd);
+            c->fd = -1;
+            free(c->buf);
+            c->buf = NULL;
+        }
+    }
+}
+
+static const char *
+vp_sess_listen(const struct sockaddr_un *addr, int *lfd)
+{
+    mode_t mask;
+    int fd;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return "socket() error: %s";
+    unlink(addr->sun_path);
+    mask = umask(077);
+    if (bind(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        umask(mask);
+        close(fd);
+        return "bind() error: %s";
+    }
+    umask(mask);
+    if (listen(fd, 16) < 0) {
+        close(fd);
+        return "listen() error: %s";
+    }
+    *lfd = fd;
+    return NULL;
+}
+
+/* vimsessiond next to the library, or "" */
+static char vp_sess_exe[4096];
+
+static void
+vp_sess_find_exe(void)
+{
+    Dl_info info;
+    const char *slash;
+
+    vp_sess_exe[0] = '\0';
+    if (dladdr(vp_sess_exe, &info) != 0 && info.dli_fname != NULL
+            && (slash = strrchr(info.dli_fname, '/')) != NULL)
+        snprintf(vp_sess_exe, sizeof(vp_sess_exe), "%.*s/vimsessiond",
+                (int)(slash - info.dli_fname), info.dli_fname);
+}
+
+/* Is a daemon listening on path? */
+static int
+vp_sess_alive(const struct sockaddr_un *addr)
+{
+    int fd, ret;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return 0;
+    ret = connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0;
+    close(fd);
+    return ret;
+}
+
+/*
+ * Start the daemon on path unless another client has just done it.
+ * Returns an error format or NULL.
+ */
+static const char *
+vp_sess_spawn(const struct sockaddr_un *addr)
+{
+    char lock[sizeof(addr->sun_path) + 8];
+    struct flock fl;
+    const char *errfmt;
+    int lfd, lockfd;
+    pid_t pid;
+    int fd;
+
+    /* Only one client may unlink() and bind() the socket. */
+    snprintf(lock, sizeof(lock), "%s.lock", addr->sun_path);
+    if ((lockfd = open(lock, O_RDWR | O_CREAT, 0600)) < 0)
+        return "open() error: %s";
+    vp_sess_cloexec(lockfd);
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(lockfd, F_SETLKW, &fl) < 0) {
+        if (errno != EINTR) {
+            close(lockfd);
+            return "fcntl() error: %s";
+        }
+    }
+    if (vp_sess_alive(addr)) {
+        close(lockfd);
+        return NULL;
+    }
+    if ((errfmt = vp_sess_listen(addr, &lfd)) != NULL) {
+        close(lockfd);
+        return errfmt;
+    }
+    vp_sess_find_exe();
+
+    pid = fork();
+    if (pid < 0) {
+        close(lfd);
+        close(lockfd);
+        return "fork() error: %s";
+    } else if (pid == 0) {
+        char arg[16];
+        sigset_t set;
+
+        if (fork() != 0)
+            _exit(EXIT_SUCCESS);
+        setsid();
+        if (chdir("/") < 0)
+            _exit(EXIT_FAILURE);
+        if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+            dup2(fd, STDIN_FILENO);
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        for (fd = STDERR_FILENO + 1; fd < sysconf(_SC_OPEN_MAX)
+                && fd < 65536; ++fd)
+            if (fd != lfd)
+                close(fd);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGINT, SIG_IGN);
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL);
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+        /* A fork of Vim would keep all of its memory. */
+        if (vp_sess_exe[0] != '\0') {
+            sprintf(arg, "%d", lfd);
+            execl(vp_sess_exe, "vimsessiond", arg, (char *)NULL);
+        }
+        vp_sess_cloexec(lfd);
+        vp_sess_daemon(lfd);
+    }
+    close(lfd);
+    waitpid(pid, NULL, 0);
+    close(lockfd);
+    return NULL;
+}
+
+/* Connect to the daemon on path, starting it if "start". */
+static const char *
+vp_sess_connect(const char *path, int start, int *pfd)
+{
+    struct sockaddr_un addr;
+    const char *errfmt;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return "socket path: %s";
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return "socket() error: %s";
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (!start || (errno != ENOENT && errno != ECONNREFUSED)) {
+            close(fd);
+            return "connect() error: %s";
+        }
+        if ((errfmt = vp_sess_spawn(&addr)) != NULL) {
+            close(fd);
+            return errfmt;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return "connect() error: %s";
+        }
+    }
+#if defined __linux__ && defined SO_PEERCRED
+    {
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0
+                || cred.uid != getuid()) {
+            close(fd);
+            errno = EPERM;
+            return "session daemon: %s";
+        }
+    }
+#endif
+    *pfd = fd;
+    return NULL;
+}
+
+/*
+ * Send a request and read the reply line into reply, decoded into words.
+ * The connection is returned in *sock if sock is not NULL, else closed.
+ * Returns an error format or NULL; a daemon error is in words[1] with
+ * *nwords set to -1.
+ */
+static const char *
+vp_sess_call(const char *path, int start, const char **req, int nreq,
+        char *reply, size_t size, char **words, int *nwords, int *sock)
+{
+    struct pollfd pfd = {0, POLLIN, 0};
+    const char *errfmt;
+    size_t len;
+    int fd;
+
+    len = vp_sess_encode(reply, size, req, nreq);
+    if (len == 0) {
+        errno = E2BIG;
+        return "session request: %s";
+    }
+    if ((errfmt = vp_sess_connect(path, start, &fd)) != NULL)
+        return errfmt;
+    if (vp_sess_write_all(fd, reply, len) < 0) {
+        close(fd);
+        return "write() error: %s";
+    }
+
+    /* One byte at a time: the stream of "attach" follows the reply. */
+    pfd.fd = fd;
+    for (len = 0; len < size - 1; ++len) {
+        if (poll(&pfd, 1, VP_SESS_TIMEOUT) <= 0
+                || read(fd, reply + len, 1) != 1) {
+            close(fd);
+            errno = ECONNRESET;
+            return "session daemon: %s";
+        }
+        if (reply[len] == '\n')
+            break;
+    }
+    reply[len] = '\0';
+    *nwords = vp_sess_decode(reply, words, VP_SESS_WORD_MAX);
+    if (*nwords == 0 || strcmp(words[0], "ok") != 0) {
+        close(fd);
+        if (*nwords < 2) {
+            strcpy(reply, "bad reply");
+            words[1] = reply;
+        }
+        *nwords = -1;
+        return NULL;
+    }
+    if (sock != NULL)
+        *sock = fd;
+    else
+        close(fd);
+    return NULL;
+}
+
+#if defined VP_SESS_MAIN
+/* vimsessiond <fd>: the daemon on the listening socket fd. */
+int
+main(int argc, char **argv)
+{
+    int lfd;
+
+    if (argc != 2 || (lfd = atoi(argv[1])) <= STDERR_FILENO) {
+        fprintf(stderr, "usage: vimsessiond <fd>\n");
+        return EXIT_FAILURE;
+    }
+    vp_sess_cloexec(lfd);
+    vp_sess_daemon(lfd);
+    return EXIT_SUCCESS;
+}
+#endif
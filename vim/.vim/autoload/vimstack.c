@@ -19,6 +19,9 @@
 #define VP_EOV '\xFF'
 #define VP_EOV_STR "\xFF"
 
+/* Binary value is hex string, or raw bytes after VP_RAW. */
+#define VP_RAW '\xFE'
+
 #define VP_NUM_BUFSIZE 64
 #define VP_NUMFMT_BUFSIZE 16
 #define VP_INITIAL_BUFSIZE 512
@@ -223,6 +226,12 @@ vp_stack_pop_bin(vp_stack_t *stack, char **buf, size_t *size)
     size_t gain = 0;
 
     VP_RETURN_IF_FAIL(vp_stack_pop_str(stack, buf));
+    if (**buf == VP_RAW) {
+        /* Vim sends it when the value has neither NUL nor EOV. */
+        ++*buf;
+        *size = strlen(*buf);
+        return NULL;
+    }
     p = *buf;
     while (*p) {
         ub = CHR2XD[(unsigned char)*(p++)];
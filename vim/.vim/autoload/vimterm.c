@@ -0,0 +1,1119 @@
+/* vim:set sw=4 sts=4 et: */
+/**
+ * FILE:   vimterm.c
+ *
+ * Screen model for vp_term_*().
+ * A VT100/xterm parser writes pty output into a cell grid.  Every row
+ * has a dirty flag, so a poll returns only the rows which changed since
+ * the last one, however much output was parsed in between.  Lines which
+ * scroll off the top of the main screen go to a scrollback ring.
+ *
+ * Not emulated: combining characters (dropped), double width/height
+ * lines, tab stops other than every 8 columns, and mouse/keyboard modes
+ * (they only change what Vim sends, not the screen).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+/* vp_cell_t.attr */
+#define VP_TERM_BOLD        0x01
+#define VP_TERM_DIM         0x02
+#define VP_TERM_ITALIC      0x04
+#define VP_TERM_UNDERLINE   0x08
+#define VP_TERM_BLINK       0x10
+#define VP_TERM_REVERSE     0x20
+#define VP_TERM_INVISIBLE   0x40
+#define VP_TERM_STRIKE      0x80
+
+/* vp_cell_t.fg/bg: -1 is the default color, 0-255 an indexed color. */
+#define VP_TERM_RGB         0x1000000
+
+/* vp_cell_t.ch of the right half of a double width character. */
+#define VP_TERM_WIDE        0xFFFFFFFF
+
+#define VP_TERM_NPARAM      16
+
+/* Size of the buffers for vp_term_encode(). */
+#define VP_TERM_TEXT_SIZE(n)    ((size_t)(n) * 4 + 1)
+#define VP_TERM_RUNS_SIZE(n)    ((size_t)(n) * 64 + 1)
+
+typedef struct vp_cell_t {
+    unsigned int ch;    /* 0 is blank */
+    int fg;
+    int bg;
+    int attr;
+} vp_cell_t;
+
+typedef struct vp_sbline_t {
+    vp_cell_t *cells;
+    int len;
+} vp_sbline_t;
+
+typedef struct vp_cursor_t {
+    int x, y;
+    int wrapnext;
+    vp_cell_t pen;
+    int origin;
+    int charset[2];
+    int gl;
+} vp_cursor_t;
+
+enum {
+    VP_TERM_GROUND, VP_TERM_ESC, VP_TERM_ESC_INT, VP_TERM_CSI,
+    VP_TERM_OSC, VP_TERM_STRING
+};
+
+typedef struct vp_term_t {
+    int cols, rows;
+    vp_cell_t *main;
+    vp_cell_t *alt;
+    vp_cell_t *screen;      /* main or alt */
+    unsigned char *dirty;   /* per row */
+
+    vp_cursor_t cur;
+    vp_cursor_t saved;
+    vp_cursor_t saved_alt;
+    int top, bottom;        /* scroll region */
+    int autowrap;
+    int insert;
+    int cursor_visible;
+    unsigned int last;      /* for REP */
+
+    vp_sbline_t *sb;        /* scrollback ring */
+    int sb_cap;
+    int sb_head;            /* next slot */
+    int sb_count;
+    int sb_new;             /* pushed since the last damage poll */
+
+    char title[256];
+
+    /* answers to DSR/DA, written back to the pty by the caller */
+    char reply[256];
+    size_t nreply;
+
+    /* parser */
+    int state;
+    int params[VP_TERM_NPARAM];
+    int nparams;
+    int private;
+    int intermediate;
+    char osc[512];
+    size_t nosc;
+    unsigned int u8cp;
+    int u8need;
+} vp_term_t;
+
+static const vp_cell_t vp_term_blank = {0, -1, -1, 0};
+
+/* DEC special graphics for 0x60-0x7E. */
+static const unsigned int vp_term_acs[31] = {
+    0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0x00B0, 0x00B1,
+    0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x23BA,
+    0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534, 0x252C,
+    0x2502, 0x2264, 0x2265, 0x03C0, 0x2260, 0x00A3, 0x00B7
+};
+
+#define VP_TERM_CELL(t, y, x) (&(t)->screen[(size_t)(y) * (t)->cols + (x)])
+
+static void
+vp_term_dirty(vp_term_t *t, int y0, int y1)
+{
+    if (y0 < 0)
+        y0 = 0;
+    if (y1 >= t->rows)
+        y1 = t->rows - 1;
+    if (y0 <= y1)
+        memset(t->dirty + y0, 1, y1 - y0 + 1);
+}
+
+static void
+vp_term_fill(vp_cell_t *cells, size_t n, const vp_cell_t *c)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+        cells[i] = *c;
+}
+
+/* Erased cells keep the background of the pen (bce). */
+static void
+vp_term_erase(vp_term_t *t, int y, int x0, int x1)
+{
+    vp_cell_t c = vp_term_blank;
+
+    if (x0 < 0)
+        x0 = 0;
+    if (x1 > t->cols)
+        x1 = t->cols;
+    if (y < 0 || y >= t->rows || x0 >= x1)
+        return;
+    c.bg = t->cur.pen.bg;
+    vp_term_fill(VP_TERM_CELL(t, y, x0), x1 - x0, &c);
+    t->dirty[y] = 1;
+}
+
+static void
+vp_term_sb_push(vp_term_t *t, const vp_cell_t *cells)
+{
+    vp_sbline_t *l;
+    int len = t->cols;
+
+    if (t->sb_cap == 0)
+        return;
+    while (len > 0 && memcmp(&cells[len - 1], &vp_term_blank,
+                sizeof(vp_cell_t)) == 0)
+        --len;
+    l = &t->sb[t->sb_head];
+    free(l->cells);
+    l->cells = NULL;
+    l->len = 0;
+    if (len > 0 && (l->cells = malloc(len * sizeof(vp_cell_t))) != NULL) {
+        memcpy(l->cells, cells, len * sizeof(vp_cell_t));
+        l->len = len;
+    }
+    t->sb_head = (t->sb_head + 1) % t->sb_cap;
+    if (t->sb_count < t->sb_cap)
+        ++t->sb_count;
+    if (t->sb_new < t->sb_cap)
+        ++t->sb_new;
+}
+
+/* Lines scrolled off the top of the main screen are saved if "save". */
+static void
+vp_term_scroll_up(vp_term_t *t, int top, int bottom, int n, int save)
+{
+    int y;
+
+    if (n > bottom - top + 1)
+        n = bottom - top + 1;
+    if (n <= 0)
+        return;
+    if (save && top == 0 && t->screen == t->main)
+        for (y = 0; y < n; ++y)
+            vp_term_sb_push(t, VP_TERM_CELL(t, y, 0));
+    memmove(VP_TERM_CELL(t, top, 0), VP_TERM_CELL(t, top + n, 0),
+            (size_t)(bottom - top + 1 - n) * t->cols * sizeof(vp_cell_t));
+    for (y = bottom - n + 1; y <= bottom; ++y)
+        vp_term_erase(t, y, 0, t->cols);
+    vp_term_dirty(t, top, bottom);
+}
+
+static void
+vp_term_scroll_down(vp_term_t *t, int top, int bottom, int n)
+{
+    int y;
+
+    if (n > bottom - top + 1)
+        n = bottom - top + 1;
+    if (n <= 0)
+        return;
+    memmove(VP_TERM_CELL(t, top + n, 0), VP_TERM_CELL(t, top, 0),
+            (size_t)(bottom - top + 1 - n) * t->cols * sizeof(vp_cell_t));
+    for (y = top; y < top + n; ++y)
+        vp_term_erase(t, y, 0, t->cols);
+    vp_term_dirty(t, top, bottom);
+}
+
+static void
+vp_term_linefeed(vp_term_t *t)
+{
+    if (t->cur.y == t->bottom)
+        vp_term_scroll_up(t, t->top, t->bottom, 1, 1);
+    else if (t->cur.y < t->rows - 1)
+        ++t->cur.y;
+}
+
+static void
+vp_term_reverse_index(vp_term_t *t)
+{
+    if (t->cur.y == t->top)
+        vp_term_scroll_down(t, t->top, t->bottom, 1);
+    else if (t->cur.y > 0)
+        --t->cur.y;
+}
+
+static void
+vp_term_goto(vp_term_t *t, int x, int y)
+{
+    int top = 0, bottom = t->rows - 1;
+
+    if (t->cur.origin) {
+        top = t->top;
+        bottom = t->bottom;
+        y += top;
+    }
+    t->cur.x = (x < 0) ? 0 : (x >= t->cols) ? t->cols - 1 : x;
+    t->cur.y = (y < top) ? top : (y > bottom) ? bottom : y;
+    t->cur.wrapnext = 0;
+}
+
+/* Clear the other half of a double width character at (x, y). */
+static void
+vp_term_unwide(vp_term_t *t, int x, int y)
+{
+    vp_cell_t *c = VP_TERM_CELL(t, y, x);
+
+    if (c->ch == VP_TERM_WIDE && x > 0)
+        c[-1].ch = 0;
+    else if (x + 1 < t->cols && c[1].ch == VP_TERM_WIDE)
+        c[1].ch = 0;
+}
+
+static void
+vp_term_put(vp_term_t *t, unsigned int ch)
+{
+    vp_cell_t *c;
+    int width;
+
+    if (ch >= 0x60 && ch <= 0x7E && t->cur.charset[t->cur.gl])
+        ch = vp_term_acs[ch - 0x60];
+    width = wcwidth((wchar_t)ch);
+    if (width == 0)
+        return;
+    if (width < 0)
+        width = 1;
+
+    if (t->cur.wrapnext && t->autowrap) {
+        t->cur.x = 0;
+        vp_term_linefeed(t);
+    }
+    t->cur.wrapnext = 0;
+    if (width == 2 && t->cur.x == t->cols - 1) {
+        if (!t->autowrap || t->cols < 2)
+            return;
+        vp_term_erase(t, t->cur.y, t->cur.x, t->cols);
+        t->cur.x = 0;
+        vp_term_linefeed(t);
+    }
+
+    c = VP_TERM_CELL(t, t->cur.y, t->cur.x);
+    if (t->insert && t->cur.x + width < t->cols)
+        memmove(c + width, c,
+                (t->cols - t->cur.x - width) * sizeof(vp_cell_t));
+    vp_term_unwide(t, t->cur.x, t->cur.y);
+    if (width == 2)
+        vp_term_unwide(t, t->cur.x + 1, t->cur.y);
+    *c = t->cur.pen;
+    c->ch = ch;
+    if (width == 2) {
+        c[1] = t->cur.pen;
+        c[1].ch = VP_TERM_WIDE;
+    }
+    t->dirty[t->cur.y] = 1;
+    t->last = ch;
+
+    t->cur.x += width;
+    if (t->cur.x >= t->cols) {
+        t->cur.x = t->cols - 1;
+        t->cur.wrapnext = 1;
+    }
+}
+
+static void
+vp_term_reply(vp_term_t *t, const char *s)
+{
+    size_t len = strlen(s);
+
+    if (t->nreply + len <= sizeof(t->reply)) {
+        memcpy(t->reply + t->nreply, s, len);
+        t->nreply += len;
+    }
+}
+
+static void
+vp_term_save_cursor(vp_term_t *t)
+{
+    if (t->screen == t->alt)
+        t->saved_alt = t->cur;
+    else
+        t->saved = t->cur;
+}
+
+static void
+vp_term_restore_cursor(vp_term_t *t)
+{
+    t->cur = (t->screen == t->alt) ? t->saved_alt : t->saved;
+    if (t->cur.x >= t->cols)
+        t->cur.x = t->cols - 1;
+    if (t->cur.y >= t->rows)
+        t->cur.y = t->rows - 1;
+}
+
+static void
+vp_term_reset(vp_term_t *t)
+{
+    t->screen = t->main;
+    vp_term_fill(t->main, (size_t)t->rows * t->cols, &vp_term_blank);
+    vp_term_fill(t->alt, (size_t)t->rows * t->cols, &vp_term_blank);
+    memset(&t->cur, 0, sizeof(t->cur));
+    t->cur.pen = vp_term_blank;
+    t->saved = t->saved_alt = t->cur;
+    t->top = 0;
+    t->bottom = t->rows - 1;
+    t->autowrap = 1;
+    t->insert = 0;
+    t->cursor_visible = 1;
+    t->state = VP_TERM_GROUND;
+    t->u8need = 0;
+    vp_term_dirty(t, 0, t->rows - 1);
+}
+
+static void
+vp_term_altscreen(vp_term_t *t, int on, int save)
+{
+    if (on == (t->screen == t->alt))
+        return;
+    if (on) {
+        if (save)
+            vp_term_save_cursor(t);
+        t->screen = t->alt;
+        vp_term_fill(t->alt, (size_t)t->rows * t->cols, &vp_term_blank);
+    } else {
+        t->screen = t->main;
+        if (save)
+            vp_term_restore_cursor(t);
+    }
+    vp_term_dirty(t, 0, t->rows - 1);
+}
+
+static int
+vp_term_param(vp_term_t *t, int i, int def)
+{
+    return (i < t->nparams && t->params[i] > 0) ? t->params[i] : def;
+}
+
+static void
+vp_term_sgr(vp_term_t *t)
+{
+    vp_cell_t *pen = &t->cur.pen;
+    int i;
+
+    if (t->nparams == 0)
+        t->nparams = 1;
+    for (i = 0; i < t->nparams; ++i) {
+        int p = t->params[i];
+
+        switch (p) {
+        case 0: *pen = vp_term_blank; break;
+        case 1: pen->attr |= VP_TERM_BOLD; break;
+        case 2: pen->attr |= VP_TERM_DIM; break;
+        case 3: pen->attr |= VP_TERM_ITALIC; break;
+        case 4: pen->attr |= VP_TERM_UNDERLINE; break;
+        case 5: case 6: pen->attr |= VP_TERM_BLINK; break;
+        case 7: pen->attr |= VP_TERM_REVERSE; break;
+        case 8: pen->attr |= VP_TERM_INVISIBLE; break;
+        case 9: pen->attr |= VP_TERM_STRIKE; break;
+        case 21: case 22: pen->attr &= ~(VP_TERM_BOLD | VP_TERM_DIM); break;
+        case 23: pen->attr &= ~VP_TERM_ITALIC; break;
+        case 24: pen->attr &= ~VP_TERM_UNDERLINE; break;
+        case 25: pen->attr &= ~VP_TERM_BLINK; break;
+        case 27: pen->attr &= ~VP_TERM_REVERSE; break;
+        case 28: pen->attr &= ~VP_TERM_INVISIBLE; break;
+        case 29: pen->attr &= ~VP_TERM_STRIKE; break;
+        case 39: pen->fg = -1; break;
+        case 49: pen->bg = -1; break;
+        case 38: case 48: {
+            int color = -2;
+
+            if (i + 2 < t->nparams && t->params[i + 1] == 5) {
+                color = t->params[i + 2] & 0xFF;
+                i += 2;
+            } else if (i + 4 < t->nparams && t->params[i + 1] == 2) {
+                color = VP_TERM_RGB | (t->params[i + 2] & 0xFF) << 16
+                    | (t->params[i + 3] & 0xFF) << 8
+                    | (t->params[i + 4] & 0xFF);
+                i += 4;
+            } else {
+                i = t->nparams;
+            }
+            if (color != -2) {
+                if (p == 38)
+                    pen->fg = color;
+                else
+                    pen->bg = color;
+            }
+            break;
+        }
+        default:
+            if (p >= 30 && p <= 37)
+                pen->fg = p - 30;
+            else if (p >= 40 && p <= 47)
+                pen->bg = p - 40;
+            else if (p >= 90 && p <= 97)
+                pen->fg = p - 90 + 8;
+            else if (p >= 100 && p <= 107)
+                pen->bg = p - 100 + 8;
+            break;
+        }
+    }
+}
+
+static void
+vp_term_mode(vp_term_t *t, int set)
+{
+    int i;
+
+    for (i = 0; i < t->nparams; ++i) {
+        if (t->private != '?') {
+            if (t->params[i] == 4)
+                t->insert = set;
+            continue;
+        }
+        switch (t->params[i]) {
+        case 6:
+            t->cur.origin = set;
+            vp_term_goto(t, 0, 0);
+            break;
+        case 7:
+            t->autowrap = set;
+            break;
+        case 25:
+            t->cursor_visible = set;
+            break;
+        case 47: case 1047:
+            vp_term_altscreen(t, set, 0);
+            break;
+        case 1048:
+            if (set)
+                vp_term_save_cursor(t);
+            else
+                vp_term_restore_cursor(t);
+            break;
+        case 1049:
+            vp_term_altscreen(t, set, 1);
+            break;
+        }
+    }
+}
+
+static void
+vp_term_csi(vp_term_t *t, int final)
+{
+    char buf[64];
+    vp_cell_t *c;
+    int n = vp_term_param(t, 0, 1);
+    int y = t->cur.y;
+    int i;
+
+    if (t->intermediate != 0)
+        return;
+    if (t->private == '?' && final != 'h' && final != 'l')
+        return;
+
+    switch (final) {
+    case '@':   /* ICH */
+        if (n > t->cols - t->cur.x)
+            n = t->cols - t->cur.x;
+        c = VP_TERM_CELL(t, y, t->cur.x);
+        memmove(c + n, c, (t->cols - t->cur.x - n) * sizeof(vp_cell_t));
+        vp_term_erase(t, y, t->cur.x, t->cur.x + n);
+        break;
+    case 'A':   /* CUU */
+        t->cur.y = (t->cur.y - n < t->top && t->cur.y >= t->top)
+            ? t->top : (t->cur.y - n < 0) ? 0 : t->cur.y - n;
+        t->cur.wrapnext = 0;
+        break;
+    case 'B':   /* CUD */
+    case 'e':   /* VPR */
+        t->cur.y = (t->cur.y + n > t->bottom && t->cur.y <= t->bottom)
+            ? t->bottom : (t->cur.y + n >= t->rows) ? t->rows - 1
+            : t->cur.y + n;
+        t->cur.wrapnext = 0;
+        break;
+    case 'C':   /* CUF */
+    case 'a':   /* HPR */
+        t->cur.x = (t->cur.x + n >= t->cols) ? t->cols - 1 : t->cur.x + n;
+        t->cur.wrapnext = 0;
+        break;
+    case 'D':   /* CUB */
+        t->cur.x = (t->cur.x - n < 0) ? 0 : t->cur.x - n;
+        t->cur.wrapnext = 0;
+        break;
+    case 'E':   /* CNL */
+        t->cur.x = 0;
+        t->cur.y = (t->cur.y + n >= t->rows) ? t->rows - 1 : t->cur.y + n;
+        t->cur.wrapnext = 0;
+        break;
+    case 'F':   /* CPL */
+        t->cur.x = 0;
+        t->cur.y = (t->cur.y - n < 0) ? 0 : t->cur.y - n;
+        t->cur.wrapnext = 0;
+        break;
+    case 'G':   /* CHA */
+    case '`':   /* HPA */
+        t->cur.x = (n > t->cols) ? t->cols - 1 : n - 1;
+        t->cur.wrapnext = 0;
+        break;
+    case 'H':   /* CUP */
+    case 'f':   /* HVP */
+        vp_term_goto(t, vp_term_param(t, 1, 1) - 1, n - 1);
+        break;
+    case 'I':   /* CHT */
+        while (n-- > 0 && t->cur.x < t->cols - 1)
+            t->cur.x = (t->cur.x / 8 + 1) * 8;
+        if (t->cur.x >= t->cols)
+            t->cur.x = t->cols - 1;
+        t->cur.wrapnext = 0;
+        break;
+    case 'J':   /* ED */
+        switch (vp_term_param(t, 0, 0)) {
+        case 0:
+            vp_term_erase(t, y, t->cur.x, t->cols);
+            for (i = y + 1; i < t->rows; ++i)
+                vp_term_erase(t, i, 0, t->cols);
+            break;
+        case 1:
+            for (i = 0; i < y; ++i)
+                vp_term_erase(t, i, 0, t->cols);
+            vp_term_erase(t, y, 0, t->cur.x + 1);
+            break;
+        case 2: case 3:
+            for (i = 0; i < t->rows; ++i)
+                vp_term_erase(t, i, 0, t->cols);
+            break;
+        }
+        break;
+    case 'K':   /* EL */
+        switch (vp_term_param(t, 0, 0)) {
+        case 0: vp_term_erase(t, y, t->cur.x, t->cols); break;
+        case 1: vp_term_erase(t, y, 0, t->cur.x + 1); break;
+        case 2: vp_term_erase(t, y, 0, t->cols); break;
+        }
+        break;
+    case 'L':   /* IL */
+        if (y >= t->top && y <= t->bottom)
+            vp_term_scroll_down(t, y, t->bottom, n);
+        t->cur.x = 0;
+        break;
+    case 'M':   /* DL */
+        if (y >= t->top && y <= t->bottom)
+            vp_term_scroll_up(t, y, t->bottom, n, 0);
+        t->cur.x = 0;
+        break;
+    case 'P':   /* DCH */
+        if (n > t->cols - t->cur.x)
+            n = t->cols - t->cur.x;
+        c = VP_TERM_CELL(t, y, t->cur.x);
+        memmove(c, c + n, (t->cols - t->cur.x - n) * sizeof(vp_cell_t));
+        vp_term_erase(t, y, t->cols - n, t->cols);
+        break;
+    case 'S':   /* SU */
+        vp_term_scroll_up(t, t->top, t->bottom, n, 1);
+        break;
+    case 'T':   /* SD */
+        vp_term_scroll_down(t, t->top, t->bottom, n);
+        break;
+    case 'X':   /* ECH */
+        vp_term_erase(t, y, t->cur.x, t->cur.x + n);
+        break;
+    case 'Z':   /* CBT */
+        while (n-- > 0 && t->cur.x > 0)
+            t->cur.x = (t->cur.x - 1) / 8 * 8;
+        t->cur.wrapnext = 0;
+        break;
+    case 'b':   /* REP */
+        if (t->last != 0)
+            while (n-- > 0)
+                vp_term_put(t, t->last);
+        break;
+    case 'c':   /* DA */
+        if (t->private == '>')
+            vp_term_reply(t, "\033[>0;0;0c");
+        else if (t->private == 0)
+            vp_term_reply(t, "\033[?1;2c");
+        break;
+    case 'd':   /* VPA */
+        vp_term_goto(t, t->cur.x, n - 1);
+        break;
+    case 'h':   /* SM */
+        vp_term_mode(t, 1);
+        break;
+    case 'l':   /* RM */
+        vp_term_mode(t, 0);
+        break;
+    case 'm':   /* SGR */
+        if (t->private == 0)
+            vp_term_sgr(t);
+        break;
+    case 'n':   /* DSR */
+        if (t->private != 0)
+            break;
+        if (vp_term_param(t, 0, 0) == 5) {
+            vp_term_reply(t, "\033[0n");
+        } else if (vp_term_param(t, 0, 0) == 6) {
+            sprintf(buf, "\033[%d;%dR",
+                    t->cur.y + 1 - (t->cur.origin ? t->top : 0),
+                    t->cur.x + 1);
+            vp_term_reply(t, buf);
+        }
+        break;
+    case 'r':   /* DECSTBM */
+        if (t->private == 0) {
+            int top = vp_term_param(t, 0, 1) - 1;
+            int bottom = vp_term_param(t, 1, t->rows) - 1;
+
+            if (bottom >= t->rows)
+                bottom = t->rows - 1;
+            if (top < bottom) {
+                t->top = top;
+                t->bottom = bottom;
+                vp_term_goto(t, 0, 0);
+            }
+        }
+        break;
+    case 's':   /* SCOSC */
+        vp_term_save_cursor(t);
+        break;
+    case 'u':   /* SCORC */
+        vp_term_restore_cursor(t);
+        break;
+    }
+}
+
+static void
+vp_term_esc(vp_term_t *t, int final)
+{
+    if (t->intermediate == '(' || t->intermediate == ')') {
+        t->cur.charset[t->intermediate == ')'] = (final == '0');
+        return;
+    }
+    if (t->intermediate == '#' && final == '8') {
+        /* DECALN */
+        vp_cell_t c = vp_term_blank;
+        int y;
+
+        c.ch = 'E';
+        for (y = 0; y < t->rows; ++y)
+            vp_term_fill(VP_TERM_CELL(t, y, 0), t->cols, &c);
+        vp_term_dirty(t, 0, t->rows - 1);
+        return;
+    }
+    if (t->intermediate != 0)
+        return;
+
+    switch (final) {
+    case '7': vp_term_save_cursor(t); break;
+    case '8': vp_term_restore_cursor(t); break;
+    case 'D': vp_term_linefeed(t); break;
+    case 'E': t->cur.x = 0; vp_term_linefeed(t); break;
+    case 'M': vp_term_reverse_index(t); break;
+    case 'c': vp_term_reset(t); break;
+    }
+    t->cur.wrapnext = 0;
+}
+
+static void
+vp_term_osc(vp_term_t *t)
+{
+    const unsigned char *p;
+    size_t n = 0;
+
+    t->osc[t->nosc] = '\0';
+    if ((t->osc[0] == '0' || t->osc[0] == '2') && t->osc[1] == ';') {
+        /* 0xFE and 0xFF are never UTF-8, and would break the value list
+         * of vp_term_damage(). */
+        for (p = (const unsigned char *)t->osc + 2;
+                *p != '\0' && n < sizeof(t->title) - 1; ++p)
+            if (*p < 0xFE)
+                t->title[n++] = (char)*p;
+        t->title[n] = '\0';
+    }
+}
+
+/* C0 controls are executed in every state but OSC and strings. */
+static void
+vp_term_control(vp_term_t *t, int c)
+{
+    switch (c) {
+    case '\b':
+        if (t->cur.x > 0)
+            --t->cur.x;
+        t->cur.wrapnext = 0;
+        break;
+    case '\t':
+        t->cur.x = (t->cur.x / 8 + 1) * 8;
+        if (t->cur.x >= t->cols)
+            t->cur.x = t->cols - 1;
+        break;
+    case '\n': case '\v': case '\f':
+        vp_term_linefeed(t);
+        t->cur.wrapnext = 0;
+        break;
+    case '\r':
+        t->cur.x = 0;
+        t->cur.wrapnext = 0;
+        break;
+    case 0x0E:  /* SO */
+        t->cur.gl = 1;
+        break;
+    case 0x0F:  /* SI */
+        t->cur.gl = 0;
+        break;
+    case 0x18: case 0x1A:   /* CAN, SUB */
+        t->state = VP_TERM_GROUND;
+        break;
+    }
+}
+
+static void
+vp_term_byte(vp_term_t *t, int c)
+{
+    if (t->state == VP_TERM_OSC || t->state == VP_TERM_STRING) {
+        if (c == 0x07 || c == 0x1B || c == 0x18 || c == 0x1A) {
+            if (t->state == VP_TERM_OSC && c != 0x18 && c != 0x1A)
+                vp_term_osc(t);
+            t->state = (c == 0x1B) ? VP_TERM_ESC : VP_TERM_GROUND;
+            t->intermediate = 0;
+        } else if (t->state == VP_TERM_OSC && t->nosc < sizeof(t->osc) - 1) {
+            t->osc[t->nosc++] = (char)c;
+        }
+        return;
+    }
+    if (c == 0x1B) {
+        t->state = VP_TERM_ESC;
+        t->intermediate = 0;
+        return;
+    }
+    if (c < 0x20 || c == 0x7F) {
+        if (c != 0x7F)
+            vp_term_control(t, c);
+        return;
+    }
+
+    switch (t->state) {
+    case VP_TERM_GROUND:
+        vp_term_put(t, c);
+        break;
+    case VP_TERM_ESC:
+        if (c == '[') {
+            t->state = VP_TERM_CSI;
+            t->nparams = 0;
+            t->params[0] = 0;
+            t->private = 0;
+            t->intermediate = 0;
+        } else if (c == ']') {
+            t->state = VP_TERM_OSC;
+            t->nosc = 0;
+        } else if (c == 'P' || c == 'X' || c == '^' || c == '_') {
+            t->state = VP_TERM_STRING;
+        } else if (c >= 0x20 && c <= 0x2F) {
+            t->intermediate = c;
+            t->state = VP_TERM_ESC_INT;
+        } else {
+            t->state = VP_TERM_GROUND;
+            vp_term_esc(t, c);
+        }
+        break;
+    case VP_TERM_ESC_INT:
+        if (c >= 0x30) {
+            t->state = VP_TERM_GROUND;
+            vp_term_esc(t, c);
+        }
+        break;
+    case VP_TERM_CSI:
+        if (c >= '0' && c <= '9') {
+            int *p;
+
+            if (t->nparams == 0)
+                t->nparams = 1;
+            p = &t->params[t->nparams - 1];
+            if (*p < 10000)
+                *p = *p * 10 + (c - '0');
+        } else if (c == ';' || c == ':') {
+            if (t->nparams == 0)
+                t->nparams = 1;
+            if (t->nparams < VP_TERM_NPARAM)
+                t->params[t->nparams++] = 0;
+        } else if (c >= '<' && c <= '?') {
+            t->private = c;
+        } else if (c >= 0x20 && c <= 0x2F) {
+            t->intermediate = c;
+        } else if (c >= 0x40 && c <= 0x7E) {
+            t->state = VP_TERM_GROUND;
+            vp_term_csi(t, c);
+        }
+        break;
+    }
+}
+
+static void
+vp_term_parse(vp_term_t *t, const char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)buf[i];
+
+        if (t->u8need > 0) {
+            if ((c & 0xC0) == 0x80) {
+                t->u8cp = (t->u8cp << 6) | (c & 0x3F);
+                if (--t->u8need == 0)
+                    vp_term_put(t, t->u8cp);
+                continue;
+            }
+            t->u8need = 0;
+            vp_term_put(t, 0xFFFD);
+        }
+        if (c < 0x80 || t->state != VP_TERM_GROUND) {
+            if (c < 0x80)
+                vp_term_byte(t, c);
+            else if (t->state == VP_TERM_OSC && t->nosc < sizeof(t->osc) - 1)
+                t->osc[t->nosc++] = (char)c;
+        } else if (c >= 0xC2 && c <= 0xDF) {
+            t->u8cp = c & 0x1F;
+            t->u8need = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            t->u8cp = c & 0x0F;
+            t->u8need = 2;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            t->u8cp = c & 0x07;
+            t->u8need = 3;
+        } else {
+            vp_term_put(t, 0xFFFD);
+        }
+    }
+}
+
+static void
+vp_term_free(vp_term_t *t)
+{
+    int i;
+
+    if (t == NULL)
+        return;
+    for (i = 0; i < t->sb_cap; ++i)
+        free(t->sb[i].cells);
+    free(t->sb);
+    free(t->main);
+    free(t->alt);
+    free(t->dirty);
+    free(t);
+}
+
+static vp_term_t *
+vp_term_new(int cols, int rows, int scrollback)
+{
+    vp_term_t *t;
+
+    if (cols <= 0 || rows <= 0 || scrollback < 0)
+        return NULL;
+    if ((t = calloc(1, sizeof(vp_term_t))) == NULL)
+        return NULL;
+    t->cols = cols;
+    t->rows = rows;
+    t->sb_cap = scrollback;
+    t->main = malloc((size_t)cols * rows * sizeof(vp_cell_t));
+    t->alt = malloc((size_t)cols * rows * sizeof(vp_cell_t));
+    t->dirty = malloc(rows);
+    t->sb = calloc(scrollback + 1, sizeof(vp_sbline_t));
+    if (t->main == NULL || t->alt == NULL || t->dirty == NULL
+            || t->sb == NULL) {
+        vp_term_free(t);
+        return NULL;
+    }
+    vp_term_reset(t);
+    return t;
+}
+
+/* The top left corner is kept; if the cursor would fall off the bottom,
+ * the top lines go to the scrollback instead. */
+static int
+vp_term_resize_screen(vp_term_t *t, int cols, int rows)
+{
+    vp_cell_t *main, *alt;
+    unsigned char *dirty;
+    int shift = 0;
+    int y, n;
+
+    if (cols <= 0 || rows <= 0)
+        return -1;
+    main = malloc((size_t)cols * rows * sizeof(vp_cell_t));
+    alt = malloc((size_t)cols * rows * sizeof(vp_cell_t));
+    dirty = malloc(rows);
+    if (main == NULL || alt == NULL || dirty == NULL) {
+        free(main);
+        free(alt);
+        free(dirty);
+        return -1;
+    }
+    vp_term_fill(main, (size_t)cols * rows, &vp_term_blank);
+    vp_term_fill(alt, (size_t)cols * rows, &vp_term_blank);
+
+    if (t->screen == t->main && t->cur.y >= rows) {
+        shift = t->cur.y - rows + 1;
+        for (y = 0; y < shift; ++y)
+            vp_term_sb_push(t, &t->main[(size_t)y * t->cols]);
+    }
+    n = (cols < t->cols) ? cols : t->cols;
+    for (y = 0; y < rows && y + shift < t->rows; ++y) {
+        memcpy(&main[(size_t)y * cols],
+                &t->main[(size_t)(y + shift) * t->cols],
+                n * sizeof(vp_cell_t));
+        memcpy(&alt[(size_t)y * cols],
+                &t->alt[(size_t)(y + shift) * t->cols],
+                n * sizeof(vp_cell_t));
+    }
+    t->screen = (t->screen == t->main) ? main : alt;
+    free(t->main);
+    free(t->alt);
+    free(t->dirty);
+    t->main = main;
+    t->alt = alt;
+    t->dirty = dirty;
+    t->cols = cols;
+    t->rows = rows;
+
+    t->top = 0;
+    t->bottom = rows - 1;
+    t->cur.y -= shift;
+    t->saved.y = (t->saved.y < shift) ? 0 : t->saved.y - shift;
+    if (t->cur.x >= cols)
+        t->cur.x = cols - 1;
+    if (t->cur.y >= rows)
+        t->cur.y = rows - 1;
+    t->cur.wrapnext = 0;
+    vp_term_dirty(t, 0, rows - 1);
+    return 0;
+}
+
+/* Row y of the screen, or of the scrollback if negative (-1 is the
+ * newest line).  Empty scrollback lines have no cells. */
+static int
+vp_term_line(vp_term_t *t, int y, const vp_cell_t **cells, int *len)
+{
+    if (y >= 0) {
+        if (y >= t->rows)
+            return -1;
+        *cells = VP_TERM_CELL(t, y, 0);
+        *len = t->cols;
+        return 0;
+    }
+    if (-y > t->sb_count)
+        return -1;
+    y = (t->sb_head + y + t->sb_cap) % t->sb_cap;
+    *cells = t->sb[y].cells;
+    *len = t->sb[y].len;
+    return 0;
+}
+
+/*
+ * Copy the screen of src to dst, marking the rows of dst which change.
+ * Lines src scrolled off since the last call go to the scrollback of
+ * dst.  Both must have the same size.
+ */
+static void
+vp_term_sync(vp_term_t *dst, vp_term_t *src)
+{
+    const vp_cell_t *cells;
+    int n, y, len;
+
+    for (n = src->sb_new; n > 0; --n)
+        if (vp_term_line(src, -n, &cells, &len) == 0) {
+            vp_cell_t *line = malloc(dst->cols * sizeof(vp_cell_t));
+
+            if (line == NULL)
+                continue;
+            vp_term_fill(line, dst->cols, &vp_term_blank);
+            if (len > 0)
+                memcpy(line, cells, (len < dst->cols ? len : dst->cols)
+                        * sizeof(vp_cell_t));
+            vp_term_sb_push(dst, line);
+            free(line);
+        }
+    src->sb_new = 0;
+
+    if ((src->screen == src->alt) != (dst->screen == dst->alt))
+        vp_term_dirty(dst, 0, dst->rows - 1);
+    for (y = 0; y < dst->rows; ++y) {
+        size_t off = (size_t)y * dst->cols;
+
+        if (memcmp(&src->screen[off], &dst->screen[off],
+                    dst->cols * sizeof(vp_cell_t)) != 0)
+            dst->dirty[y] = 1;
+    }
+    memcpy(dst->main, src->main,
+            (size_t)dst->rows * dst->cols * sizeof(vp_cell_t));
+    memcpy(dst->alt, src->alt,
+            (size_t)dst->rows * dst->cols * sizeof(vp_cell_t));
+    dst->screen = (src->screen == src->alt) ? dst->alt : dst->main;
+
+    dst->cur = src->cur;
+    dst->saved = src->saved;
+    dst->saved_alt = src->saved_alt;
+    dst->top = src->top;
+    dst->bottom = src->bottom;
+    dst->autowrap = src->autowrap;
+    dst->insert = src->insert;
+    dst->cursor_visible = src->cursor_visible;
+    dst->last = src->last;
+    memcpy(dst->title, src->title, sizeof(dst->title));
+}
+
+static size_t
+vp_term_utf8(char *p, unsigned int ch)
+{
+    if (ch < 0x80) {
+        p[0] = (char)ch;
+        return 1;
+    } else if (ch < 0x800) {
+        p[0] = (char)(0xC0 | ch >> 6);
+        p[1] = (char)(0x80 | (ch & 0x3F));
+        return 2;
+    } else if (ch < 0x10000) {
+        p[0] = (char)(0xE0 | ch >> 12);
+        p[1] = (char)(0x80 | (ch >> 6 & 0x3F));
+        p[2] = (char)(0x80 | (ch & 0x3F));
+        return 3;
+    }
+    p[0] = (char)(0xF0 | ch >> 18);
+    p[1] = (char)(0x80 | (ch >> 12 & 0x3F));
+    p[2] = (char)(0x80 | (ch >> 6 & 0x3F));
+    p[3] = (char)(0x80 | (ch & 0x3F));
+    return 4;
+}
+
+/*
+ * Encode cells as UTF-8 text and attribute runs.  Trailing blanks are
+ * dropped.  Runs cover the cells which are not in the default colors,
+ * as "col len fg bg attr" with a 1-based byte column, separated by
+ * spaces.
+ */
+static void
+vp_term_encode(const vp_cell_t *cells, int n, char *text, char *runs)
+{
+    char *p = text, *r = runs;
+    int run = -1;       /* first cell of the current run */
+    size_t run_col = 0;
+    int x;
+
+    while (n > 0 && memcmp(&cells[n - 1], &vp_term_blank,
+                sizeof(vp_cell_t)) == 0)
+        --n;
+
+    for (x = 0; x <= n; ++x) {
+        const vp_cell_t *c = (x < n) ? &cells[x] : NULL;
+
+        if (run >= 0 && (c == NULL || c->fg != cells[run].fg
+                    || c->bg != cells[run].bg
+                    || c->attr != cells[run].attr)) {
+            r += sprintf(r, "%s%lu %lu %d %d %d", (r == runs) ? "" : " ",
+                    (unsigned long)run_col + 1,
+                    (unsigned long)((p - text) - run_col),
+                    cells[run].fg, cells[run].bg, cells[run].attr);
+            run = -1;
+        }
+        if (c == NULL)
+            break;
+        if (run < 0 && (c->fg != -1 || c->bg != -1 || c->attr != 0)) {
+            run = x;
+            run_col = p - text;
+        }
+        if (c->ch == VP_TERM_WIDE)
+            continue;
+        p += vp_term_utf8(p, (c->ch == 0) ? ' ' : c->ch);
+    }
+    *p = '\0';
+    *r = '\0';
+}